@@ -1,14 +1,539 @@
 #include <iostream>
+#ifdef _WIN32
 #include <windows.h>
+#endif
 #include <sql.h>
 #include <sqlext.h>
 #include <string>
 #include <iomanip>
 #include <limits>
 #include <cstdio>
+#include <cstdarg>
 #include <vector>
+#include <unordered_map>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <thread>
+#include <algorithm>
+#include <list>
+#include <cstdint>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <future>
+#include <cerrno>
+#include <ctime>
+#include <cmath>
+#include <climits>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CHEMDB_SSE2 1
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#endif
 using namespace std;
 
+// One row of dbo.Elements held in memory
+struct ElementRecord {
+    string symbol;
+    string name;
+    int charge = 0;
+    bool hasCharge = false;
+    double atomicWeight = 0.0;
+    int atomicNumber = 0;
+    bool hasAtomicNumber = false;
+};
+
+// One row of dbo.Cations or dbo.Anions held in memory
+struct IonRecord {
+    string symbol;
+    string name;
+    int charge = 0;
+    double atomicWeight = 0.0;
+};
+
+// Field-by-field comparisons used to skip unchanged rows on refresh
+inline bool sameRecord(const ElementRecord& a, const ElementRecord& b) {
+    return a.symbol == b.symbol && a.name == b.name && a.charge == b.charge && a.hasCharge == b.hasCharge &&
+           a.atomicWeight == b.atomicWeight && a.atomicNumber == b.atomicNumber &&
+           a.hasAtomicNumber == b.hasAtomicNumber;
+}
+
+inline bool sameRecord(const IonRecord& a, const IonRecord& b) {
+    return a.symbol == b.symbol && a.name == b.name && a.charge == b.charge && a.atomicWeight == b.atomicWeight;
+}
+
+// Function to compare symbols the way the server's default collation orders them
+static bool symbolLess(const string& a, const string& b) {
+    size_t n = min(a.size(), b.size());
+    for (size_t i = 0; i < n; i++) {
+        int x = toupper((unsigned char)a[i]), y = toupper((unsigned char)b[i]);
+        if (x != y) {
+            return x < y;
+        }
+    }
+    return a.size() < b.size();
+}
+
+// Listing order of full loads: elements by atomic number, ions by symbol
+inline bool listingLess(const ElementRecord& a, const ElementRecord& b) {
+    return a.atomicNumber < b.atomicNumber;
+}
+
+inline bool listingLess(const IonRecord& a, const IonRecord& b) {
+    return symbolLess(a.symbol, b.symbol);
+}
+
+// Rows kept in listing order plus a hash index keyed by the upper-cased symbol
+template <typename Record>
+struct ReferenceTable {
+    vector<Record> rows;
+    unordered_map<string, size_t> index;
+
+    void clear() {
+        rows.clear();
+        index.clear();
+    }
+
+    void add(const Record& record) {
+        string key = record.symbol;
+        for (char &c : key) {
+            c = toupper(c);
+        }
+        // Keep the first row for a symbol, like the TOP 1 lookups did
+        if (index.emplace(key, rows.size()).second) {
+            rows.push_back(record);
+        }
+    }
+
+    // Insert or replace the row for a symbol; new symbols go last. Returns
+    // the row number, or -1 when the row was already identical.
+    long upsert(const Record& record) {
+        string key = record.symbol;
+        for (char &c : key) {
+            c = toupper(c);
+        }
+        auto inserted = index.emplace(key, rows.size());
+        if (inserted.second) {
+            rows.push_back(record);
+            return (long)rows.size() - 1;
+        }
+        Record& existing = rows[inserted.first->second];
+        if (sameRecord(existing, record)) {
+            return -1;
+        }
+        existing = record;
+        return (long)inserted.first->second;
+    }
+
+    // Function to put the rows back in listing order after upserts added
+    // or renumbered some. Returns true when rows moved, which invalidates
+    // every row number handed out before.
+    bool restoreOrder() {
+        auto less = [](const Record& a, const Record& b) { return listingLess(a, b); };
+        if (is_sorted(rows.begin(), rows.end(), less)) {
+            return false;
+        }
+        stable_sort(rows.begin(), rows.end(), less);
+        index.clear();
+        for (size_t i = 0; i < rows.size(); i++) {
+            string key = rows[i].symbol;
+            for (char &c : key) {
+                c = toupper(c);
+            }
+            index.emplace(key, i);
+        }
+        return true;
+    }
+
+    // Expects an upper-cased symbol, as the menu code already produces
+    const Record* find(const string& upperSymbol) const {
+        auto it = index.find(upperSymbol);
+        return it == index.end() ? nullptr : &rows[it->second];
+    }
+};
+
+// One row of dbo.Thermodynamics: standard values for a species with its
+// phase, e.g. "H2O(l)". Enthalpy and Gibbs in kJ/mol, entropy in kJ/(mol K).
+struct ThermoRecord {
+    string species;
+    double enthalpy = 0.0;
+    double entropy = 0.0;
+    double gibbs = 0.0;
+};
+
+// Thermodynamic rows indexed by exact species text; case is significant
+// here because "Co(s)" and "CO(g)" are different species
+struct ThermoTable {
+    vector<ThermoRecord> rows;
+    unordered_map<string, size_t> index;
+
+    void clear() {
+        rows.clear();
+        index.clear();
+    }
+
+    void add(const ThermoRecord& record) {
+        if (index.emplace(record.species, rows.size()).second) {
+            rows.push_back(record);
+        }
+    }
+
+    const ThermoRecord* find(const string& species) const {
+        auto it = index.find(species);
+        return it == index.end() ? nullptr : &rows[it->second];
+    }
+};
+
+// One row of dbo.Isotopes: a naturally occurring isotope with its exact
+// mass in u and its abundance as a fraction of the element
+struct IsotopeRecord {
+    string symbol;
+    int massNumber = 0;
+    double mass = 0.0;
+    double abundance = 0.0;
+};
+
+// Isotopes grouped per element, keyed by upper-cased symbol like the
+// element table, in ascending mass number
+struct IsotopeTable {
+    unordered_map<string, vector<IsotopeRecord>> elements;
+    size_t count = 0;
+
+    void clear() {
+        elements.clear();
+        count = 0;
+    }
+
+    void add(const IsotopeRecord& record) {
+        string key = record.symbol;
+        for (char &c : key) {
+            c = toupper(c);
+        }
+        vector<IsotopeRecord>& isotopes = elements[key];
+        auto at = upper_bound(isotopes.begin(), isotopes.end(), record,
+                              [](const IsotopeRecord& a, const IsotopeRecord& b) { return a.massNumber < b.massNumber; });
+        isotopes.insert(at, record);
+        count++;
+    }
+
+    const vector<IsotopeRecord>* find(const string& symbol) const {
+        string key = symbol;
+        for (char &c : key) {
+            c = toupper(c);
+        }
+        auto it = elements.find(key);
+        return it == elements.end() ? nullptr : &it->second;
+    }
+};
+
+// Tables that can be refreshed while running
+enum RefTable {
+    RefElements,
+    RefCations,
+    RefAnions,
+    RefTableCount
+};
+
+// Last seen state of one source table. version is MAX(RowVer) when the
+// table has a rowversion column, else a checksum or file stamp; -1 means
+// unknown and forces a full reload on the next refresh.
+struct TableVersion {
+    long long rows = -1;
+    long long version = -1;
+    bool hasRowVersion = false;
+};
+
+// Elements, Cations and Anions loaded once right after connecting, plus
+// Thermodynamics and Isotopes when those tables exist. generation goes up with every
+// applied refresh so derived caches know when to rebuild.
+struct ReferenceData {
+    ReferenceTable<ElementRecord> elements;
+    ReferenceTable<IonRecord> cations;
+    ReferenceTable<IonRecord> anions;
+    ThermoTable thermo;
+    IsotopeTable isotopes;
+    bool loaded = false;
+    bool thermoLoaded = false;
+    bool isotopesLoaded = false;
+    unsigned long generation = 0;
+    TableVersion versions[RefTableCount];
+
+    const ReferenceTable<IonRecord>& ions(bool isCation) const {
+        return isCation ? cations : anions;
+    }
+};
+
+// Function to quote text as a JSON string
+static string jsonQuote(const string& text) {
+    string out = "\"";
+    for (char c : text) {
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if ((unsigned char)c < 0x20) {
+                    char escaped[8];
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    out += escaped;
+                } else {
+                    out += c;
+                }
+        }
+    }
+    return out + "\"";
+}
+
+// Phases timed by the instrumentation layer
+enum TracePhase {
+    TraceConnect,
+    TracePrepare,
+    TraceExecute,
+    TraceFetch,
+    TraceConvert,
+    TraceOutput,
+    TraceLookup,
+    TraceRequest,
+    TracePhaseCount
+};
+
+static const char* tracePhaseNames[TracePhaseCount] = {
+    "connect", "prepare", "execute", "fetch", "convert", "output", "lookup", "request"
+};
+
+// Power-of-two nanosecond buckets: bucket b holds [2^(b-1), 2^b) ns
+const int TRACE_BUCKETS = 48;
+
+// Plain latency histogram used for merging and reporting
+struct PhaseHistogram {
+    uint64_t count = 0;
+    uint64_t totalNs = 0;
+    uint64_t maxNs = 0;
+    uint64_t buckets[TRACE_BUCKETS] = {0};
+
+    // Upper bound of the bucket holding the given percentile
+    double percentileUs(double pct) const {
+        if (count == 0) {
+            return 0.0;
+        }
+        uint64_t rank = (uint64_t)(pct / 100.0 * (count - 1)) + 1;
+        uint64_t seen = 0;
+        for (int b = 0; b < TRACE_BUCKETS; b++) {
+            seen += buckets[b];
+            if (seen >= rank) {
+                return min((double)(1ULL << b), (double)maxNs) / 1000.0;
+            }
+        }
+        return maxNs / 1000.0;
+    }
+};
+
+// Per-thread counters. Only the owning thread writes them, so relaxed
+// load/store pairs are enough and the summary can read them while running.
+struct ThreadTraceStats {
+    struct Counters {
+        atomic<uint64_t> count{0};
+        atomic<uint64_t> totalNs{0};
+        atomic<uint64_t> maxNs{0};
+        atomic<uint64_t> buckets[TRACE_BUCKETS] = {};
+    };
+    Counters phases[TracePhaseCount];
+
+    ThreadTraceStats();
+    ~ThreadTraceStats();
+
+    void record(TracePhase phase, uint64_t ns) {
+        Counters& c = phases[phase];
+        int bucket = 0;
+        for (uint64_t v = ns; v != 0 && bucket < TRACE_BUCKETS - 1; v >>= 1) {
+            bucket++;
+        }
+        c.count.store(c.count.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        c.totalNs.store(c.totalNs.load(memory_order_relaxed) + ns, memory_order_relaxed);
+        if (ns > c.maxNs.load(memory_order_relaxed)) {
+            c.maxNs.store(ns, memory_order_relaxed);
+        }
+        c.buckets[bucket].store(c.buckets[bucket].load(memory_order_relaxed) + 1, memory_order_relaxed);
+    }
+
+    void mergeInto(PhaseHistogram* out) const {
+        for (int p = 0; p < TracePhaseCount; p++) {
+            const Counters& c = phases[p];
+            out[p].count += c.count.load(memory_order_relaxed);
+            out[p].totalNs += c.totalNs.load(memory_order_relaxed);
+            out[p].maxNs = max(out[p].maxNs, c.maxNs.load(memory_order_relaxed));
+            for (int b = 0; b < TRACE_BUCKETS; b++) {
+                out[p].buckets[b] += c.buckets[b].load(memory_order_relaxed);
+            }
+        }
+    }
+};
+
+// Live threads register here; exiting threads fold into traceRetired
+static mutex traceRegistryMutex;
+static vector<ThreadTraceStats*> traceThreads;
+static PhaseHistogram traceRetired[TracePhaseCount];
+
+// Structured trace lines on stderr, toggled with --trace or CHEMDB_TRACE=1
+static atomic<bool> traceEnabled{false};
+
+ThreadTraceStats::ThreadTraceStats() {
+    lock_guard<mutex> lock(traceRegistryMutex);
+    traceThreads.push_back(this);
+}
+
+ThreadTraceStats::~ThreadTraceStats() {
+    lock_guard<mutex> lock(traceRegistryMutex);
+    mergeInto(traceRetired);
+    traceThreads.erase(find(traceThreads.begin(), traceThreads.end(), this));
+}
+
+static ThreadTraceStats& threadTraceStats() {
+    static thread_local ThreadTraceStats stats;
+    return stats;
+}
+
+// Function to emit a structured trace event when tracing is on
+static void traceEvent(const char* event, const string& detail) {
+    if (traceEnabled.load(memory_order_relaxed)) {
+        fprintf(stderr, "trace {\"event\":\"%s\",\"detail\":%s}\n", event, jsonQuote(detail).c_str());
+    }
+}
+
+// Times one phase for as long as it is in scope
+class TraceScope {
+public:
+    explicit TraceScope(TracePhase phase, const char* detail = nullptr)
+        : phase(phase), detail(detail), start(chrono::steady_clock::now()) {}
+
+    ~TraceScope() {
+        uint64_t ns = (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+        threadTraceStats().record(phase, ns);
+        if (traceEnabled.load(memory_order_relaxed)) {
+            fprintf(stderr, "trace {\"phase\":\"%s\",\"us\":%.3f,\"detail\":%s}\n", tracePhaseNames[phase],
+                    ns / 1000.0, detail ? jsonQuote(detail).c_str() : "null");
+        }
+    }
+
+private:
+    TracePhase phase;
+    const char* detail;
+    chrono::steady_clock::time_point start;
+};
+
+// Function to merge the histograms of every thread seen so far
+static void collectTraceStats(PhaseHistogram* out) {
+    lock_guard<mutex> lock(traceRegistryMutex);
+    for (int p = 0; p < TracePhaseCount; p++) {
+        out[p] = traceRetired[p];
+    }
+    for (const ThreadTraceStats* stats : traceThreads) {
+        stats->mergeInto(out);
+    }
+}
+
+// Function to print per-phase latency for every phase that ran
+void printTraceSummary(FILE* out) {
+    PhaseHistogram phases[TracePhaseCount];
+    collectTraceStats(phases);
+
+    fprintf(out, "\nLatency by phase:\n");
+    fprintf(out, "------------------------------------------------------------------------\n");
+    fprintf(out, "%-8s | %8s | %10s | %10s | %10s | %10s | %10s\n",
+            "Phase", "Count", "Total ms", "Mean us", "p50 us", "p99 us", "Max us");
+    fprintf(out, "------------------------------------------------------------------------\n");
+    for (int p = 0; p < TracePhaseCount; p++) {
+        const PhaseHistogram& h = phases[p];
+        if (h.count == 0) {
+            continue;
+        }
+        fprintf(out, "%-8s | %8llu | %10.3f | %10.3f | %10.3f | %10.3f | %10.3f\n", tracePhaseNames[p],
+                (unsigned long long)h.count, h.totalNs / 1e6, h.totalNs / 1000.0 / h.count,
+                h.percentileUs(50), h.percentileUs(99), h.maxNs / 1000.0);
+    }
+    fprintf(out, "------------------------------------------------------------------------\n");
+}
+
+// Function to report the same summary as one JSON object
+string traceSummaryJson() {
+    PhaseHistogram phases[TracePhaseCount];
+    collectTraceStats(phases);
+
+    string out = "{";
+    char buffer[256];
+    for (int p = 0; p < TracePhaseCount; p++) {
+        const PhaseHistogram& h = phases[p];
+        snprintf(buffer, sizeof(buffer),
+                 "%s\"%s\":{\"count\":%llu,\"totalMs\":%.3f,\"p50Us\":%.3f,\"p99Us\":%.3f,\"maxUs\":%.3f}",
+                 p ? "," : "", tracePhaseNames[p], (unsigned long long)h.count, h.totalNs / 1e6,
+                 h.percentileUs(50), h.percentileUs(99), h.maxNs / 1000.0);
+        out += buffer;
+    }
+    return out + "}";
+}
+
+// Symbol lookups that are prepared once per connection
+enum LookupQuery {
+    ElementLookup,
+    CationLookup,
+    AnionLookup,
+    LookupQueryCount
+};
+
+// A prepared lookup whose single parameter is bound to symbol
+struct PreparedLookup {
+    SQLHSTMT stmt = SQL_NULL_HSTMT;
+    SQLCHAR symbol[11] = {0}; // Symbol columns are varchar(10)
+    SQLLEN symbolLen = SQL_NTS;
+    unsigned long executions = 0;
+    unsigned long hits = 0;
+    double prepareMs = 0.0;
+};
+
+// Statement handles and row buffers handed back by finished queries.
+// Later queries take them from here instead of allocating their own, so
+// once every fetch path has run once a lookup allocates nothing.
+struct FetchPool {
+    vector<SQLHSTMT> idleStatements;
+    vector<vector<char>> idleBuffers;
+    unsigned long statementsAllocated = 0;
+    unsigned long statementsReused = 0;
+    unsigned long buffersAllocated = 0;
+    unsigned long buffersReused = 0;
+    size_t bufferBytes = 0;
+};
+
+// Per-connection cache of prepared lookups and pooled fetch resources,
+// freed before disconnecting
+struct StatementCache {
+    SQLHDBC dbc = SQL_NULL_HDBC;
+    PreparedLookup lookups[LookupQueryCount];
+    FetchPool pool;
+};
+
+// Connection, loading and diagnostic messages. They move to stderr when
+// results are machine-readable so stdout carries only the results.
+static FILE* statusOut = stdout;
+
 // Function to report ODBC errors
 void show_error(SQLHANDLE handle, SQLSMALLINT type) {
     SQLSMALLINT i = 0;
@@ -18,31 +543,357 @@ void show_error(SQLHANDLE handle, SQLSMALLINT type) {
     SQLSMALLINT len;
     SQLRETURN ret;
 
-    printf("Error occurred:\n");
+    fprintf(statusOut, "Error occurred:\n");
     
     do {
         ret = SQLGetDiagRec(type, handle, ++i, state, &native, text, sizeof(text), &len);
         if (SQL_SUCCEEDED(ret)) {
-            printf("%s:%d:%d:%s\n", state, i, (int)native, text);
+            fprintf(statusOut, "%s:%d:%d:%s\n", state, i, (int)native, text);
         }
     } while (ret == SQL_SUCCESS);
 }
 
-// Function to connect to database
-bool connectToDatabase(SQLHENV &env, SQLHDBC &dbc) {
+// Value kinds of the reference table columns
+enum ColumnType {
+    ColumnText,
+    ColumnInt,
+    ColumnDecimal
+};
+
+// One column as declared in the schema: varchar(size), int or decimal(size, scale)
+struct ColumnSchema {
+    const char* name;
+    ColumnType type;
+    int size;
+    int scale;
+    bool nullable;
+};
+
+// A table the application reads. The connection check compares the catalog
+// with these declarations, and the bulk loader validates seed rows by them.
+struct TableSchema {
+    const char* table;
+    const char* label;
+    bool optional;
+    vector<ColumnSchema> columns;
+};
+
+static const TableSchema tableSchemas[] = {
+    {"dbo.Elements", "Elements", false,
+     {{"Symbol", ColumnText, 10, 0, false},
+      {"Charge", ColumnInt, 0, 0, true},
+      {"Name", ColumnText, 100, 0, false},
+      {"AtomicWeight", ColumnDecimal, 10, 4, false},
+      {"AtomicNumber", ColumnInt, 0, 0, true}}},
+    {"dbo.Cations", "Cations", false,
+     {{"Symbol", ColumnText, 10, 0, false},
+      {"Charge", ColumnInt, 0, 0, false},
+      {"Name", ColumnText, 100, 0, false},
+      {"AtomicWeight", ColumnDecimal, 10, 4, false}}},
+    {"dbo.Anions", "Anions", false,
+     {{"Symbol", ColumnText, 10, 0, false},
+      {"Charge", ColumnInt, 0, 0, false},
+      {"Name", ColumnText, 100, 0, false},
+      {"AtomicWeight", ColumnDecimal, 10, 4, false}}},
+    {"dbo.Thermodynamics", "Thermodynamics", true,
+     {{"Ions", ColumnText, 50, 0, false},
+      {"Enthalpy", ColumnDecimal, 10, 2, false},
+      {"Entropy", ColumnDecimal, 10, 4, false},
+      {"Gibbs", ColumnDecimal, 10, 2, false}}},
+    {"dbo.Isotopes", "Isotopes", true,
+     {{"Symbol", ColumnText, 10, 0, false},
+      {"MassNumber", ColumnInt, 0, 0, false},
+      {"Mass", ColumnDecimal, 14, 10, false},
+      {"Abundance", ColumnDecimal, 9, 8, false}}},
+};
+
+// Function to hash bytes (FNV-1a); used for the snapshot index and
+// checksum and for schema fingerprints
+static uint64_t fnv1aHash(const char* data, size_t length) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Function to describe a declared column the way catalogColumnText does,
+// e.g. "Symbol text(10) not null"
+static string declaredColumnText(const ColumnSchema& column) {
+    char type[32];
+    if (column.type == ColumnText) {
+        snprintf(type, sizeof(type), "text(%d)", column.size);
+    } else if (column.type == ColumnDecimal) {
+        snprintf(type, sizeof(type), "decimal(%d,%d)", column.size, column.scale);
+    } else {
+        snprintf(type, sizeof(type), "int");
+    }
+    return string(column.name) + " " + type + (column.nullable ? " null" : " not null");
+}
+
+// Function to describe a column as INFORMATION_SCHEMA.COLUMNS reports it.
+// Character and integer types are folded into text(n) and int, since the
+// application reads them the same way.
+static string catalogColumnText(const string& name, const string& dataType, long length, long precision,
+                                long scale, bool nullable) {
+    char type[64];
+    if (dataType == "char" || dataType == "varchar" || dataType == "nchar" || dataType == "nvarchar") {
+        snprintf(type, sizeof(type), "text(%ld)", length);
+    } else if (dataType == "int" || dataType == "smallint" || dataType == "tinyint" || dataType == "bigint") {
+        snprintf(type, sizeof(type), "int");
+    } else if (dataType == "decimal" || dataType == "numeric") {
+        snprintf(type, sizeof(type), "decimal(%ld,%ld)", precision, scale);
+    } else {
+        snprintf(type, sizeof(type), "%s", dataType.c_str());
+    }
+    return name + " " + type + (nullable ? " null" : " not null");
+}
+
+// Function to fingerprint a table's columns, given in declared order
+static uint64_t schemaFingerprint(const vector<string>& columns) {
+    string text;
+    for (const string& column : columns) {
+        text += column;
+        text += ';';
+    }
+    return fnv1aHash(text.data(), text.size());
+}
+
+// Function to fingerprint every declared table, derived from tableSchemas
+// on first use so changed declarations re-validate
+static uint64_t expectedSchemaFingerprint() {
+    static const uint64_t fingerprint = []() {
+        vector<string> columns;
+        for (const TableSchema& schema : tableSchemas) {
+            columns.push_back(schema.table);
+            for (const ColumnSchema& column : schema.columns) {
+                columns.push_back(declaredColumnText(column));
+            }
+        }
+        return schemaFingerprint(columns);
+    }();
+    return fingerprint;
+}
+
+// Function to build the catalog queries that validate every table. The
+// checksum query returns one row, a server-side checksum over the declared
+// tables' columns, which is what the local cache remembers; the column
+// query returns one row per column and only runs when that checksum is new.
+static string schemaCatalogSql(bool checksumOnly) {
+    string tables;
+    for (const TableSchema& schema : tableSchemas) {
+        tables += tables.empty() ? "'" : ", '";
+        tables += strchr(schema.table, '.') + 1;
+        tables += "'";
+    }
+    string select = checksumOnly ? "SELECT CHECKSUM_AGG(CHECKSUM(TABLE_NAME, COLUMN_NAME, DATA_TYPE, "
+                                   "CHARACTER_MAXIMUM_LENGTH, NUMERIC_PRECISION, NUMERIC_SCALE, IS_NULLABLE)) "
+                                 : "SELECT TABLE_NAME, COLUMN_NAME, DATA_TYPE, CHARACTER_MAXIMUM_LENGTH, "
+                                   "NUMERIC_PRECISION, NUMERIC_SCALE, IS_NULLABLE ";
+    return select + "FROM INFORMATION_SCHEMA.COLUMNS WHERE TABLE_SCHEMA = 'dbo' AND TABLE_NAME IN (" + tables + ")";
+}
+
+// Where the last validated schema is remembered: CHEMDB_SCHEMA_CACHE, or
+// chemdb\schema under %LOCALAPPDATA% on Windows and chemdb/schema under
+// $XDG_CACHE_HOME or ~/.cache elsewhere. The directory is created on
+// demand; "" when there is nowhere per-user to put it.
+static string schemaCachePath(bool create) {
+    const char* path = getenv("CHEMDB_SCHEMA_CACHE");
+    if (path != nullptr) {
+        return path;
+    }
+#ifdef _WIN32
+    const char* base = getenv("LOCALAPPDATA");
+    if (base == nullptr || *base == '\0') {
+        return "";
+    }
+    string directory = string(base) + "\\chemdb";
+    if (create) {
+        CreateDirectoryA(directory.c_str(), NULL);
+    }
+    return directory + "\\schema";
+#else
+    string base;
+    const char* xdg = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    if (xdg != nullptr && *xdg != '\0') {
+        base = xdg;
+    } else if (home != nullptr && *home != '\0') {
+        base = string(home) + "/.cache";
+    } else {
+        return "";
+    }
+    string directory = base + "/chemdb";
+    if (create) {
+        mkdir(base.c_str(), 0700);
+        mkdir(directory.c_str(), 0700);
+    }
+    return directory + "/schema";
+#endif
+}
+
+// The cache holds one line: connection, expected fingerprint and the
+// server checksum that was validated against it
+static bool schemaCacheMatches(uint64_t connection, uint64_t expected, long checksum) {
+    string path = schemaCachePath(false);
+    FILE* file = path.empty() ? nullptr : fopen(path.c_str(), "r");
+    if (file == nullptr) {
+        return false;
+    }
+    unsigned long long cachedConnection = 0, cachedExpected = 0;
+    long cachedChecksum = 0;
+    bool matches = fscanf(file, "%llx %llx %ld", &cachedConnection, &cachedExpected, &cachedChecksum) == 3 &&
+                   cachedConnection == connection && cachedExpected == expected && cachedChecksum == checksum;
+    fclose(file);
+    return matches;
+}
+
+static void writeSchemaCache(uint64_t connection, uint64_t expected, long checksum) {
+    string path = schemaCachePath(true);
+    FILE* file = path.empty() ? nullptr : fopen(path.c_str(), "w");
+    if (file == nullptr) {
+        return; // only costs a re-validation next time
+    }
+    fprintf(file, "%016llx %016llx %ld\n", (unsigned long long)connection, (unsigned long long)expected, checksum);
+    fclose(file);
+}
+
+// Function to verify the table structure against the catalog. A one-row
+// checksum query runs first; when it matches the cached one for this
+// connection and build, the schema is known good and the column query is
+// skipped. Mismatches are reported as warnings; the application continues
+// anyway.
+static void verifySchema(SQLHDBC dbc, const char* connectionString) {
+    TraceScope trace(TraceExecute, "schema catalog");
+    fprintf(statusOut, "Verifying table structure...\n");
+
+    SQLHSTMT stmt = SQL_NULL_HSTMT;
+    string sql = schemaCatalogSql(true);
+    SQLINTEGER serverChecksum = 0;
+    SQLLEN lenChecksum = SQL_NULL_DATA;
+    if (!SQL_SUCCEEDED(SQLAllocHandle(SQL_HANDLE_STMT, dbc, &stmt)) ||
+        !SQL_SUCCEEDED(SQLExecDirect(stmt, (SQLCHAR*)sql.c_str(), SQL_NTS)) ||
+        !SQL_SUCCEEDED(SQLFetch(stmt)) ||
+        !SQL_SUCCEEDED(SQLGetData(stmt, 1, SQL_C_SLONG, &serverChecksum, 0, &lenChecksum))) {
+        fprintf(statusOut, "Warning: Could not verify table structure.\n");
+        if (stmt != SQL_NULL_HSTMT) {
+            show_error(stmt, SQL_HANDLE_STMT);
+            SQLFreeHandle(SQL_HANDLE_STMT, stmt);
+        }
+        return;
+    }
+    long checksum = lenChecksum == SQL_NULL_DATA ? 0 : (long)serverChecksum;
+
+    uint64_t connection = fnv1aHash(connectionString, strlen(connectionString));
+    uint64_t expected = expectedSchemaFingerprint();
+    if (schemaCacheMatches(connection, expected, checksum)) {
+        SQLFreeHandle(SQL_HANDLE_STMT, stmt);
+        fprintf(statusOut, "Table structure unchanged since last verified.\n");
+        return;
+    }
+
+    // The checksum is new: fetch the columns on the same statement
+    SQLFreeStmt(stmt, SQL_CLOSE);
+    sql = schemaCatalogSql(false);
+    if (!SQL_SUCCEEDED(SQLExecDirect(stmt, (SQLCHAR*)sql.c_str(), SQL_NTS))) {
+        fprintf(statusOut, "Warning: Could not verify table structure.\n");
+        show_error(stmt, SQL_HANDLE_STMT);
+        SQLFreeHandle(SQL_HANDLE_STMT, stmt);
+        return;
+    }
+
+    // Catalog text of each declared column, in declared order; empty if missing
+    size_t tableCount = sizeof(tableSchemas) / sizeof(tableSchemas[0]);
+    vector<vector<string>> found(tableCount);
+    for (size_t t = 0; t < tableCount; t++) {
+        found[t].resize(tableSchemas[t].columns.size());
+    }
+    vector<bool> present(tableCount, false);
+
+    while (SQL_SUCCEEDED(SQLFetch(stmt))) {
+        SQLCHAR table[130], column[130], dataType[130], nullable[4];
+        SQLINTEGER length, precision, scale;
+        SQLLEN lenTable, lenColumn, lenType, lenLength, lenPrecision, lenScale, lenNullable;
+        SQLGetData(stmt, 1, SQL_C_CHAR, table, sizeof(table), &lenTable);
+        SQLGetData(stmt, 2, SQL_C_CHAR, column, sizeof(column), &lenColumn);
+        SQLGetData(stmt, 3, SQL_C_CHAR, dataType, sizeof(dataType), &lenType);
+        SQLGetData(stmt, 4, SQL_C_SLONG, &length, 0, &lenLength);
+        SQLGetData(stmt, 5, SQL_C_SLONG, &precision, 0, &lenPrecision);
+        SQLGetData(stmt, 6, SQL_C_SLONG, &scale, 0, &lenScale);
+        SQLGetData(stmt, 7, SQL_C_CHAR, nullable, sizeof(nullable), &lenNullable);
+        if (lenTable == SQL_NULL_DATA || lenColumn == SQL_NULL_DATA || lenType == SQL_NULL_DATA) {
+            continue;
+        }
+        for (size_t t = 0; t < tableCount; t++) {
+            if (strcmp(strchr(tableSchemas[t].table, '.') + 1, (char*)table) != 0) {
+                continue;
+            }
+            present[t] = true;
+            const vector<ColumnSchema>& columns = tableSchemas[t].columns;
+            for (size_t c = 0; c < columns.size(); c++) {
+                if (strcmp(columns[c].name, (char*)column) == 0) {
+                    found[t][c] = catalogColumnText(columns[c].name, (char*)dataType,
+                                                    lenLength == SQL_NULL_DATA ? 0 : (long)length,
+                                                    lenPrecision == SQL_NULL_DATA ? 0 : (long)precision,
+                                                    lenScale == SQL_NULL_DATA ? 0 : (long)scale,
+                                                    lenNullable != SQL_NULL_DATA && nullable[0] == 'Y');
+                }
+            }
+        }
+    }
+    SQLFreeHandle(SQL_HANDLE_STMT, stmt);
+
+    bool valid = true;
+    for (size_t t = 0; t < tableCount; t++) {
+        const TableSchema& schema = tableSchemas[t];
+        if (!present[t]) {
+            if (!schema.optional) {
+                fprintf(statusOut, "Warning: %s table not found.\n", schema.label);
+                valid = false;
+            }
+            continue;
+        }
+        vector<string> declared;
+        for (const ColumnSchema& column : schema.columns) {
+            declared.push_back(declaredColumnText(column));
+        }
+        if (schemaFingerprint(found[t]) == schemaFingerprint(declared)) {
+            fprintf(statusOut, "%s table structure verified.\n", schema.label);
+            continue;
+        }
+        valid = false;
+        fprintf(statusOut, "Warning: %s table structure doesn't match expected columns.\n", schema.label);
+        for (size_t c = 0; c < declared.size(); c++) {
+            if (found[t][c].empty()) {
+                fprintf(statusOut, "  missing %s\n", declared[c].c_str());
+            } else if (found[t][c] != declared[c]) {
+                fprintf(statusOut, "  found %s, expected %s\n", found[t][c].c_str(), declared[c].c_str());
+            }
+        }
+    }
+    if (valid) {
+        writeSchemaCache(connection, expected, checksum);
+    }
+}
+
+// Function to connect to database. quiet is for extra pooled connections
+// opened in the background: no progress lines and no schema check, which
+// the primary connection has already done.
+bool connectToDatabase(SQLHENV &env, SQLHDBC &dbc, bool quiet = false) {
     SQLRETURN ret;
 
     // Initialize ODBC environment
     ret = SQLAllocHandle(SQL_HANDLE_ENV, SQL_NULL_HANDLE, &env);
     if (!SQL_SUCCEEDED(ret)) {
-        printf("Failed to allocate environment handle.\n");
+        fprintf(statusOut, "Failed to allocate environment handle.\n");
         return false;
     }
     
     // Set ODBC version
     ret = SQLSetEnvAttr(env, SQL_ATTR_ODBC_VERSION, (SQLPOINTER)SQL_OV_ODBC3, 0);
     if (!SQL_SUCCEEDED(ret)) {
-        printf("Failed to set ODBC version.\n");
+        fprintf(statusOut, "Failed to set ODBC version.\n");
         show_error(env, SQL_HANDLE_ENV);
         SQLFreeHandle(SQL_HANDLE_ENV, env);
         return false;
@@ -51,7 +902,7 @@ bool connectToDatabase(SQLHENV &env, SQLHDBC &dbc) {
     // Allocate connection handle
     ret = SQLAllocHandle(SQL_HANDLE_DBC, env, &dbc);
     if (!SQL_SUCCEEDED(ret)) {
-        printf("Failed to allocate connection handle.\n");
+        fprintf(statusOut, "Failed to allocate connection handle.\n");
         show_error(env, SQL_HANDLE_ENV);
         SQLFreeHandle(SQL_HANDLE_ENV, env);
         return false;
@@ -65,532 +916,8540 @@ bool connectToDatabase(SQLHENV &env, SQLHDBC &dbc) {
                                "TrustServerCertificate=Yes;";
     
     // Connect to the database
-    printf("Connecting to database...\n");
-    ret = SQLDriverConnect(dbc, NULL, conn_str, SQL_NTS, NULL, 0, NULL, SQL_DRIVER_NOPROMPT);
+    if (!quiet) {
+        fprintf(statusOut, "Connecting to database...\n");
+    }
+    {
+        TraceScope trace(TraceConnect, "SQLDriverConnect");
+        ret = SQLDriverConnect(dbc, NULL, conn_str, SQL_NTS, NULL, 0, NULL, SQL_DRIVER_NOPROMPT);
+    }
     if (!SQL_SUCCEEDED(ret)) {
-        printf("Failed to connect to database.\n");
+        fprintf(statusOut, "Failed to connect to database.\n");
         show_error(dbc, SQL_HANDLE_DBC);
         SQLFreeHandle(SQL_HANDLE_DBC, dbc);
         SQLFreeHandle(SQL_HANDLE_ENV, env);
         return false;
     }
     
-    printf("Successfully connected to the database!\n");
-    
-    // Verify database structure
-    printf("Verifying table structure...\n");
-    SQLHSTMT stmt = SQL_NULL_HSTMT;
-    
-    // Allocate statement handle
-    ret = SQLAllocHandle(SQL_HANDLE_STMT, dbc, &stmt);
-    if (!SQL_SUCCEEDED(ret)) {
-        printf("Warning: Could not verify table structure.\n");
-        return true; // Continue anyway
+    if (quiet) {
+        return true;
     }
+    fprintf(statusOut, "Successfully connected to the database!\n");
     
-    // Check Elements table structure
-    ret = SQLExecDirect(stmt, (SQLCHAR*)"SELECT TOP 1 Symbol, Charge, Name, AtomicWeight, AtomicNumber FROM dbo.Elements", SQL_NTS);
-    if (!SQL_SUCCEEDED(ret)) {
-        printf("Warning: Elements table structure doesn't match expected columns.\n");
-        show_error(stmt, SQL_HANDLE_STMT);
-    } else {
-        printf("Elements table structure verified.\n");
+    // Verify database structure (continues anyway on mismatches)
+    verifySchema(dbc, (const char*)conn_str);
+    return true;
+}
+
+// SQL text for each prepared lookup
+static const char* lookupSql(LookupQuery which) {
+    switch (which) {
+        case ElementLookup:
+            return "SELECT Symbol, Charge, Name, AtomicWeight, AtomicNumber FROM dbo.Elements WHERE Symbol = ?";
+        case CationLookup:
+            return "SELECT Charge, AtomicWeight FROM dbo.Cations WHERE Symbol = ?";
+        default:
+            return "SELECT Charge, AtomicWeight FROM dbo.Anions WHERE Symbol = ?";
     }
-    
-    // Check Cations table structure
-    SQLFreeStmt(stmt, SQL_CLOSE);
-    ret = SQLExecDirect(stmt, (SQLCHAR*)"SELECT TOP 1 Symbol, Charge, Name, AtomicWeight FROM dbo.Cations", SQL_NTS);
-    if (!SQL_SUCCEEDED(ret)) {
-        printf("Warning: Cations table structure doesn't match expected columns.\n");
-        show_error(stmt, SQL_HANDLE_STMT);
-    } else {
-        printf("Cations table structure verified.\n");
+}
+
+// Function to take an idle statement handle, allocating one only when the pool is empty
+SQLHSTMT acquireStatement(StatementCache& cache) {
+    FetchPool& pool = cache.pool;
+    if (!pool.idleStatements.empty()) {
+        SQLHSTMT stmt = pool.idleStatements.back();
+        pool.idleStatements.pop_back();
+        pool.statementsReused++;
+        return stmt;
     }
-    
-    // Check Anions table structure
-    SQLFreeStmt(stmt, SQL_CLOSE);
-    ret = SQLExecDirect(stmt, (SQLCHAR*)"SELECT TOP 1 Symbol, Charge, Name, AtomicWeight FROM dbo.Anions", SQL_NTS);
-    if (!SQL_SUCCEEDED(ret)) {
-        printf("Warning: Anions table structure doesn't match expected columns.\n");
-        show_error(stmt, SQL_HANDLE_STMT);
-    } else {
-        printf("Anions table structure verified.\n");
+
+    SQLHSTMT stmt = SQL_NULL_HSTMT;
+    if (!SQL_SUCCEEDED(SQLAllocHandle(SQL_HANDLE_STMT, cache.dbc, &stmt))) {
+        fprintf(statusOut, "Failed to allocate statement handle.\n");
+        show_error(cache.dbc, SQL_HANDLE_DBC);
+        return SQL_NULL_HSTMT;
     }
-    
-    SQLFreeHandle(SQL_HANDLE_STMT, stmt);
-    return true;
+    pool.statementsAllocated++;
+    return stmt;
 }
 
-// Function to list available elements
-void listAvailableElements(SQLHDBC dbc) {
-    SQLHSTMT stmt = SQL_NULL_HSTMT;
-    SQLRETURN ret;
-    
-    // Allocate statement handle
-    ret = SQLAllocHandle(SQL_HANDLE_STMT, dbc, &stmt);
-    if (!SQL_SUCCEEDED(ret)) {
-        printf("Failed to allocate statement handle.\n");
-        show_error(dbc, SQL_HANDLE_DBC);
+// Function to hand a statement back to the pool. Its cursor, bindings,
+// parameters and block attributes are reset so the next user starts clean;
+// a handle that refuses any reset is freed instead, since it could still
+// point the driver at a released buffer.
+void releaseStatement(StatementCache& cache, SQLHSTMT stmt) {
+    if (stmt == SQL_NULL_HSTMT) {
         return;
     }
-    
-    // Prepare SQL query
-    string query = "SELECT Symbol, Name FROM dbo.Elements ORDER BY AtomicNumber";
-    
-    ret = SQLExecDirect(stmt, (SQLCHAR*)query.c_str(), SQL_NTS);
-    if (!SQL_SUCCEEDED(ret)) {
-        printf("Failed to execute query.\n");
-        show_error(stmt, SQL_HANDLE_STMT);
+    bool clean = SQL_SUCCEEDED(SQLFreeStmt(stmt, SQL_CLOSE));
+    clean = SQL_SUCCEEDED(SQLFreeStmt(stmt, SQL_UNBIND)) && clean;
+    clean = SQL_SUCCEEDED(SQLFreeStmt(stmt, SQL_RESET_PARAMS)) && clean;
+    clean = SQL_SUCCEEDED(SQLSetStmtAttr(stmt, SQL_ATTR_ROW_ARRAY_SIZE, (SQLPOINTER)1, 0)) && clean;
+    clean = SQL_SUCCEEDED(SQLSetStmtAttr(stmt, SQL_ATTR_ROW_STATUS_PTR, nullptr, 0)) && clean;
+    clean = SQL_SUCCEEDED(SQLSetStmtAttr(stmt, SQL_ATTR_ROWS_FETCHED_PTR, nullptr, 0)) && clean;
+    if (!clean) {
         SQLFreeHandle(SQL_HANDLE_STMT, stmt);
         return;
     }
-    
-    // Variables to hold data
-    SQLCHAR symbol[50] = {0};
-    SQLCHAR name[100] = {0};
-    SQLLEN lenSymbol, lenName;
-    
-    // Display header
-    printf("\nAvailable Elements:\n");
-    printf("------------------------\n");
-    printf("%-10s | %s\n", "Symbol", "Name");
-    printf("------------------------\n");
-    
-    // Fetch and display results
-    while (SQL_SUCCEEDED(ret = SQLFetch(stmt))) {
-        // Get column data
-        SQLGetData(stmt, 1, SQL_C_CHAR, symbol, sizeof(symbol), &lenSymbol);
-        SQLGetData(stmt, 2, SQL_C_CHAR, name, sizeof(name), &lenName);
-        
-        // Print data
-        printf("%-10s | %s\n", 
-            (lenSymbol == SQL_NULL_DATA ? "NULL" : (char*)symbol),
-            (lenName == SQL_NULL_DATA ? "NULL" : (char*)name));
-    }
-    
-    printf("------------------------\n");
-    
-    // Clean up
-    SQLFreeHandle(SQL_HANDLE_STMT, stmt);
+    cache.pool.idleStatements.push_back(stmt);
 }
 
-// Function to get element information by symbol
-void getElementInfo(SQLHDBC dbc) {
-    SQLHSTMT stmt = SQL_NULL_HSTMT;
-    SQLRETURN ret;
-    string symbol, symbolDisplay;
+// Function to take an idle buffer of at least bytes. The smallest one that
+// fits is reused as is; otherwise the largest idle one is grown.
+void acquireBuffer(StatementCache& cache, size_t bytes, vector<char>& buffer) {
+    FetchPool& pool = cache.pool;
+    size_t best = pool.idleBuffers.size();
+    size_t largest = pool.idleBuffers.size();
+    for (size_t i = 0; i < pool.idleBuffers.size(); i++) {
+        size_t capacity = pool.idleBuffers[i].capacity();
+        if (capacity >= bytes && (best == pool.idleBuffers.size() || capacity < pool.idleBuffers[best].capacity())) {
+            best = i;
+        }
+        if (largest == pool.idleBuffers.size() || capacity > pool.idleBuffers[largest].capacity()) {
+            largest = i;
+        }
+    }
 
-    printf("\n=== Element Information Lookup ===\n");
-    
-    // Show available elements
-    listAvailableElements(dbc);
-    
-    printf("Enter element symbol (e.g., H, He, Li): ");
-    cin >> symbol;
+    size_t pick = best != pool.idleBuffers.size() ? best : largest;
+    if (pick != pool.idleBuffers.size()) {
+        buffer.swap(pool.idleBuffers[pick]);
+        pool.idleBuffers[pick].swap(pool.idleBuffers.back());
+        pool.idleBuffers.pop_back();
+    } else {
+        buffer.clear();
+    }
 
-    // Store original casing
-    symbolDisplay = symbol;
-    
-    // Convert to uppercase for consistent matching
-    for (char &c : symbol) {
-        c = toupper(c);
+    size_t before = buffer.capacity();
+    buffer.resize(bytes);
+    if (buffer.capacity() != before) {
+        pool.buffersAllocated++;
+        pool.bufferBytes += buffer.capacity() - before;
+    } else {
+        pool.buffersReused++;
+    }
+}
+
+// Function to hand a buffer back to the pool, keeping its capacity
+void releaseBuffer(StatementCache& cache, vector<char>& buffer) {
+    if (buffer.capacity() == 0) {
+        return;
+    }
+    cache.pool.idleBuffers.emplace_back();
+    cache.pool.idleBuffers.back().swap(buffer);
+}
+
+// Function to execute a cached lookup for a symbol.
+// The statement is prepared and its parameter bound on first use only;
+// the caller closes the cursor with SQLFreeStmt(stmt, SQL_CLOSE).
+SQLHSTMT executeLookup(StatementCache& cache, LookupQuery which, const string& symbol) {
+    PreparedLookup& lookup = cache.lookups[which];
+    SQLRETURN ret;
+
+    if (symbol.size() >= sizeof(lookup.symbol)) {
+        fprintf(statusOut, "Symbol '%s' is longer than the Symbol column.\n", symbol.c_str());
+        return SQL_NULL_HSTMT;
+    }
+
+    if (lookup.stmt == SQL_NULL_HSTMT) {
+        auto start = chrono::steady_clock::now();
+
+        lookup.stmt = acquireStatement(cache);
+        if (lookup.stmt == SQL_NULL_HSTMT) {
+            return SQL_NULL_HSTMT;
+        }
+
+        {
+            TraceScope trace(TracePrepare, lookupSql(which));
+            ret = SQLPrepare(lookup.stmt, (SQLCHAR*)lookupSql(which), SQL_NTS);
+        }
+        if (SQL_SUCCEEDED(ret)) {
+            ret = SQLBindParameter(lookup.stmt, 1, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_VARCHAR,
+                                   sizeof(lookup.symbol) - 1, 0, lookup.symbol, sizeof(lookup.symbol),
+                                   &lookup.symbolLen);
+        }
+        if (!SQL_SUCCEEDED(ret)) {
+            fprintf(statusOut, "Failed to prepare query.\n");
+            show_error(lookup.stmt, SQL_HANDLE_STMT);
+            releaseStatement(cache, lookup.stmt);
+            lookup.stmt = SQL_NULL_HSTMT;
+            return SQL_NULL_HSTMT;
+        }
+
+        lookup.prepareMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    } else {
+        lookup.hits++;
     }
 
-    // Allocate statement handle
-    ret = SQLAllocHandle(SQL_HANDLE_STMT, dbc, &stmt);
+    // The bound buffer is read at execute time, so just overwrite it
+    memcpy(lookup.symbol, symbol.c_str(), symbol.size() + 1);
+    lookup.symbolLen = SQL_NTS;
+    lookup.executions++;
+
+    {
+        TraceScope trace(TraceExecute, lookupSql(which));
+        ret = SQLExecute(lookup.stmt);
+    }
     if (!SQL_SUCCEEDED(ret)) {
-        printf("Failed to allocate statement handle.\n");
-        show_error(dbc, SQL_HANDLE_DBC);
+        fprintf(statusOut, "Failed to execute query.\n");
+        show_error(lookup.stmt, SQL_HANDLE_STMT);
+        SQLFreeStmt(lookup.stmt, SQL_CLOSE);
+        return SQL_NULL_HSTMT;
+    }
+
+    return lookup.stmt;
+}
+
+// Function to free every prepared and pooled statement of a connection
+void releaseStatementCache(StatementCache& cache) {
+    for (PreparedLookup& lookup : cache.lookups) {
+        if (lookup.stmt != SQL_NULL_HSTMT) {
+            SQLFreeHandle(SQL_HANDLE_STMT, lookup.stmt);
+            lookup.stmt = SQL_NULL_HSTMT;
+        }
+    }
+    for (SQLHSTMT stmt : cache.pool.idleStatements) {
+        SQLFreeHandle(SQL_HANDLE_STMT, stmt);
+    }
+    cache.pool = FetchPool();
+}
+
+// Function to print prepared statement usage
+void printStatementCacheStats(const StatementCache& cache) {
+    static const char* names[LookupQueryCount] = { "Elements", "Cations", "Anions" };
+
+    fprintf(statusOut, "\nPrepared statement cache:\n");
+    fprintf(statusOut, "------------------------------------------------\n");
+    fprintf(statusOut, "%-10s | %10s | %10s | %10s\n", "Lookup", "Executions", "Hits", "Prepare ms");
+    fprintf(statusOut, "------------------------------------------------\n");
+    for (int i = 0; i < LookupQueryCount; i++) {
+        const PreparedLookup& lookup = cache.lookups[i];
+        fprintf(statusOut, "%-10s | %10lu | %10lu | %10.3f\n", names[i], lookup.executions, lookup.hits, lookup.prepareMs);
+    }
+    fprintf(statusOut, "------------------------------------------------\n");
+
+    const FetchPool& pool = cache.pool;
+    fprintf(statusOut, "Statement handles: %lu allocated, %lu reused\n", pool.statementsAllocated, pool.statementsReused);
+    fprintf(statusOut, "Row buffers: %lu allocated (%.1f KB), %lu reused\n", pool.buffersAllocated,
+            pool.bufferBytes / 1024.0, pool.buffersReused);
+}
+
+// Rows fetched per SQLFetch call for full-table reads
+const SQLULEN FETCH_BLOCK_ROWS = 256;
+
+// Most columns any block cursor reads
+const size_t MAX_BLOCK_COLUMNS = 8;
+
+// One column-wise bound result column holding a whole block of values.
+// data and lengths point into the cursor's pooled buffer once it is open.
+struct BlockColumn {
+    SQLSMALLINT cType = SQL_C_CHAR;
+    SQLLEN width = 0;
+    char* data = nullptr;
+    SQLLEN* lengths = nullptr;
+};
+
+// Block cursor over a full-table query. Columns are declared with
+// addText/addInt/addDouble before openBlockCursor binds them; their
+// values, lengths and the row status array share one pooled buffer.
+struct RowBlock {
+    SQLHSTMT stmt = SQL_NULL_HSTMT;
+    BlockColumn columns[MAX_BLOCK_COLUMNS];
+    size_t columnCount = 0;
+    SQLUSMALLINT* rowStatus = nullptr;
+    SQLULEN rowsFetched = 0;
+    bool singleRow = false; // driver would not fetch in blocks
+    vector<char> buffer;
+    StatementCache* cache = nullptr;
+
+    void addColumn(SQLSMALLINT cType, SQLLEN width) {
+        if (columnCount < MAX_BLOCK_COLUMNS) {
+            columns[columnCount].cType = cType;
+            columns[columnCount].width = width;
+            columnCount++;
+        }
+    }
+
+    void addText(SQLLEN width) { addColumn(SQL_C_CHAR, width); }
+    void addInt() { addColumn(SQL_C_SLONG, sizeof(SQLINTEGER)); }
+    void addDouble() { addColumn(SQL_C_DOUBLE, sizeof(SQLDOUBLE)); }
+    void addBigInt() { addColumn(SQL_C_SBIGINT, sizeof(long long)); }
+
+    // Column numbers are 0-based here, unlike SQLBindCol
+    bool isNull(size_t col, SQLULEN row) const {
+        return columns[col].lengths[row] == SQL_NULL_DATA;
+    }
+    const char* text(size_t col, SQLULEN row) const {
+        return isNull(col, row) ? "NULL" : &columns[col].data[row * columns[col].width];
+    }
+    int intAt(size_t col, SQLULEN row) const {
+        SQLINTEGER value;
+        memcpy(&value, &columns[col].data[row * columns[col].width], sizeof(value));
+        return (int)value;
+    }
+    long long bigIntAt(size_t col, SQLULEN row) const {
+        long long value;
+        memcpy(&value, &columns[col].data[row * columns[col].width], sizeof(value));
+        return value;
+    }
+    double doubleAt(size_t col, SQLULEN row) const {
+        SQLDOUBLE value;
+        memcpy(&value, &columns[col].data[row * columns[col].width], sizeof(value));
+        return value;
+    }
+    bool rowValid(SQLULEN row) const {
+        return rowStatus[row] == SQL_ROW_SUCCESS || rowStatus[row] == SQL_ROW_SUCCESS_WITH_INFO;
+    }
+};
+
+// Function to release the statement and buffer behind a block cursor
+void closeBlockCursor(RowBlock& block) {
+    if (block.cache == nullptr) {
         return;
     }
+    releaseStatement(*block.cache, block.stmt);
+    releaseBuffer(*block.cache, block.buffer);
+    block.stmt = SQL_NULL_HSTMT;
+    block.rowStatus = nullptr;
+    for (size_t i = 0; i < block.columnCount; i++) {
+        block.columns[i].data = nullptr;
+        block.columns[i].lengths = nullptr;
+    }
+    block.cache = nullptr;
+}
+
+// Function to round a buffer offset up so doubles and SQLLENs stay aligned
+static size_t alignBlockOffset(size_t offset) {
+    return (offset + 7) & ~(size_t)7;
+}
+
+// Function to run a query and bind its columns for block fetching
+bool openBlockCursor(StatementCache& cache, const char* sql, RowBlock& block, bool reportErrors = true) {
+    SQLRETURN ret;
+
+    block.stmt = acquireStatement(cache);
+    if (block.stmt == SQL_NULL_HSTMT) {
+        return false;
+    }
+    block.cache = &cache;
+
+    // Lay out the row status array, then each column's lengths and values
+    size_t bytes = alignBlockOffset(FETCH_BLOCK_ROWS * sizeof(SQLUSMALLINT));
+    for (size_t i = 0; i < block.columnCount; i++) {
+        bytes += FETCH_BLOCK_ROWS * sizeof(SQLLEN);
+        bytes = alignBlockOffset(bytes + block.columns[i].width * FETCH_BLOCK_ROWS);
+    }
+    acquireBuffer(cache, bytes, block.buffer);
+
+    char* base = block.buffer.data();
+    size_t offset = alignBlockOffset(FETCH_BLOCK_ROWS * sizeof(SQLUSMALLINT));
+    block.rowStatus = (SQLUSMALLINT*)base;
+    for (size_t i = 0; i < block.columnCount; i++) {
+        BlockColumn& column = block.columns[i];
+        column.lengths = (SQLLEN*)(base + offset);
+        offset += FETCH_BLOCK_ROWS * sizeof(SQLLEN);
+        column.data = base + offset;
+        offset = alignBlockOffset(offset + column.width * FETCH_BLOCK_ROWS);
+    }
+
+    // A driver without block cursors rejects the array size or substitutes
+    // its own (SQL_SUCCESS_WITH_INFO); read one row per fetch from it instead
+    block.singleRow = SQLSetStmtAttr(block.stmt, SQL_ATTR_ROW_BIND_TYPE, (SQLPOINTER)SQL_BIND_BY_COLUMN, 0) != SQL_SUCCESS ||
+                      SQLSetStmtAttr(block.stmt, SQL_ATTR_ROW_ARRAY_SIZE, (SQLPOINTER)FETCH_BLOCK_ROWS, 0) != SQL_SUCCESS ||
+                      SQLSetStmtAttr(block.stmt, SQL_ATTR_ROW_STATUS_PTR, block.rowStatus, 0) != SQL_SUCCESS ||
+                      SQLSetStmtAttr(block.stmt, SQL_ATTR_ROWS_FETCHED_PTR, &block.rowsFetched, 0) != SQL_SUCCESS;
+    if (block.singleRow) {
+        traceEvent("single-row-fetch", sql);
+        SQLSetStmtAttr(block.stmt, SQL_ATTR_ROW_ARRAY_SIZE, (SQLPOINTER)1, 0);
+        SQLSetStmtAttr(block.stmt, SQL_ATTR_ROW_STATUS_PTR, nullptr, 0);
+        SQLSetStmtAttr(block.stmt, SQL_ATTR_ROWS_FETCHED_PTR, nullptr, 0);
+    }
+
+    for (size_t i = 0; i < block.columnCount; i++) {
+        BlockColumn& column = block.columns[i];
+        ret = SQLBindCol(block.stmt, (SQLUSMALLINT)(i + 1), column.cType, column.data,
+                         column.width, column.lengths);
+        if (!SQL_SUCCEEDED(ret)) {
+            fprintf(statusOut, "Failed to bind result column %zu.\n", i + 1);
+            show_error(block.stmt, SQL_HANDLE_STMT);
+            closeBlockCursor(block);
+            return false;
+        }
+    }
+
+    {
+        TraceScope trace(TraceExecute, sql);
+        ret = SQLExecDirect(block.stmt, (SQLCHAR*)sql, SQL_NTS);
+    }
+    if (!SQL_SUCCEEDED(ret)) {
+        if (reportErrors) {
+            fprintf(statusOut, "Failed to execute query.\n");
+            show_error(block.stmt, SQL_HANDLE_STMT);
+        }
+        closeBlockCursor(block);
+        return false;
+    }
+
+    return true;
+}
+
+// Outcome of fetching a block. A failed fetch must not read as the end of
+// the rows, or a truncated table would be cached as complete.
+enum FetchStatus {
+    FetchRows,
+    FetchEnd,
+    FetchError
+};
+
+// Function to fetch the next block; rowsFetched holds its size
+FetchStatus fetchBlock(RowBlock& block) {
+    block.rowsFetched = 0;
+    SQLRETURN ret;
+    {
+        TraceScope trace(TraceFetch);
+        ret = SQLFetch(block.stmt);
+    }
+    if (ret == SQL_NO_DATA) {
+        return FetchEnd;
+    }
+    if (!SQL_SUCCEEDED(ret)) {
+        fprintf(statusOut, "Error fetching data.\n");
+        show_error(block.stmt, SQL_HANDLE_STMT);
+        return FetchError;
+    }
+    if (block.singleRow) {
+        // Nothing fills the status array or the count for a one-row fetch
+        block.rowStatus[0] = ret == SQL_SUCCESS ? SQL_ROW_SUCCESS : SQL_ROW_SUCCESS_WITH_INFO;
+        block.rowsFetched = 1;
+    }
+    return block.rowsFetched > 0 ? FetchRows : FetchEnd;
+}
+
+
+// Function to load the ion rows of one table into memory. With changed
+// set, only rows matching where are read and merged into the table, and
+// the numbers of rows that differ are appended to changed.
+static bool loadIonTable(StatementCache& statements, bool isCation, ReferenceTable<IonRecord>& table,
+                         const string& where = "", vector<uint32_t>* changed = nullptr) {
+    if (changed == nullptr) {
+        table.clear();
+    }
+
+    string tableName = isCation ? "dbo.Cations" : "dbo.Anions";
+    string query = "SELECT Symbol, Name, Charge, AtomicWeight FROM " + tableName +
+                   (where.empty() ? "" : " WHERE " + where) + " ORDER BY Symbol";
+
+    RowBlock block;
+    block.addText(50);
+    block.addText(100);
+    block.addInt();
+    block.addDouble();
+
+    if (!openBlockCursor(statements, query.c_str(), block)) {
+        fprintf(statusOut, "Failed to load %s.\n", tableName.c_str());
+        return false;
+    }
+
+    FetchStatus fetched;
+    while ((fetched = fetchBlock(block)) == FetchRows) {
+        TraceScope trace(TraceConvert);
+        for (SQLULEN row = 0; row < block.rowsFetched; row++) {
+            if (!block.rowValid(row) || block.isNull(0, row)) {
+                continue;
+            }
+
+            // Same defaults getIonInfo falls back to for NULL columns
+            IonRecord record;
+            record.symbol = block.text(0, row);
+            record.name = block.text(1, row);
+            record.charge = block.isNull(2, row) ? (isCation ? 1 : -1) : block.intAt(2, row);
+            record.atomicWeight = block.isNull(3, row) ? 1.0 : block.doubleAt(3, row);
+            if (changed == nullptr) {
+                table.add(record);
+            } else {
+                long updated = table.upsert(record);
+                if (updated >= 0) {
+                    changed->push_back((uint32_t)updated);
+                }
+            }
+        }
+    }
+
+    closeBlockCursor(block);
+    if (fetched == FetchError) {
+        fprintf(statusOut, "Failed to load %s.\n", tableName.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Function to load the element rows into memory, or merge the rows
+// matching where as loadIonTable does
+static bool loadElementTable(StatementCache& statements, ReferenceTable<ElementRecord>& table,
+                             const string& where = "", vector<uint32_t>* changed = nullptr) {
+    if (changed == nullptr) {
+        table.clear();
+    }
+    string query = "SELECT Symbol, Name, Charge, AtomicWeight, AtomicNumber FROM dbo.Elements" +
+                   (where.empty() ? string() : " WHERE " + where) + " ORDER BY AtomicNumber";
+
+    RowBlock block;
+    block.addText(50);
+    block.addText(100);
+    block.addInt();
+    block.addDouble();
+    block.addInt();
+
+    if (!openBlockCursor(statements, query.c_str(), block)) {
+        fprintf(statusOut, "Failed to load dbo.Elements.\n");
+        return false;
+    }
+
+    FetchStatus fetched;
+    while ((fetched = fetchBlock(block)) == FetchRows) {
+        TraceScope trace(TraceConvert);
+        for (SQLULEN row = 0; row < block.rowsFetched; row++) {
+            if (!block.rowValid(row) || block.isNull(0, row)) {
+                continue;
+            }
+
+            ElementRecord record;
+            record.symbol = block.text(0, row);
+            record.name = block.text(1, row);
+            record.hasCharge = !block.isNull(2, row);
+            record.charge = record.hasCharge ? block.intAt(2, row) : 0;
+            record.atomicWeight = block.isNull(3, row) ? 0.0 : block.doubleAt(3, row);
+            record.hasAtomicNumber = !block.isNull(4, row);
+            record.atomicNumber = record.hasAtomicNumber ? block.intAt(4, row) : 0;
+            if (changed == nullptr) {
+                table.add(record);
+            } else {
+                long updated = table.upsert(record);
+                if (updated >= 0) {
+                    changed->push_back((uint32_t)updated);
+                }
+            }
+        }
+    }
+
+    closeBlockCursor(block);
+    if (fetched == FetchError) {
+        fprintf(statusOut, "Failed to load dbo.Elements.\n");
+        return false;
+    }
+    return true;
+}
+
+// Function to load the thermodynamic rows into memory
+static bool loadThermoTable(StatementCache& statements, ThermoTable& table) {
+    table.clear();
+
+    RowBlock block;
+    block.addText(50);
+    block.addDouble();
+    block.addDouble();
+    block.addDouble();
+
+    // Optional table: a database without it should not print an ODBC error
+    if (!openBlockCursor(statements, "SELECT Ions, Enthalpy, Entropy, Gibbs FROM dbo.Thermodynamics", block, false)) {
+        return false;
+    }
+
+    FetchStatus fetched;
+    while ((fetched = fetchBlock(block)) == FetchRows) {
+        TraceScope trace(TraceConvert);
+        for (SQLULEN row = 0; row < block.rowsFetched; row++) {
+            if (!block.rowValid(row) || block.isNull(0, row)) {
+                continue;
+            }
+
+            ThermoRecord record;
+            record.species = block.text(0, row);
+            record.enthalpy = block.isNull(1, row) ? 0.0 : block.doubleAt(1, row);
+            record.entropy = block.isNull(2, row) ? 0.0 : block.doubleAt(2, row);
+            record.gibbs = block.isNull(3, row) ? 0.0 : block.doubleAt(3, row);
+            table.add(record);
+        }
+    }
+
+    closeBlockCursor(block);
+    return fetched != FetchError;
+}
+
+// Function to load the isotope rows into memory
+static bool loadIsotopeTable(StatementCache& statements, IsotopeTable& table) {
+    table.clear();
+
+    RowBlock block;
+    block.addText(10);
+    block.addInt();
+    block.addDouble();
+    block.addDouble();
+
+    if (!openBlockCursor(statements, "SELECT Symbol, MassNumber, Mass, Abundance FROM dbo.Isotopes", block, false)) {
+        return false;
+    }
+
+    FetchStatus fetched;
+    while ((fetched = fetchBlock(block)) == FetchRows) {
+        TraceScope trace(TraceConvert);
+        for (SQLULEN row = 0; row < block.rowsFetched; row++) {
+            if (!block.rowValid(row) || block.isNull(0, row) || block.isNull(2, row) || block.isNull(3, row)) {
+                continue;
+            }
+
+            IsotopeRecord record;
+            record.symbol = block.text(0, row);
+            record.massNumber = block.isNull(1, row) ? 0 : block.intAt(1, row);
+            record.mass = block.doubleAt(2, row);
+            record.abundance = block.doubleAt(3, row);
+            table.add(record);
+        }
+    }
+
+    closeBlockCursor(block);
+    return fetched != FetchError;
+}
+
+// Function to load Elements, Cations and Anions into memory.
+// On failure the menu keeps working against the database directly.
+bool loadReferenceData(StatementCache& statements, ReferenceData& ref) {
+    fprintf(statusOut, "Loading reference data...\n");
+    ref.loaded = false;
+
+    if (!loadElementTable(statements, ref.elements) ||
+        !loadIonTable(statements, true, ref.cations) ||
+        !loadIonTable(statements, false, ref.anions)) {
+        fprintf(statusOut, "Warning: Could not cache reference data, lookups will query the database.\n");
+        return false;
+    }
+
+    ref.loaded = true;
+    fprintf(statusOut, "Cached %zu elements, %zu cations and %zu anions.\n",
+            ref.elements.rows.size(), ref.cations.rows.size(), ref.anions.rows.size());
+
+    // Thermodynamics is optional; only the reaction features need it
+    ref.thermoLoaded = loadThermoTable(statements, ref.thermo);
+    if (ref.thermoLoaded) {
+        fprintf(statusOut, "Cached %zu thermodynamic species.\n", ref.thermo.rows.size());
+    } else {
+        fprintf(statusOut, "Warning: dbo.Thermodynamics not available, reaction energetics disabled.\n");
+    }
+
+    // Isotopes are optional too; only isotopic patterns need them
+    ref.isotopesLoaded = loadIsotopeTable(statements, ref.isotopes);
+    if (ref.isotopesLoaded) {
+        fprintf(statusOut, "Cached %zu isotopes.\n", ref.isotopes.count);
+    }
+    return true;
+}
+
+// Rows whose numbers changed during a refresh, per table. A reloaded
+// table was replaced wholesale, so its row numbers may all have moved.
+struct RefreshResult {
+    vector<uint32_t> changed[RefTableCount];
+    bool reloaded[RefTableCount] = { false, false, false };
+
+    bool any() const {
+        for (int t = 0; t < RefTableCount; t++) {
+            if (reloaded[t] || !changed[t].empty()) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+static const char* refTableNames[RefTableCount] = { "dbo.Elements", "dbo.Cations", "dbo.Anions" };
+
+// Function to merge a complete fresh copy of a table into a cached one.
+// Returns false when rows were deleted or the merge broke listing order;
+// the caller then replaces the table with the fresh copy.
+template <typename Record>
+bool mergeTableRows(ReferenceTable<Record>& table, const ReferenceTable<Record>& fresh, vector<uint32_t>& changed) {
+    for (const auto& entry : table.index) {
+        if (fresh.index.count(entry.first) == 0) {
+            return false;
+        }
+    }
+    for (const Record& record : fresh.rows) {
+        long row = table.upsert(record);
+        if (row >= 0) {
+            changed.push_back((uint32_t)row);
+        }
+    }
+    if (table.restoreOrder()) {
+        changed.clear();
+        return false;
+    }
+    return true;
+}
+
+// Function to read the row count and version of a table. The RowVer
+// rowversion column is tried first; tables without it fall back to a
+// checksum of every row, which can only trigger a full reload.
+static bool probeTableVersion(StatementCache& statements, RefTable table, TableVersion& version) {
+    string rowVersionSql = string("SELECT COUNT_BIG(*), CAST(MAX(RowVer) AS BIGINT) FROM ") + refTableNames[table];
+    string checksumSql = string("SELECT COUNT_BIG(*), CAST(CHECKSUM_AGG(BINARY_CHECKSUM(*)) AS BIGINT) FROM ") +
+                         refTableNames[table];
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        bool useRowVersion = attempt == 0;
+        RowBlock block;
+        block.addBigInt();
+        block.addBigInt();
+        if (!openBlockCursor(statements, (useRowVersion ? rowVersionSql : checksumSql).c_str(), block, !useRowVersion)) {
+            continue;
+        }
+        bool ok = fetchBlock(block) == FetchRows && block.rowValid(0);
+        if (ok) {
+            version.rows = block.bigIntAt(0, 0);
+            version.version = block.isNull(1, 0) ? 0 : block.bigIntAt(1, 0);
+            version.hasRowVersion = useRowVersion;
+        }
+        closeBlockCursor(block);
+        return ok;
+    }
+    return false;
+}
+
+// Function to probe every table against the versions ref was loaded at
+bool referenceDataChanged(StatementCache& statements, const ReferenceData& ref, bool& changed) {
+    changed = false;
+    for (int t = 0; t < RefTableCount && !changed; t++) {
+        TableVersion probe;
+        if (!probeTableVersion(statements, (RefTable)t, probe)) {
+            return false;
+        }
+        const TableVersion& known = ref.versions[t];
+        changed = probe.rows != known.rows || probe.version != known.version || probe.hasRowVersion != known.hasRowVersion;
+    }
+    return true;
+}
+
+// Function to bring cached tables up to date. Unchanged tables cost one
+// probe; with a rowversion column only rows newer than the last seen
+// version are fetched, otherwise (or after deletes) the table is reloaded.
+// Changed tables are rebuilt in copies and swapped in, with their versions
+// and result, only once every table succeeded; a failure leaves ref as it was.
+bool refreshReferenceData(StatementCache& statements, ReferenceData& ref, RefreshResult& result) {
+    ReferenceTable<ElementRecord> elements;
+    ReferenceTable<IonRecord> cations, anions;
+    TableVersion probes[RefTableCount];
+    bool touched[RefTableCount] = { false, false, false };
+    RefreshResult pending;
+
+    for (int t = 0; t < RefTableCount; t++) {
+        RefTable table = (RefTable)t;
+        TableVersion& probe = probes[t];
+        if (!probeTableVersion(statements, table, probe)) {
+            return false;
+        }
+        const TableVersion& known = ref.versions[t];
+        if (probe.rows == known.rows && probe.version == known.version && probe.hasRowVersion == known.hasRowVersion) {
+            continue;
+        }
+        touched[t] = true;
+
+        bool incremental = probe.hasRowVersion && known.hasRowVersion && known.version >= 0 && probe.rows >= known.rows;
+        string where = incremental ? "CAST(RowVer AS BIGINT) > " + to_string(known.version) : "";
+        vector<uint32_t>* changed = incremental ? &pending.changed[t] : nullptr;
+        // Only a merge needs the current rows; a full reload starts empty
+        if (incremental) {
+            if (table == RefElements) {
+                elements = ref.elements;
+            } else {
+                (table == RefCations ? cations : anions) = ref.ions(table == RefCations);
+            }
+        }
+        bool ok = table == RefElements ? loadElementTable(statements, elements, where, changed)
+                                       : loadIonTable(statements, table == RefCations, table == RefCations ? cations : anions,
+                                                      where, changed);
+        if (!ok) {
+            return false;
+        }
+
+        // A delete plus an insert keeps the count; the merged size gives it away
+        size_t size = table == RefElements ? elements.rows.size() : (table == RefCations ? cations : anions).rows.size();
+        if (incremental && (long long)size != probe.rows) {
+            pending.changed[t].clear();
+            incremental = false;
+            ok = table == RefElements ? loadElementTable(statements, elements)
+                                      : loadIonTable(statements, table == RefCations, table == RefCations ? cations : anions);
+            if (!ok) {
+                return false;
+            }
+        }
+
+        // New symbols were appended; sorting them in moves row numbers
+        if (incremental && (table == RefElements ? elements.restoreOrder()
+                                                 : (table == RefCations ? cations : anions).restoreOrder())) {
+            pending.changed[t].clear();
+            incremental = false;
+        }
+        pending.reloaded[t] = !incremental;
+    }
+
+    if (touched[RefElements]) {
+        ref.elements = std::move(elements);
+    }
+    if (touched[RefCations]) {
+        ref.cations = std::move(cations);
+    }
+    if (touched[RefAnions]) {
+        ref.anions = std::move(anions);
+    }
+    for (int t = 0; t < RefTableCount; t++) {
+        if (touched[t]) {
+            ref.versions[t] = probes[t];
+            result.changed[t] = std::move(pending.changed[t]);
+            result.reloaded[t] = pending.reloaded[t];
+        }
+    }
+    return true;
+}
+
+// Function to copy one field into out with surrounding blanks and quotes removed
+static void trimField(const string& line, size_t begin, size_t end, string& out) {
+    while (begin < end && (isspace((unsigned char)line[begin]) || line[begin] == '"')) {
+        begin++;
+    }
+    while (end > begin && (isspace((unsigned char)line[end - 1]) || line[end - 1] == '"')) {
+        end--;
+    }
+    out.assign(line, begin, end - begin);
+}
+
+// Outcome of a single-row lookup against a storage backend
+enum LookupStatus {
+    LookupFound,
+    LookupNotFound,
+    LookupFailed
+};
+
+// Outcome of an ion lookup that may run in the background
+struct IonLookup {
+    LookupStatus status = LookupFailed;
+    IonRecord ion;
+};
+
+// Where the reference data lives. The menu and batch code only talk to
+// this interface; lookups and listings are used when the tables could not
+// be cached by loadReferenceData.
+class StorageBackend {
+public:
+    virtual ~StorageBackend() {}
+
+    virtual const char* name() const = 0;
+    virtual bool open() = 0;
+    virtual void close() = 0;
+
+    // Whether lookups read the source in place, as cheap as the cached
+    // tables and safe from any thread. Modes that only look up then skip
+    // loadReferenceData.
+    virtual bool lookupsInPlace() const { return false; }
+
+    // Fill ref with every table the backend has
+    virtual bool loadReferenceData(ReferenceData& ref) = 0;
+
+    // Symbols are passed upper-cased
+    virtual LookupStatus findElement(const string& symbol, ElementRecord& element) = 0;
+    virtual LookupStatus findIon(bool isCation, const string& symbol, IonRecord& ion) = 0;
+
+    // Ion lookup the caller can overlap with other work. By default it
+    // runs synchronously once the result is requested.
+    virtual future<IonLookup> findIonAsync(bool isCation, const string& symbol) {
+        return async(launch::deferred, [this, isCation, symbol]() {
+            TraceScope trace(TraceLookup, isCation ? "cation" : "anion");
+            IonLookup result;
+            result.status = findIon(isCation, symbol, result.ion);
+            return result;
+        });
+    }
+
+    // Listings in menu order; only symbol and name have to be filled
+    virtual bool listElements(vector<ElementRecord>& elements) = 0;
+    virtual bool listIons(bool isCation, vector<IonRecord>& ions) = 0;
+
+    // Function to tell whether any table moved past the versions in ref,
+    // without touching ref. The default cannot tell and says yes.
+    virtual bool referenceDataChanged(const ReferenceData&, bool& changed) {
+        changed = true;
+        return true;
+    }
+
+    // Bring a loaded ref up to date with the source, touching only tables
+    // whose version moved. The default reloads everything.
+    virtual bool refreshReferenceData(ReferenceData& ref, RefreshResult& result) {
+        ReferenceData fresh;
+        if (!loadReferenceData(fresh)) {
+            return false;
+        }
+        fresh.generation = ref.generation;
+        ref = fresh;
+        for (int t = 0; t < RefTableCount; t++) {
+            result.reloaded[t] = true;
+        }
+        return true;
+    }
+};
+
+// SQL Server over ODBC, the original data path
+class OdbcBackend : public StorageBackend {
+public:
+    // pooled connections open and close without status output
+    explicit OdbcBackend(bool pooled = false) : pooled(pooled) {}
+
+    const char* name() const override { return "SQL Server (ODBC)"; }
+
+    bool open() override {
+        if (!connectToDatabase(env, dbc, pooled)) {
+            return false;
+        }
+        statements.dbc = dbc;
+        return true;
+    }
+
+    void close() override {
+        if (dbc == SQL_NULL_HDBC) {
+            return;
+        }
+        bool used = false;
+        for (const PreparedLookup& lookup : statements.lookups) {
+            used = used || lookup.executions > 0;
+        }
+        if (used && !pooled) {
+            printStatementCacheStats(statements);
+        }
+        releaseStatementCache(statements);
+        if (!pooled) {
+            fprintf(statusOut, "Disconnecting from database...\n");
+        }
+        SQLDisconnect(dbc);
+        SQLFreeHandle(SQL_HANDLE_DBC, dbc);
+        SQLFreeHandle(SQL_HANDLE_ENV, env);
+        dbc = SQL_NULL_HDBC;
+        env = SQL_NULL_HENV;
+    }
+
+    bool loadReferenceData(ReferenceData& ref) override {
+        return ::loadReferenceData(statements, ref);
+    }
+
+    bool referenceDataChanged(const ReferenceData& ref, bool& changed) override {
+        return ::referenceDataChanged(statements, ref, changed);
+    }
+
+    bool refreshReferenceData(ReferenceData& ref, RefreshResult& result) override {
+        return ::refreshReferenceData(statements, ref, result);
+    }
+
+    LookupStatus findElement(const string& symbol, ElementRecord& element) override {
+        SQLHSTMT stmt = executeLookup(statements, ElementLookup, symbol);
+        if (stmt == SQL_NULL_HSTMT) {
+            return LookupFailed;
+        }
+
+        LookupStatus status = LookupFailed;
+        SQLRETURN ret;
+        {
+            TraceScope trace(TraceFetch, "dbo.Elements");
+            ret = SQLFetch(stmt);
+        }
+        if (SQL_SUCCEEDED(ret)) {
+            TraceScope trace(TraceConvert, "dbo.Elements");
+            SQLCHAR symbolBuf[50];
+            SQLCHAR nameBuf[100];
+            SQLINTEGER charge, number;
+            SQLDOUBLE weight;
+            SQLLEN lenSymbol, lenCharge, lenName, lenWeight, lenNumber;
+
+            SQLGetData(stmt, 1, SQL_C_CHAR, symbolBuf, sizeof(symbolBuf), &lenSymbol);
+            SQLGetData(stmt, 2, SQL_C_SLONG, &charge, 0, &lenCharge);
+            SQLGetData(stmt, 3, SQL_C_CHAR, nameBuf, sizeof(nameBuf), &lenName);
+            SQLGetData(stmt, 4, SQL_C_DOUBLE, &weight, 0, &lenWeight);
+            SQLGetData(stmt, 5, SQL_C_SLONG, &number, 0, &lenNumber);
+
+            element.symbol = lenSymbol == SQL_NULL_DATA ? "" : (char*)symbolBuf;
+            element.name = lenName == SQL_NULL_DATA ? "NULL" : (char*)nameBuf;
+            element.hasCharge = lenCharge != SQL_NULL_DATA;
+            element.charge = element.hasCharge ? (int)charge : 0;
+            element.atomicWeight = lenWeight == SQL_NULL_DATA ? 0.0 : weight;
+            element.hasAtomicNumber = lenNumber != SQL_NULL_DATA;
+            element.atomicNumber = element.hasAtomicNumber ? (int)number : 0;
+            status = LookupFound;
+        } else if (ret == SQL_NO_DATA) {
+            status = LookupNotFound;
+        } else {
+            fprintf(statusOut, "Error fetching data.\n");
+            show_error(stmt, SQL_HANDLE_STMT);
+        }
+
+        // Close the cursor but keep the prepared statement for the next lookup
+        SQLFreeStmt(stmt, SQL_CLOSE);
+        return status;
+    }
+
+    LookupStatus findIon(bool isCation, const string& symbol, IonRecord& ion) override {
+        LookupQuery which = isCation ? CationLookup : AnionLookup;
+        if (traceEnabled.load(memory_order_relaxed)) {
+            traceEvent("query", string(lookupSql(which)) + " [Symbol = '" + symbol + "']");
+        }
+
+        SQLHSTMT stmt = executeLookup(statements, which, symbol);
+        if (stmt == SQL_NULL_HSTMT) {
+            return LookupFailed;
+        }
+
+        LookupStatus status = LookupFailed;
+        SQLRETURN ret;
+        {
+            TraceScope trace(TraceFetch, lookupSql(which));
+            ret = SQLFetch(stmt);
+        }
+        if (SQL_SUCCEEDED(ret)) {
+            TraceScope trace(TraceConvert, lookupSql(which));
+            SQLINTEGER charge;
+            SQLDOUBLE weight;
+            SQLLEN lenCharge, lenWeight;
+
+            SQLGetData(stmt, 1, SQL_C_SLONG, &charge, 0, &lenCharge);
+            SQLGetData(stmt, 2, SQL_C_DOUBLE, &weight, 0, &lenWeight);
+
+            ion.symbol = symbol;
+            if (lenCharge != SQL_NULL_DATA) {
+                ion.charge = (int)charge;
+            } else {
+                ion.charge = isCation ? 1 : -1; // Default values
+                traceEvent("null-charge", symbol + " defaults to " + to_string(ion.charge));
+            }
+            if (lenWeight != SQL_NULL_DATA) {
+                ion.atomicWeight = weight;
+            } else {
+                ion.atomicWeight = 1.0; // Default value
+                traceEvent("null-atomic-weight", symbol + " defaults to 1.0");
+            }
+            status = LookupFound;
+        } else if (ret == SQL_NO_DATA) {
+            status = LookupNotFound;
+        } else {
+            fprintf(statusOut, "Error fetching data.\n");
+            show_error(stmt, SQL_HANDLE_STMT);
+        }
+
+        SQLFreeStmt(stmt, SQL_CLOSE);
+        return status;
+    }
+
+    bool listElements(vector<ElementRecord>& elements) override {
+        RowBlock block;
+        block.addText(50);
+        block.addText(100);
+        if (!openBlockCursor(statements, "SELECT Symbol, Name FROM dbo.Elements ORDER BY AtomicNumber", block)) {
+            return false;
+        }
+
+        elements.clear();
+        FetchStatus fetched;
+        while ((fetched = fetchBlock(block)) == FetchRows) {
+            for (SQLULEN row = 0; row < block.rowsFetched; row++) {
+                if (block.rowValid(row)) {
+                    ElementRecord element;
+                    element.symbol = block.text(0, row);
+                    element.name = block.text(1, row);
+                    elements.push_back(element);
+                }
+            }
+        }
+        closeBlockCursor(block);
+        return fetched != FetchError;
+    }
+
+    bool listIons(bool isCation, vector<IonRecord>& ions) override {
+        string tableName = isCation ? "dbo.Cations" : "dbo.Anions";
+        string query = "SELECT Symbol, Name FROM " + tableName + " ORDER BY Symbol";
+
+        RowBlock block;
+        block.addText(50);
+        block.addText(100);
+        if (!openBlockCursor(statements, query.c_str(), block)) {
+            return false;
+        }
+
+        ions.clear();
+        FetchStatus fetched;
+        while ((fetched = fetchBlock(block)) == FetchRows) {
+            for (SQLULEN row = 0; row < block.rowsFetched; row++) {
+                if (block.rowValid(row)) {
+                    IonRecord ion;
+                    ion.symbol = block.text(0, row);
+                    ion.name = block.text(1, row);
+                    ions.push_back(ion);
+                }
+            }
+        }
+        closeBlockCursor(block);
+        return fetched != FetchError;
+    }
+
+private:
+    bool pooled;
+    SQLHENV env = SQL_NULL_HENV;
+    SQLHDBC dbc = SQL_NULL_HDBC;
+    StatementCache statements;
+};
+
+// One value of a seed script row; NULL is kept apart from the text 'NULL'
+struct SeedValue {
+    string text;
+    bool isNull = false;
+};
+
+// The rows of an INSERT INTO ... VALUES script such as dbo.Elements
+struct SeedScript {
+    string table;
+    vector<string> columns;
+    vector<vector<SeedValue>> rows;
+};
+
+// Function to compare two identifiers ignoring case
+static bool sameName(const string& a, const string& b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        if (toupper((unsigned char)a[i]) != toupper((unsigned char)b[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Function to parse a seed script. Lines starting with ## or -- are
+// comments; several INSERT statements per file are allowed, and a stray
+// ';' between tuples (as in the Elements seed) is tolerated.
+bool parseSeedFile(const string& path, SeedScript& script, string& error) {
+    ifstream input(path, ios::binary);
+    if (!input) {
+        error = "could not open '" + path + "'";
+        return false;
+    }
+
+    // Drop comment lines up front so the scanner only sees SQL
+    string text, line;
+    while (getline(input, line)) {
+        size_t first = line.find_first_not_of(" \t");
+        if (first != string::npos && (line.compare(first, 2, "##") == 0 || line.compare(first, 2, "--") == 0)) {
+            text += '\n';
+            continue;
+        }
+        text += line;
+        text += '\n';
+    }
+
+    script.table.clear();
+    script.columns.clear();
+    script.rows.clear();
+
+    size_t pos = 0;
+    auto lineAt = [&](size_t at) { return (int)count(text.begin(), text.begin() + min(at, text.size()), '\n') + 1; };
+    auto skipBlanks = [&]() {
+        while (pos < text.size() && (isspace((unsigned char)text[pos]) || text[pos] == ',' || text[pos] == ';')) {
+            pos++;
+        }
+    };
+    auto keywordAt = [&](const char* keyword) {
+        size_t length = strlen(keyword);
+        return pos + length <= text.size() && sameName(text.substr(pos, length), keyword);
+    };
+
+    skipBlanks();
+    while (pos < text.size()) {
+        if (!keywordAt("INSERT")) {
+            error = "expected INSERT on line " + to_string(lineAt(pos));
+            return false;
+        }
+        pos += 6;
+        while (pos < text.size() && isspace((unsigned char)text[pos])) {
+            pos++;
+        }
+        if (keywordAt("INTO")) {
+            pos += 4;
+        }
+        while (pos < text.size() && isspace((unsigned char)text[pos])) {
+            pos++;
+        }
+
+        size_t nameStart = pos;
+        while (pos < text.size() && !isspace((unsigned char)text[pos]) && text[pos] != '(') {
+            pos++;
+        }
+        string table = text.substr(nameStart, pos - nameStart);
+
+        size_t open = text.find('(', pos);
+        size_t close = text.find(')', open);
+        if (open == string::npos || close == string::npos) {
+            error = "missing column list on line " + to_string(lineAt(pos));
+            return false;
+        }
+        vector<string> columns;
+        string column;
+        for (size_t i = open + 1; i <= close; i++) {
+            if (text[i] == ',' || i == close) {
+                trimField(column, 0, column.size(), column);
+                columns.push_back(column);
+                column.clear();
+            } else {
+                column += text[i];
+            }
+        }
+        if (script.columns.empty()) {
+            script.table = table;
+            script.columns = columns;
+        } else if (columns.size() != script.columns.size()) {
+            error = "column list changes on line " + to_string(lineAt(open));
+            return false;
+        }
+
+        pos = close + 1;
+        while (pos < text.size() && isspace((unsigned char)text[pos])) {
+            pos++;
+        }
+        if (!keywordAt("VALUES")) {
+            error = "expected VALUES on line " + to_string(lineAt(pos));
+            return false;
+        }
+        pos += 6;
+
+        // Tuples until the next INSERT or the end of the file
+        skipBlanks();
+        while (pos < text.size() && text[pos] == '(') {
+            size_t rowStart = pos++;
+            vector<SeedValue> row;
+            while (true) {
+                while (pos < text.size() && isspace((unsigned char)text[pos])) {
+                    pos++;
+                }
+                SeedValue value;
+                if (pos < text.size() && text[pos] == '\'') {
+                    pos++;
+                    while (pos < text.size()) {
+                        if (text[pos] == '\'') {
+                            if (pos + 1 < text.size() && text[pos + 1] == '\'') {
+                                value.text += '\'';
+                                pos += 2;
+                                continue;
+                            }
+                            break;
+                        }
+                        value.text += text[pos++];
+                    }
+                    pos++;
+                } else {
+                    size_t start = pos;
+                    while (pos < text.size() && text[pos] != ',' && text[pos] != ')') {
+                        pos++;
+                    }
+                    trimField(text, start, pos, value.text);
+                    value.isNull = sameName(value.text, "NULL");
+                }
+                row.push_back(value);
+
+                while (pos < text.size() && isspace((unsigned char)text[pos])) {
+                    pos++;
+                }
+                if (pos < text.size() && text[pos] == ',') {
+                    pos++;
+                    continue;
+                }
+                if (pos < text.size() && text[pos] == ')') {
+                    pos++;
+                    break;
+                }
+                error = "unterminated row on line " + to_string(lineAt(rowStart));
+                return false;
+            }
+
+            if (row.size() != script.columns.size()) {
+                error = "row on line " + to_string(lineAt(rowStart)) + " has " + to_string(row.size()) +
+                        " values, expected " + to_string(script.columns.size());
+                return false;
+            }
+            script.rows.push_back(row);
+            skipBlanks();
+        }
+    }
+
+    return true;
+}
+
+// Function to find a column of a seed script by name, or -1
+static int seedColumn(const SeedScript& script, const char* name) {
+    for (size_t i = 0; i < script.columns.size(); i++) {
+        if (sameName(script.columns[i], name)) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+// Embedded store read straight from the dbo.* seed scripts in a directory.
+// Needs no server or driver, so it suits read-only use, Linux and CI.
+class SeedFileBackend : public StorageBackend {
+public:
+    explicit SeedFileBackend(const string& directory) : directory(directory) {}
+
+    const char* name() const override { return "seed files"; }
+
+    bool open() override {
+        auto start = chrono::steady_clock::now();
+        TraceScope trace(TraceConnect, "seed files");
+        fprintf(statusOut, "Loading seed files from '%s'...\n", directory.c_str());
+
+        for (int t = 0; t < RefTableCount; t++) {
+            data.versions[t] = fileStamp(refTableNames[t]);
+        }
+        if (!loadElements() || !loadIons(true) || !loadIons(false)) {
+            return false;
+        }
+        data.loaded = true;
+
+        // Thermodynamics and Isotopes are optional, as with the server
+        data.thermoLoaded = loadThermo();
+        data.isotopesLoaded = loadIsotopes();
+
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        fprintf(statusOut, "Seed data ready in %.2f ms.\n", ms);
+        return true;
+    }
+
+    void close() override {}
+
+    bool loadReferenceData(ReferenceData& ref) override {
+        ref = data;
+        fprintf(statusOut, "Cached %zu elements, %zu cations and %zu anions.\n",
+                ref.elements.rows.size(), ref.cations.rows.size(), ref.anions.rows.size());
+        if (ref.thermoLoaded) {
+            fprintf(statusOut, "Cached %zu thermodynamic species.\n", ref.thermo.rows.size());
+        }
+        if (ref.isotopesLoaded) {
+            fprintf(statusOut, "Cached %zu isotopes.\n", ref.isotopes.count);
+        }
+        return ref.loaded;
+    }
+
+    LookupStatus findElement(const string& symbol, ElementRecord& element) override {
+        const ElementRecord* found = data.elements.find(symbol);
+        if (found == nullptr) {
+            return LookupNotFound;
+        }
+        element = *found;
+        return LookupFound;
+    }
+
+    LookupStatus findIon(bool isCation, const string& symbol, IonRecord& ion) override {
+        const IonRecord* found = data.ions(isCation).find(symbol);
+        if (found == nullptr) {
+            return LookupNotFound;
+        }
+        ion = *found;
+        return LookupFound;
+    }
+
+    bool listElements(vector<ElementRecord>& elements) override {
+        elements = data.elements.rows;
+        return true;
+    }
+
+    bool listIons(bool isCation, vector<IonRecord>& ions) override {
+        ions = data.ions(isCation).rows;
+        return true;
+    }
+
+    bool referenceDataChanged(const ReferenceData& ref, bool& changed) override {
+        changed = false;
+        for (int t = 0; t < RefTableCount; t++) {
+            TableVersion stamp = fileStamp(refTableNames[t]);
+            changed = changed || stamp.rows != ref.versions[t].rows || stamp.version != ref.versions[t].version;
+        }
+        return true;
+    }
+
+    // Re-reads only the seed files whose stamp moved and merges the rows
+    // that differ; a file that lost rows replaces its table
+    bool refreshReferenceData(ReferenceData& ref, RefreshResult& result) override {
+        for (int t = 0; t < RefTableCount; t++) {
+            TableVersion stamp = fileStamp(refTableNames[t]);
+            if (stamp.rows == ref.versions[t].rows && stamp.version == ref.versions[t].version) {
+                continue;
+            }
+
+            bool ok = t == RefElements ? loadElements() : loadIons(t == RefCations);
+            if (!ok) {
+                return false;
+            }
+            bool merged = t == RefElements
+                              ? mergeTableRows(ref.elements, data.elements, result.changed[t])
+                              : mergeTableRows(t == RefCations ? ref.cations : ref.anions,
+                                               data.ions(t == RefCations), result.changed[t]);
+            if (!merged) {
+                if (t == RefElements) {
+                    ref.elements = data.elements;
+                } else {
+                    (t == RefCations ? ref.cations : ref.anions) = data.ions(t == RefCations);
+                }
+                result.reloaded[t] = true;
+            }
+            ref.versions[t] = stamp;
+            data.versions[t] = stamp;
+        }
+        return true;
+    }
+
+private:
+    // File size and modification time stand in for a table version
+    TableVersion fileStamp(const char* file) const {
+        TableVersion stamp;
+        struct stat info;
+        if (stat(path(file).c_str(), &info) == 0) {
+            stamp.rows = (long long)info.st_size;
+            stamp.version = (long long)info.st_mtime;
+        }
+        return stamp;
+    }
+
+    string path(const char* file) const {
+        return directory + "/" + file;
+    }
+
+    bool readScript(const char* file, SeedScript& script, bool required) {
+        string error;
+        if (!parseSeedFile(path(file), script, error)) {
+            fprintf(statusOut, "%s: %s\n", required ? "Error" : "Warning", error.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    bool loadElements() {
+        SeedScript script;
+        if (!readScript("dbo.Elements", script, true)) {
+            return false;
+        }
+        int symbol = seedColumn(script, "Symbol"), name = seedColumn(script, "Name");
+        int charge = seedColumn(script, "Charge"), weight = seedColumn(script, "AtomicWeight");
+        int number = seedColumn(script, "AtomicNumber");
+        if (symbol < 0 || name < 0 || charge < 0 || weight < 0 || number < 0) {
+            fprintf(statusOut, "Error: dbo.Elements seed is missing expected columns.\n");
+            return false;
+        }
+
+        vector<ElementRecord> rows;
+        for (const vector<SeedValue>& row : script.rows) {
+            ElementRecord record;
+            record.symbol = row[symbol].text;
+            record.name = row[name].isNull ? "NULL" : row[name].text;
+            record.hasCharge = !row[charge].isNull;
+            record.charge = record.hasCharge ? atoi(row[charge].text.c_str()) : 0;
+            record.atomicWeight = row[weight].isNull ? 0.0 : atof(row[weight].text.c_str());
+            record.hasAtomicNumber = !row[number].isNull;
+            record.atomicNumber = record.hasAtomicNumber ? atoi(row[number].text.c_str()) : 0;
+            rows.push_back(record);
+        }
+
+        // Same order as ORDER BY AtomicNumber
+        stable_sort(rows.begin(), rows.end(), [](const ElementRecord& a, const ElementRecord& b) {
+            return a.atomicNumber < b.atomicNumber;
+        });
+        data.elements.clear();
+        for (const ElementRecord& record : rows) {
+            data.elements.add(record);
+        }
+        return true;
+    }
+
+    bool loadIons(bool isCation) {
+        const char* file = isCation ? "dbo.Cations" : "dbo.Anions";
+        SeedScript script;
+        if (!readScript(file, script, true)) {
+            return false;
+        }
+        int symbol = seedColumn(script, "Symbol"), name = seedColumn(script, "Name");
+        int charge = seedColumn(script, "Charge"), weight = seedColumn(script, "AtomicWeight");
+        if (symbol < 0 || name < 0 || charge < 0 || weight < 0) {
+            fprintf(statusOut, "Error: %s seed is missing expected columns.\n", file);
+            return false;
+        }
+
+        vector<IonRecord> rows;
+        for (const vector<SeedValue>& row : script.rows) {
+            IonRecord record;
+            record.symbol = row[symbol].text;
+            record.name = row[name].isNull ? "NULL" : row[name].text;
+            record.charge = row[charge].isNull ? (isCation ? 1 : -1) : atoi(row[charge].text.c_str());
+            record.atomicWeight = row[weight].isNull ? 1.0 : atof(row[weight].text.c_str());
+            rows.push_back(record);
+        }
+
+        // Same order as ORDER BY Symbol
+        stable_sort(rows.begin(), rows.end(), [](const IonRecord& a, const IonRecord& b) {
+            return symbolLess(a.symbol, b.symbol);
+        });
+        ReferenceTable<IonRecord>& table = isCation ? data.cations : data.anions;
+        table.clear();
+        for (const IonRecord& record : rows) {
+            table.add(record);
+        }
+        return true;
+    }
+
+    bool loadThermo() {
+        SeedScript script;
+        if (!readScript("dbo.Thermodynamics", script, false)) {
+            return false;
+        }
+        int species = seedColumn(script, "Ions"), enthalpy = seedColumn(script, "Enthalpy");
+        int entropy = seedColumn(script, "Entropy"), gibbs = seedColumn(script, "Gibbs");
+        if (species < 0 || enthalpy < 0 || entropy < 0 || gibbs < 0) {
+            fprintf(statusOut, "Warning: dbo.Thermodynamics seed is missing expected columns.\n");
+            return false;
+        }
+
+        data.thermo.clear();
+        for (const vector<SeedValue>& row : script.rows) {
+            ThermoRecord record;
+            record.species = row[species].text;
+            record.enthalpy = atof(row[enthalpy].text.c_str());
+            record.entropy = atof(row[entropy].text.c_str());
+            record.gibbs = atof(row[gibbs].text.c_str());
+            data.thermo.add(record);
+        }
+        return true;
+    }
+
+    bool loadIsotopes() {
+        SeedScript script;
+        if (!readScript("dbo.Isotopes", script, false)) {
+            return false;
+        }
+        int symbol = seedColumn(script, "Symbol"), massNumber = seedColumn(script, "MassNumber");
+        int mass = seedColumn(script, "Mass"), abundance = seedColumn(script, "Abundance");
+        if (symbol < 0 || massNumber < 0 || mass < 0 || abundance < 0) {
+            fprintf(statusOut, "Warning: dbo.Isotopes seed is missing expected columns.\n");
+            return false;
+        }
+
+        data.isotopes.clear();
+        for (const vector<SeedValue>& row : script.rows) {
+            IsotopeRecord record;
+            record.symbol = row[symbol].text;
+            record.massNumber = atoi(row[massNumber].text.c_str());
+            record.mass = atof(row[mass].text.c_str());
+            record.abundance = atof(row[abundance].text.c_str());
+            data.isotopes.add(record);
+        }
+        return true;
+    }
+
+    string directory;
+    ReferenceData data;
+};
+
+// Parameter sets sent per SQLExecute, and rows committed per transaction
+const size_t LOAD_PARAMSET_ROWS = 1000;
+const size_t LOAD_COMMIT_ROWS = 20000;
+
+// Function to read a CSV with a header row of column names into the same
+// shape as a seed script. Fields may be double-quoted; an empty unquoted
+// field or NULL is a NULL.
+bool parseSeedCsv(const string& path, SeedScript& script, string& error) {
+    ifstream input(path, ios::binary);
+    if (!input) {
+        error = "could not open '" + path + "'";
+        return false;
+    }
+
+    script.columns.clear();
+    script.rows.clear();
+
+    string line;
+    size_t lineNumber = 0;
+    while (getline(input, line)) {
+        lineNumber++;
+        // Spreadsheet exports often start with a UTF-8 byte order mark
+        if (lineNumber == 1 && line.compare(0, 3, "\xEF\xBB\xBF") == 0) {
+            line.erase(0, 3);
+        }
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.find_first_not_of(" \t") == string::npos) {
+            continue;
+        }
+
+        vector<SeedValue> row;
+        size_t pos = 0;
+        while (true) {
+            SeedValue value;
+            while (pos < line.size() && (line[pos] == ' ' || line[pos] == '\t')) {
+                pos++;
+            }
+            if (pos < line.size() && line[pos] == '"') {
+                pos++;
+                while (pos < line.size()) {
+                    if (line[pos] == '"') {
+                        if (pos + 1 < line.size() && line[pos + 1] == '"') {
+                            value.text += '"';
+                            pos += 2;
+                            continue;
+                        }
+                        break;
+                    }
+                    value.text += line[pos++];
+                }
+                pos = line.find(',', pos);
+            } else {
+                size_t next = line.find(',', pos);
+                trimField(line, pos, next == string::npos ? line.size() : next, value.text);
+                value.isNull = value.text.empty() || sameName(value.text, "NULL");
+                pos = next;
+            }
+            row.push_back(value);
+            if (pos == string::npos) {
+                break;
+            }
+            pos++;
+        }
+
+        if (script.columns.empty()) {
+            for (const SeedValue& value : row) {
+                script.columns.push_back(value.text);
+            }
+        } else if (row.size() != script.columns.size()) {
+            error = "line " + to_string(lineNumber) + " has " + to_string(row.size()) + " fields, expected " +
+                    to_string(script.columns.size());
+            return false;
+        } else {
+            script.rows.push_back(row);
+        }
+    }
+
+    if (script.columns.empty()) {
+        error = "'" + path + "' has no header row";
+        return false;
+    }
+    return true;
+}
+
+// Function to find the schema of a table, with or without the dbo. prefix
+static const TableSchema* findTableSchema(const string& table) {
+    for (const TableSchema& schema : tableSchemas) {
+        if (sameName(table, schema.table) || sameName(table, schema.label)) {
+            return &schema;
+        }
+    }
+    return nullptr;
+}
+
+// Function to check one value against its column, as the server would
+static bool validSeedValue(const ColumnSchema& column, const SeedValue& value, string& error) {
+    if (value.isNull) {
+        if (!column.nullable) {
+            error = string(column.name) + " cannot be NULL";
+            return false;
+        }
+        return true;
+    }
+
+    const string& text = value.text;
+    switch (column.type) {
+        case ColumnText:
+            if ((int)text.size() > column.size) {
+                error = string(column.name) + " '" + text + "' is longer than " + to_string(column.size) +
+                        " characters";
+                return false;
+            }
+            return true;
+
+        case ColumnInt: {
+            char* end = nullptr;
+            errno = 0;
+            long number = strtol(text.c_str(), &end, 10);
+            if (text.empty() || *end != '\0' || errno == ERANGE || number < INT32_MIN || number > INT32_MAX) {
+                error = string(column.name) + " '" + text + "' is not an int";
+                return false;
+            }
+            return true;
+        }
+
+        default: {
+            // decimal(p, s) takes p - s integer digits; extra fraction digits are rounded
+            size_t pos = text[0] == '+' || text[0] == '-' ? 1 : 0;
+            size_t integerDigits = 0, fractionDigits = 0;
+            while (pos < text.size() && isdigit((unsigned char)text[pos])) {
+                integerDigits++;
+                pos++;
+            }
+            if (pos < text.size() && text[pos] == '.') {
+                pos++;
+                while (pos < text.size() && isdigit((unsigned char)text[pos])) {
+                    fractionDigits++;
+                    pos++;
+                }
+            }
+            if (pos != text.size() || integerDigits + fractionDigits == 0) {
+                error = string(column.name) + " '" + text + "' is not a decimal";
+                return false;
+            }
+            if ((int)integerDigits > column.size - column.scale) {
+                error = string(column.name) + " '" + text + "' overflows decimal(" + to_string(column.size) + "," +
+                        to_string(column.scale) + ")";
+                return false;
+            }
+            return true;
+        }
+    }
+}
+
+// A parsed seed file matched to its table, with the script column feeding
+// each schema column (-1 loads NULL)
+struct LoadPlan {
+    string path;
+    const TableSchema* schema = nullptr;
+    SeedScript script;
+    vector<int> source;
+};
+
+// Function to parse a seed script or CSV and validate every row against the
+// table schema. A CSV names its table through the file name (dbo.Cations.csv).
+bool prepareLoadPlan(const string& path, LoadPlan& plan) {
+    plan.path = path;
+    string error;
+    size_t slash = path.find_last_of("/\\");
+    string fileName = path.substr(slash == string::npos ? 0 : slash + 1);
+    bool csv = fileName.size() > 4 && sameName(fileName.substr(fileName.size() - 4), ".csv");
+
+    if (csv) {
+        plan.script.table = fileName.substr(0, fileName.size() - 4);
+        if (!parseSeedCsv(path, plan.script, error)) {
+            fprintf(statusOut, "Error: %s\n", error.c_str());
+            return false;
+        }
+    } else if (!parseSeedFile(path, plan.script, error)) {
+        fprintf(statusOut, "Error: %s\n", error.c_str());
+        return false;
+    }
+
+    plan.schema = findTableSchema(plan.script.table);
+    if (plan.schema == nullptr) {
+        fprintf(statusOut, "Error: %s: unknown table '%s'.\n", path.c_str(), plan.script.table.c_str());
+        return false;
+    }
+
+    bool ok = true;
+    for (const string& column : plan.script.columns) {
+        bool known = false;
+        for (const ColumnSchema& declared : plan.schema->columns) {
+            known = known || sameName(column, declared.name);
+        }
+        if (!known) {
+            fprintf(statusOut, "Error: %s: %s has no column '%s'.\n", path.c_str(), plan.schema->table, column.c_str());
+            ok = false;
+        }
+    }
+    plan.source.clear();
+    for (const ColumnSchema& declared : plan.schema->columns) {
+        int index = seedColumn(plan.script, declared.name);
+        if (index < 0 && !declared.nullable) {
+            fprintf(statusOut, "Error: %s: missing required column '%s'.\n", path.c_str(), declared.name);
+            ok = false;
+        }
+        plan.source.push_back(index);
+    }
+    if (!ok) {
+        return false;
+    }
+
+    // Report the first few bad rows rather than stopping at one
+    size_t errors = 0;
+    for (size_t row = 0; row < plan.script.rows.size(); row++) {
+        for (size_t c = 0; c < plan.source.size(); c++) {
+            if (plan.source[c] < 0 || validSeedValue(plan.schema->columns[c], plan.script.rows[row][plan.source[c]], error)) {
+                continue;
+            }
+            if (++errors <= 10) {
+                fprintf(statusOut, "Error: %s row %zu: %s.\n", path.c_str(), row + 1, error.c_str());
+            }
+        }
+    }
+    if (errors > 10) {
+        fprintf(statusOut, "Error: %s: %zu invalid values in total.\n", path.c_str(), errors);
+    }
+    return errors == 0;
+}
+
+// Column-wise parameter buffers for one array-bound INSERT
+struct ParamColumn {
+    vector<SQLCHAR> text;
+    vector<SQLINTEGER> ints;
+    vector<SQLLEN> lengths;
+    size_t width = 0;
+};
+
+// Function to insert a validated plan with parameter arrays: LOAD_PARAMSET_ROWS
+// rows per round trip, committed every LOAD_COMMIT_ROWS. With replace the
+// delete and every insert are one transaction, so a failure keeps the old
+// rows. Otherwise a failed batch rolls back its transaction; earlier
+// transactions stay committed. A driver without parameter arrays gets one
+// row per execute.
+bool bulkLoadTable(SQLHDBC dbc, const LoadPlan& plan, bool replace, size_t& loaded, size_t& transactions) {
+    const TableSchema& schema = *plan.schema;
+    const vector<vector<SeedValue>>& rows = plan.script.rows;
+    loaded = 0;
+    transactions = 0;
+
+    SQLHSTMT stmt = SQL_NULL_HSTMT;
+    if (!SQL_SUCCEEDED(SQLAllocHandle(SQL_HANDLE_STMT, dbc, &stmt))) {
+        fprintf(statusOut, "Failed to allocate statement handle.\n");
+        return false;
+    }
+    if (!SQL_SUCCEEDED(SQLSetConnectAttr(dbc, SQL_ATTR_AUTOCOMMIT, (SQLPOINTER)SQL_AUTOCOMMIT_OFF, 0))) {
+        show_error(dbc, SQL_HANDLE_DBC);
+        SQLFreeHandle(SQL_HANDLE_STMT, stmt);
+        return false;
+    }
+
+    string sql = string("INSERT INTO ") + schema.table + " (";
+    for (size_t c = 0; c < schema.columns.size(); c++) {
+        sql += c ? ", " : "";
+        sql += schema.columns[c].name;
+    }
+    sql += ") VALUES (";
+    for (size_t c = 0; c < schema.columns.size(); c++) {
+        sql += c ? ", ?" : "?";
+    }
+    sql += ")";
+
+    bool ok = true;
+    if (replace) {
+        string clear = string("DELETE FROM ") + schema.table;
+        TraceScope trace(TraceExecute, "bulk delete");
+        if (!SQL_SUCCEEDED(SQLExecDirect(stmt, (SQLCHAR*)clear.c_str(), SQL_NTS))) {
+            show_error(stmt, SQL_HANDLE_STMT);
+            ok = false;
+        }
+    }
+    if (ok) {
+        TraceScope trace(TracePrepare, "bulk insert");
+        if (!SQL_SUCCEEDED(SQLPrepare(stmt, (SQLCHAR*)sql.c_str(), SQL_NTS))) {
+            show_error(stmt, SQL_HANDLE_STMT);
+            ok = false;
+        }
+    }
+
+    // Text and decimal values go as text so the server does the exact
+    // decimal conversion; ints are bound as ints
+    vector<ParamColumn> params(schema.columns.size());
+    vector<SQLUSMALLINT> status(LOAD_PARAMSET_ROWS);
+    SQLULEN processed = 0;
+    for (size_t c = 0; ok && c < schema.columns.size(); c++) {
+        const ColumnSchema& column = schema.columns[c];
+        ParamColumn& param = params[c];
+        param.lengths.resize(LOAD_PARAMSET_ROWS);
+        SQLRETURN ret;
+        if (column.type == ColumnInt) {
+            param.ints.resize(LOAD_PARAMSET_ROWS);
+            ret = SQLBindParameter(stmt, (SQLUSMALLINT)(c + 1), SQL_PARAM_INPUT, SQL_C_SLONG, SQL_INTEGER, 0, 0,
+                                   param.ints.data(), 0, param.lengths.data());
+        } else {
+            param.width = column.type == ColumnText ? column.size + 1 : column.size + 3;
+            param.text.resize(param.width * LOAD_PARAMSET_ROWS);
+            ret = SQLBindParameter(stmt, (SQLUSMALLINT)(c + 1), SQL_PARAM_INPUT, SQL_C_CHAR,
+                                   column.type == ColumnText ? SQL_VARCHAR : SQL_DECIMAL, column.size,
+                                   (SQLSMALLINT)column.scale, param.text.data(), (SQLLEN)param.width,
+                                   param.lengths.data());
+        }
+        if (!SQL_SUCCEEDED(ret)) {
+            show_error(stmt, SQL_HANDLE_STMT);
+            ok = false;
+        }
+    }
+    size_t batch = LOAD_PARAMSET_ROWS;
+    if (ok && !(SQL_SUCCEEDED(SQLSetStmtAttr(stmt, SQL_ATTR_PARAM_BIND_TYPE, (SQLPOINTER)SQL_PARAM_BIND_BY_COLUMN, 0)) &&
+                SQL_SUCCEEDED(SQLSetStmtAttr(stmt, SQL_ATTR_PARAM_STATUS_PTR, status.data(), 0)) &&
+                SQL_SUCCEEDED(SQLSetStmtAttr(stmt, SQL_ATTR_PARAMS_PROCESSED_PTR, &processed, 0)))) {
+        batch = 1;
+    }
+
+    size_t uncommitted = 0;
+    SQLULEN paramsetSize = 1;
+    size_t first = 0;
+    while (ok && first < rows.size()) {
+        size_t count = min(batch, rows.size() - first);
+        if (count != paramsetSize) {
+            if (!SQL_SUCCEEDED(SQLSetStmtAttr(stmt, SQL_ATTR_PARAMSET_SIZE, (SQLPOINTER)(SQLULEN)count, 0))) {
+                if (batch == 1) {
+                    show_error(stmt, SQL_HANDLE_STMT);
+                    ok = false;
+                    break;
+                }
+                batch = 1;
+                continue;
+            }
+            paramsetSize = count;
+        }
+        if (batch == 1 && first == 0) {
+            fprintf(statusOut, "Parameter arrays not supported; inserting one row per round trip.\n");
+        }
+        for (size_t r = 0; r < count; r++) {
+            const vector<SeedValue>& row = rows[first + r];
+            for (size_t c = 0; c < params.size(); c++) {
+                ParamColumn& param = params[c];
+                if (plan.source[c] < 0 || row[plan.source[c]].isNull) {
+                    param.lengths[r] = SQL_NULL_DATA;
+                    continue;
+                }
+                const string& text = row[plan.source[c]].text;
+                if (schema.columns[c].type == ColumnInt) {
+                    param.ints[r] = (SQLINTEGER)atol(text.c_str());
+                    param.lengths[r] = 0;
+                } else {
+                    // Decimals with more fraction digits than fit are cut;
+                    // the server rounds to the column scale anyway
+                    size_t length = min(text.size(), param.width - 1);
+                    memcpy(&param.text[r * param.width], text.data(), length);
+                    param.lengths[r] = (SQLLEN)length;
+                }
+            }
+        }
+
+        SQLRETURN ret;
+        {
+            TraceScope trace(TraceExecute, "bulk insert");
+            ret = SQLExecute(stmt);
+        }
+        if (!SQL_SUCCEEDED(ret)) {
+            size_t failed = first;
+            for (size_t r = 0; r < processed && r < count; r++) {
+                if (status[r] == SQL_PARAM_ERROR) {
+                    failed = first + r;
+                    break;
+                }
+            }
+            fprintf(statusOut, "Insert into %s failed near row %zu.\n", schema.table, failed + 1);
+            show_error(stmt, SQL_HANDLE_STMT);
+            ok = false;
+            break;
+        }
+        loaded += count;
+        uncommitted += count;
+        first += count;
+
+        if ((!replace && uncommitted >= LOAD_COMMIT_ROWS) || first == rows.size()) {
+            if (!SQL_SUCCEEDED(SQLEndTran(SQL_HANDLE_DBC, dbc, SQL_COMMIT))) {
+                show_error(dbc, SQL_HANDLE_DBC);
+                ok = false;
+                break;
+            }
+            transactions++;
+            uncommitted = 0;
+        }
+    }
+
+    // An empty file with replace still has the delete to commit
+    if (ok && rows.empty()) {
+        ok = SQL_SUCCEEDED(SQLEndTran(SQL_HANDLE_DBC, dbc, SQL_COMMIT));
+        transactions += ok;
+    }
+    if (!ok) {
+        SQLEndTran(SQL_HANDLE_DBC, dbc, SQL_ROLLBACK);
+        loaded -= uncommitted;
+    }
+    SQLSetConnectAttr(dbc, SQL_ATTR_AUTOCOMMIT, (SQLPOINTER)SQL_AUTOCOMMIT_ON, 0);
+    SQLFreeHandle(SQL_HANDLE_STMT, stmt);
+    return ok;
+}
+
+// Function to validate seed scripts or CSV files and bulk insert them.
+// Nothing is sent unless every file validates; checkOnly stops there.
+bool runBulkLoad(const vector<string>& paths, bool replace, bool checkOnly) {
+    vector<LoadPlan> plans(paths.size());
+    bool valid = true;
+    for (size_t i = 0; i < paths.size(); i++) {
+        if (prepareLoadPlan(paths[i], plans[i])) {
+            fprintf(statusOut, "%s: %zu valid rows for %s.\n", paths[i].c_str(), plans[i].script.rows.size(),
+                    plans[i].schema->table);
+        } else {
+            valid = false;
+        }
+    }
+    if (!valid) {
+        fprintf(statusOut, "Nothing loaded.\n");
+        return false;
+    }
+    if (checkOnly) {
+        return true;
+    }
+
+    SQLHENV env = SQL_NULL_HENV;
+    SQLHDBC dbc = SQL_NULL_HDBC;
+    if (!connectToDatabase(env, dbc)) {
+        return false;
+    }
+
+    bool ok = true;
+    size_t totalRows = 0;
+    auto totalStart = chrono::steady_clock::now();
+    for (const LoadPlan& plan : plans) {
+        size_t loaded = 0, transactions = 0;
+        auto start = chrono::steady_clock::now();
+        ok = bulkLoadTable(dbc, plan, replace, loaded, transactions);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        totalRows += loaded;
+        fprintf(statusOut, "Loaded %zu rows into %s in %.3f s (%.0f rows/s, %zu transactions).\n", loaded,
+                plan.schema->table, seconds, seconds > 0 ? loaded / seconds : 0.0, transactions);
+        if (!ok) {
+            break;
+        }
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - totalStart).count();
+    if (plans.size() > 1) {
+        fprintf(statusOut, "Loaded %zu rows in %.3f s (%.0f rows/s).\n", totalRows, seconds,
+                seconds > 0 ? totalRows / seconds : 0.0);
+    }
+
+    fprintf(statusOut, "Disconnecting from database...\n");
+    SQLDisconnect(dbc);
+    SQLFreeHandle(SQL_HANDLE_DBC, dbc);
+    SQLFreeHandle(SQL_HANDLE_ENV, env);
+    return ok;
+}
+
+// Binary snapshot of the reference tables (--export-snapshot / --snapshot).
+// The file is a header, then per table an array of fixed-width records
+// and an open-addressing hash index of row numbers, all 8-byte aligned, so
+// a mapped file is used in place: no parsing, and every process on a host
+// shares the same page-cache copy. The checksum covers everything after
+// the header and is checked after export and by --verify-snapshot; bump
+// SNAPSHOT_VERSION whenever a record layout changes.
+const char SNAPSHOT_MAGIC[8] = { 'C', 'H', 'E', 'M', 'S', 'N', 'A', 'P' };
+const uint32_t SNAPSHOT_VERSION = 1;
+
+enum SnapshotTable {
+    SnapElements,
+    SnapCations,
+    SnapAnions,
+    SnapThermo,
+    SnapIsotopes,
+    SnapTableCount
+};
+
+struct SnapshotTableInfo {
+    uint32_t rows;
+    uint32_t recordSize;
+    uint64_t recordsOffset;
+    uint32_t buckets; // power of two; 0 when the table is absent
+    uint32_t reserved;
+    uint64_t indexOffset; // buckets uint32_t entries, row + 1 or 0 when empty
+};
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t tableCount;
+    uint64_t fileSize;
+    uint64_t checksum;
+    int64_t createdAt;
+    SnapshotTableInfo tables[SnapTableCount];
+};
+
+// Text fields are NUL-padded to the varchar width plus one
+struct SnapshotElement {
+    char symbol[12];
+    char name[100];
+    int32_t charge;
+    int32_t atomicNumber;
+    uint8_t hasCharge;
+    uint8_t hasAtomicNumber;
+    uint8_t reserved[6];
+    double atomicWeight;
+};
+
+struct SnapshotIon {
+    char symbol[12];
+    char name[100];
+    int32_t charge;
+    double atomicWeight;
+};
+
+struct SnapshotThermo {
+    char species[56];
+    double enthalpy;
+    double entropy;
+    double gibbs;
+};
+
+// Isotopes are stored grouped by symbol; the index points at the first one
+struct SnapshotIsotope {
+    char symbol[12];
+    int32_t massNumber;
+    double mass;
+    double abundance;
+};
+
+static_assert(sizeof(SnapshotElement) == 136, "snapshot element layout changed");
+static_assert(sizeof(SnapshotIon) == 128, "snapshot ion layout changed");
+static_assert(sizeof(SnapshotThermo) == 80, "snapshot thermo layout changed");
+static_assert(sizeof(SnapshotIsotope) == 32, "snapshot isotope layout changed");
+
+// Function to copy a NUL-padded field. A damaged file may fill the whole
+// field, so the copy stops at its width rather than at a NUL.
+template <size_t N>
+static string snapshotText(const char (&field)[N]) {
+    return string(field, strnlen(field, N));
+}
+
+// Function to upper-case a symbol into a snapshot key
+template <size_t N>
+static string snapshotKey(const char (&symbol)[N]) {
+    string key = snapshotText(symbol);
+    for (char &c : key) {
+        c = toupper(c);
+    }
+    return key;
+}
+
+// Function to copy text into a fixed-width field, truncating if needed
+static void copyField(char* field, size_t width, const string& text) {
+    memset(field, 0, width);
+    memcpy(field, text.data(), min(text.size(), width - 1));
+}
+
+// Read-only view of a whole file, mapped where the platform allows
+class MappedFile {
+public:
+    ~MappedFile() { close(); }
+
+    bool open(const string& path, string& error) {
+        close();
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) {
+            error = "could not open '" + path + "'";
+            return false;
+        }
+        LARGE_INTEGER length;
+        GetFileSizeEx(file, &length);
+        size = (size_t)length.QuadPart;
+        mapping = size ? CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+        data = mapping ? (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            error = "could not open '" + path + "'";
+            return false;
+        }
+        struct stat info;
+        size = fstat(fd, &info) == 0 ? (size_t)info.st_size : 0;
+        void* view = size ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        ::close(fd);
+        data = view == MAP_FAILED ? nullptr : (const char*)view;
+#endif
+        if (data == nullptr) {
+            error = "could not map '" + path + "'";
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+#ifdef _WIN32
+        if (data != nullptr) {
+            UnmapViewOfFile(data);
+        }
+        if (mapping != NULL) {
+            CloseHandle(mapping);
+        }
+        if (file != INVALID_HANDLE_VALUE) {
+            CloseHandle(file);
+        }
+        mapping = NULL;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (data != nullptr) {
+            munmap((void*)data, size);
+        }
+#endif
+        data = nullptr;
+        size = 0;
+    }
+
+    const char* data = nullptr;
+    size_t size = 0;
+
+private:
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+#endif
+};
+
+// Function to append a table's records and hash index to a snapshot image.
+// keyOf gives the index key of a row, or "" for rows that continue the
+// previous key (later isotopes of an element).
+template <typename Row>
+static void appendSnapshotTable(string& image, SnapshotTableInfo& info, const vector<Row>& rows,
+                                const function<string(size_t)>& keyOf) {
+    info.rows = (uint32_t)rows.size();
+    info.recordSize = sizeof(Row);
+    info.recordsOffset = image.size();
+    image.append((const char*)rows.data(), rows.size() * sizeof(Row));
+
+    uint32_t buckets = 8;
+    while (buckets < rows.size() * 2) {
+        buckets *= 2;
+    }
+    vector<uint32_t> index(buckets, 0);
+    for (size_t row = 0; row < rows.size(); row++) {
+        string key = keyOf(row);
+        if (key.empty()) {
+            continue;
+        }
+        size_t slot = fnv1aHash(key.data(), key.size()) & (buckets - 1);
+        while (index[slot] != 0) {
+            slot = (slot + 1) & (buckets - 1);
+        }
+        index[slot] = (uint32_t)row + 1;
+    }
+    info.buckets = buckets;
+    info.indexOffset = image.size();
+    image.append((const char*)index.data(), index.size() * sizeof(uint32_t));
+    image.resize((image.size() + 7) & ~(size_t)7, '\0');
+}
+
+// Function to write the cached tables to a snapshot file. The image is
+// written next to the target and renamed over it, so readers never map a
+// half-written file.
+bool writeSnapshot(const ReferenceData& ref, const string& path, string& error) {
+    if (!ref.loaded) {
+        error = "the reference tables are not loaded";
+        return false;
+    }
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.tableCount = SnapTableCount;
+    header.createdAt = (int64_t)time(nullptr);
+    string image(sizeof(header), '\0');
+
+    vector<SnapshotElement> elements(ref.elements.rows.size());
+    for (size_t i = 0; i < elements.size(); i++) {
+        const ElementRecord& source = ref.elements.rows[i];
+        SnapshotElement& record = elements[i];
+        memset(&record, 0, sizeof(record));
+        copyField(record.symbol, sizeof(record.symbol), source.symbol);
+        copyField(record.name, sizeof(record.name), source.name);
+        record.charge = source.charge;
+        record.atomicNumber = source.atomicNumber;
+        record.hasCharge = source.hasCharge;
+        record.hasAtomicNumber = source.hasAtomicNumber;
+        record.atomicWeight = source.atomicWeight;
+    }
+    appendSnapshotTable(image, header.tables[SnapElements], elements,
+                        [&](size_t row) { return snapshotKey(elements[row].symbol); });
+
+    for (int t = SnapCations; t <= SnapAnions; t++) {
+        const vector<IonRecord>& sourceRows = ref.ions(t == SnapCations).rows;
+        vector<SnapshotIon> ions(sourceRows.size());
+        for (size_t i = 0; i < ions.size(); i++) {
+            SnapshotIon& record = ions[i];
+            memset(&record, 0, sizeof(record));
+            copyField(record.symbol, sizeof(record.symbol), sourceRows[i].symbol);
+            copyField(record.name, sizeof(record.name), sourceRows[i].name);
+            record.charge = sourceRows[i].charge;
+            record.atomicWeight = sourceRows[i].atomicWeight;
+        }
+        appendSnapshotTable(image, header.tables[t], ions, [&](size_t row) { return snapshotKey(ions[row].symbol); });
+    }
+
+    if (ref.thermoLoaded) {
+        vector<SnapshotThermo> thermo(ref.thermo.rows.size());
+        for (size_t i = 0; i < thermo.size(); i++) {
+            SnapshotThermo& record = thermo[i];
+            memset(&record, 0, sizeof(record));
+            copyField(record.species, sizeof(record.species), ref.thermo.rows[i].species);
+            record.enthalpy = ref.thermo.rows[i].enthalpy;
+            record.entropy = ref.thermo.rows[i].entropy;
+            record.gibbs = ref.thermo.rows[i].gibbs;
+        }
+        // Species keep their case: Co(s) and CO(g) differ
+        appendSnapshotTable(image, header.tables[SnapThermo], thermo,
+                            [&](size_t row) { return string(thermo[row].species); });
+    }
+
+    if (ref.isotopesLoaded) {
+        vector<SnapshotIsotope> isotopes;
+        vector<bool> firstOfElement;
+        for (const auto& element : ref.isotopes.elements) {
+            for (size_t i = 0; i < element.second.size(); i++) {
+                SnapshotIsotope record;
+                memset(&record, 0, sizeof(record));
+                copyField(record.symbol, sizeof(record.symbol), element.second[i].symbol);
+                record.massNumber = element.second[i].massNumber;
+                record.mass = element.second[i].mass;
+                record.abundance = element.second[i].abundance;
+                isotopes.push_back(record);
+                firstOfElement.push_back(i == 0);
+            }
+        }
+        appendSnapshotTable(image, header.tables[SnapIsotopes], isotopes, [&](size_t row) {
+            return firstOfElement[row] ? snapshotKey(isotopes[row].symbol) : string();
+        });
+    }
+
+    header.fileSize = image.size();
+    header.checksum = fnv1aHash(image.data() + sizeof(header), image.size() - sizeof(header));
+    memcpy(&image[0], &header, sizeof(header));
+
+    string temporary = path + ".tmp";
+    FILE* output = fopen(temporary.c_str(), "wb");
+    if (output == nullptr) {
+        error = "could not create '" + temporary + "'";
+        return false;
+    }
+    bool written = fwrite(image.data(), 1, image.size(), output) == image.size();
+    written = fclose(output) == 0 && written;
+#ifdef _WIN32
+    written = written && MoveFileExA(temporary.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+    written = written && rename(temporary.c_str(), path.c_str()) == 0;
+#endif
+    if (!written) {
+        remove(temporary.c_str());
+        error = "could not write '" + path + "'";
+        return false;
+    }
+    return true;
+}
+
+// Function to check a mapped snapshot's header and table directory, so
+// lookups can trust the offsets. This is cheap and runs on every open; the
+// payload checksum is left to verifySnapshotFile.
+static bool validateSnapshot(const MappedFile& file, const string& path, string& error) {
+    const SnapshotHeader& header = *(const SnapshotHeader*)file.data;
+    if (file.size < sizeof(SnapshotHeader) || memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+        error = "'" + path + "' is not a snapshot file";
+        return false;
+    }
+    if (header.version != SNAPSHOT_VERSION || header.tableCount != SnapTableCount) {
+        error = "'" + path + "' has format version " + to_string(header.version) + ", expected " +
+                to_string(SNAPSHOT_VERSION) + "; export it again";
+        return false;
+    }
+    if (header.fileSize != file.size) {
+        error = "'" + path + "' is truncated";
+        return false;
+    }
+    static const uint32_t recordSizes[SnapTableCount] = { sizeof(SnapshotElement), sizeof(SnapshotIon),
+                                                          sizeof(SnapshotIon), sizeof(SnapshotThermo),
+                                                          sizeof(SnapshotIsotope) };
+    for (int t = 0; t < SnapTableCount; t++) {
+        const SnapshotTableInfo& info = header.tables[t];
+        bool absent = info.buckets == 0 && info.rows == 0;
+        bool fits = info.recordSize == recordSizes[t] && (info.buckets & (info.buckets - 1)) == 0 &&
+                    info.buckets >= info.rows && info.recordsOffset % 8 == 0 && info.indexOffset % 4 == 0 &&
+                    info.recordsOffset + (uint64_t)info.rows * info.recordSize <= file.size &&
+                    info.indexOffset + (uint64_t)info.buckets * sizeof(uint32_t) <= file.size;
+        if (!absent && !fits) {
+            error = "'" + path + "' has a damaged table directory";
+            return false;
+        }
+    }
+    if (header.tables[SnapElements].buckets == 0 || header.tables[SnapCations].buckets == 0 ||
+        header.tables[SnapAnions].buckets == 0) {
+        error = "'" + path + "' is missing a required table";
+        return false;
+    }
+    return true;
+}
+
+// Function to map a snapshot and check it end to end, checksum included.
+// Run after every export and by --verify-snapshot; opening a snapshot only
+// checks its structure so it does not read every page.
+bool verifySnapshotFile(const string& path, string& error) {
+    MappedFile file;
+    if (!file.open(path, error) || !validateSnapshot(file, path, error)) {
+        return false;
+    }
+    const SnapshotHeader& header = *(const SnapshotHeader*)file.data;
+    if (fnv1aHash(file.data + sizeof(SnapshotHeader), file.size - sizeof(SnapshotHeader)) != header.checksum) {
+        error = "'" + path + "' failed its checksum";
+        return false;
+    }
+    return true;
+}
+
+// Reference tables served straight from a mapped snapshot file. Lookups
+// probe the prebuilt index and copy one fixed-width record; nothing is
+// parsed. Modes that only look up (one-shot, batch, server) skip
+// loadReferenceData and read the mapping from any thread; the rest still
+// build the in-memory tables from it. A refresh maps the new file and
+// swaps it in, and readers holding the old mapping keep it until they finish.
+class SnapshotBackend : public StorageBackend {
+public:
+    explicit SnapshotBackend(const string& path) : path(path) {}
+
+    const char* name() const override { return "snapshot"; }
+
+    bool lookupsInPlace() const override { return true; }
+
+    bool open() override {
+        auto start = chrono::steady_clock::now();
+        TraceScope trace(TraceConnect, "snapshot");
+        string error;
+        shared_ptr<MappedFile> next = make_shared<MappedFile>();
+        if (!next->open(path, error) || !validateSnapshot(*next, path, error)) {
+            fprintf(statusOut, "Error: snapshot %s\n", error.c_str());
+            return false;
+        }
+        atomic_store(&file, shared_ptr<const MappedFile>(next));
+        stamp = fileStamp();
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        fprintf(statusOut, "Mapped snapshot '%s' (%zu bytes) in %.3f ms.\n", path.c_str(), next->size, ms);
+        return true;
+    }
+
+    void close() override { atomic_store(&file, shared_ptr<const MappedFile>()); }
+
+    bool loadReferenceData(ReferenceData& ref) override {
+        shared_ptr<const MappedFile> view = atomic_load(&file);
+        ref.elements.clear();
+        ref.cations.clear();
+        ref.anions.clear();
+        ref.thermo.clear();
+        ref.isotopes.clear();
+
+        const SnapshotElement* elements = records<SnapshotElement>(*view, SnapElements);
+        for (uint32_t i = 0; i < table(*view, SnapElements).rows; i++) {
+            ref.elements.add(toElement(elements[i]));
+        }
+        for (int t = SnapCations; t <= SnapAnions; t++) {
+            const SnapshotIon* ions = records<SnapshotIon>(*view, t);
+            for (uint32_t i = 0; i < table(*view, t).rows; i++) {
+                (t == SnapCations ? ref.cations : ref.anions).add(toIon(ions[i]));
+            }
+        }
+        const SnapshotThermo* thermo = records<SnapshotThermo>(*view, SnapThermo);
+        for (uint32_t i = 0; i < table(*view, SnapThermo).rows; i++) {
+            ThermoRecord record;
+            record.species = snapshotText(thermo[i].species);
+            record.enthalpy = thermo[i].enthalpy;
+            record.entropy = thermo[i].entropy;
+            record.gibbs = thermo[i].gibbs;
+            ref.thermo.add(record);
+        }
+        const SnapshotIsotope* isotopes = records<SnapshotIsotope>(*view, SnapIsotopes);
+        for (uint32_t i = 0; i < table(*view, SnapIsotopes).rows; i++) {
+            IsotopeRecord record;
+            record.symbol = snapshotText(isotopes[i].symbol);
+            record.massNumber = isotopes[i].massNumber;
+            record.mass = isotopes[i].mass;
+            record.abundance = isotopes[i].abundance;
+            ref.isotopes.add(record);
+        }
+
+        ref.loaded = true;
+        ref.thermoLoaded = table(*view, SnapThermo).buckets != 0;
+        ref.isotopesLoaded = table(*view, SnapIsotopes).buckets != 0;
+        for (int t = 0; t < RefTableCount; t++) {
+            ref.versions[t] = stamp;
+        }
+        fprintf(statusOut, "Cached %zu elements, %zu cations and %zu anions.\n",
+                ref.elements.rows.size(), ref.cations.rows.size(), ref.anions.rows.size());
+        if (ref.thermoLoaded) {
+            fprintf(statusOut, "Cached %zu thermodynamic species.\n", ref.thermo.rows.size());
+        }
+        if (ref.isotopesLoaded) {
+            fprintf(statusOut, "Cached %zu isotopes.\n", ref.isotopes.count);
+        }
+        return true;
+    }
+
+    LookupStatus findElement(const string& symbol, ElementRecord& element) override {
+        shared_ptr<const MappedFile> view = atomic_load(&file);
+        const SnapshotElement* found = probe<SnapshotElement>(*view, SnapElements, symbol);
+        if (found == nullptr) {
+            return LookupNotFound;
+        }
+        element = toElement(*found);
+        return LookupFound;
+    }
+
+    LookupStatus findIon(bool isCation, const string& symbol, IonRecord& ion) override {
+        shared_ptr<const MappedFile> view = atomic_load(&file);
+        const SnapshotIon* found = probe<SnapshotIon>(*view, isCation ? SnapCations : SnapAnions, symbol);
+        if (found == nullptr) {
+            return LookupNotFound;
+        }
+        ion.symbol = snapshotText(found->symbol);
+        ion.name = snapshotText(found->name);
+        ion.charge = found->charge;
+        ion.atomicWeight = found->atomicWeight;
+        return LookupFound;
+    }
+
+    bool listElements(vector<ElementRecord>& elements) override {
+        shared_ptr<const MappedFile> view = atomic_load(&file);
+        const SnapshotElement* rows = records<SnapshotElement>(*view, SnapElements);
+        elements.clear();
+        for (uint32_t i = 0; i < table(*view, SnapElements).rows; i++) {
+            elements.push_back(toElement(rows[i]));
+        }
+        return true;
+    }
+
+    bool listIons(bool isCation, vector<IonRecord>& ions) override {
+        shared_ptr<const MappedFile> view = atomic_load(&file);
+        int t = isCation ? SnapCations : SnapAnions;
+        const SnapshotIon* rows = records<SnapshotIon>(*view, t);
+        ions.clear();
+        for (uint32_t i = 0; i < table(*view, t).rows; i++) {
+            ions.push_back(toIon(rows[i]));
+        }
+        return true;
+    }
+
+    bool referenceDataChanged(const ReferenceData&, bool& changed) override {
+        TableVersion current = fileStamp();
+        changed = current.rows != stamp.rows || current.version != stamp.version;
+        return true;
+    }
+
+    // A snapshot changes only when it is exported again; remap then. Tables
+    // that were never copied out of the mapping have nothing to reload.
+    bool refreshReferenceData(ReferenceData& ref, RefreshResult& result) override {
+        TableVersion current = fileStamp();
+        if (current.rows == stamp.rows && current.version == stamp.version) {
+            return true;
+        }
+        if (!open()) {
+            return false;
+        }
+        if (ref.loaded) {
+            return StorageBackend::refreshReferenceData(ref, result);
+        }
+        for (int t = 0; t < RefTableCount; t++) {
+            ref.versions[t] = stamp;
+            result.reloaded[t] = true;
+        }
+        return true;
+    }
+
+private:
+    static const SnapshotTableInfo& table(const MappedFile& view, int t) {
+        return ((const SnapshotHeader*)view.data)->tables[t];
+    }
+
+    template <typename Row>
+    static const Row* records(const MappedFile& view, int t) {
+        return (const Row*)(view.data + table(view, t).recordsOffset);
+    }
+
+    template <typename Row>
+    static const Row* probe(const MappedFile& view, int t, const string& upperSymbol) {
+        const SnapshotTableInfo& info = table(view, t);
+        if (info.buckets == 0) {
+            return nullptr;
+        }
+        const uint32_t* index = (const uint32_t*)(view.data + info.indexOffset);
+        const Row* rows = records<Row>(view, t);
+        size_t slot = fnv1aHash(upperSymbol.data(), upperSymbol.size()) & (info.buckets - 1);
+        for (uint32_t step = 0; step < info.buckets && index[slot] != 0; step++) {
+            uint32_t row = index[slot] - 1;
+            if (row < info.rows && symbolMatches(rows[row].symbol, upperSymbol)) {
+                return &rows[row];
+            }
+            slot = (slot + 1) & (info.buckets - 1);
+        }
+        return nullptr;
+    }
+
+    // Case-insensitive compare of a NUL-padded field without copying it;
+    // a field without a NUL ends at its width
+    template <size_t N>
+    static bool symbolMatches(const char (&field)[N], const string& upperSymbol) {
+        if (upperSymbol.size() > N) {
+            return false;
+        }
+        size_t i = 0;
+        for (; i < upperSymbol.size(); i++) {
+            if (toupper((unsigned char)field[i]) != (unsigned char)upperSymbol[i]) {
+                return false;
+            }
+        }
+        return i == N || field[i] == '\0';
+    }
+
+    static ElementRecord toElement(const SnapshotElement& source) {
+        ElementRecord element;
+        element.symbol = snapshotText(source.symbol);
+        element.name = snapshotText(source.name);
+        element.charge = source.charge;
+        element.hasCharge = source.hasCharge != 0;
+        element.atomicWeight = source.atomicWeight;
+        element.atomicNumber = source.atomicNumber;
+        element.hasAtomicNumber = source.hasAtomicNumber != 0;
+        return element;
+    }
+
+    static IonRecord toIon(const SnapshotIon& source) {
+        IonRecord ion;
+        ion.symbol = snapshotText(source.symbol);
+        ion.name = snapshotText(source.name);
+        ion.charge = source.charge;
+        ion.atomicWeight = source.atomicWeight;
+        return ion;
+    }
+
+    TableVersion fileStamp() const {
+        TableVersion version;
+        struct stat info;
+        if (stat(path.c_str(), &info) == 0) {
+            version.rows = (long long)info.st_size;
+            version.version = (long long)info.st_mtime;
+        }
+        return version;
+    }
+
+    string path;
+    shared_ptr<const MappedFile> file;
+    TableVersion stamp;
+};
+
+// Bounded pool of pre-opened backends (one ODBC connection each) shared
+// by the server workers and PipelinedBackend. acquire() blocks while every
+// connection is busy.
+class ConnectionPool {
+public:
+    // Opens up to size connections; returns how many came up
+    size_t open(size_t size, const function<StorageBackend*()>& create) {
+        for (size_t i = 0; i < size; i++) {
+            unique_ptr<StorageBackend> backend(create());
+            if (!backend->open()) {
+                break;
+            }
+            idle.push_back(backend.get());
+            all.push_back(std::move(backend));
+        }
+        return all.size();
+    }
+
+    void close() {
+        for (unique_ptr<StorageBackend>& backend : all) {
+            backend->close();
+        }
+        idle.clear();
+        all.clear();
+    }
+
+    StorageBackend* acquire() {
+        unique_lock<mutex> lock(guard);
+        available.wait(lock, [this]() { return !idle.empty(); });
+        StorageBackend* backend = idle.back();
+        idle.pop_back();
+        return backend;
+    }
+
+    void release(StorageBackend* backend) {
+        {
+            lock_guard<mutex> lock(guard);
+            idle.push_back(backend);
+        }
+        available.notify_one();
+    }
+
+    size_t size() const { return all.size(); }
+
+private:
+    vector<unique_ptr<StorageBackend>> all;
+    vector<StorageBackend*> idle;
+    mutex guard;
+    condition_variable available;
+};
+
+// Returns a pooled connection when it goes out of scope
+class PooledConnection {
+public:
+    explicit PooledConnection(ConnectionPool& pool) : pool(pool), backend(pool.acquire()) {}
+    ~PooledConnection() { pool.release(backend); }
+    StorageBackend* operator->() { return backend; }
+
+private:
+    ConnectionPool& pool;
+    StorageBackend* backend;
+};
+
+// Runs lookups and listings on a small pool of extra connections so that
+// independent queries overlap: both ion lookups of a molar-mass request run
+// at once, and with prefetching the next listings are fetched in the
+// background while the user is still typing. Connections open in the
+// background too.
+class PipelinedBackend : public StorageBackend {
+public:
+    PipelinedBackend(const function<StorageBackend*()>& create, size_t connections, bool prefetch)
+        : create(create), connections(connections), prefetch(prefetch) {}
+
+    ~PipelinedBackend() { close(); }
+
+    const char* name() const override { return "pipelined"; }
+
+    bool open() override {
+        opening = async(launch::async, [this]() { return pool.open(connections, create); }).share();
+        if (prefetch) {
+            prefetchElements();
+            prefetchIons(true);
+            prefetchIons(false);
+        }
+        return true;
+    }
+
+    void close() override {
+        if (!opening.valid()) {
+            return;
+        }
+        for (future<bool>* pending : { &elementListing, &cationListing, &anionListing }) {
+            if (pending->valid()) {
+                pending->wait();
+            }
+        }
+        opening.wait();
+        pool.close();
+        opening = shared_future<size_t>();
+    }
+
+    bool loadReferenceData(ReferenceData&) override {
+        return false;
+    }
+
+    LookupStatus findElement(const string& symbol, ElementRecord& element) override {
+        if (!connected(opening)) {
+            return LookupFailed;
+        }
+        PooledConnection connection(pool);
+        return connection->findElement(symbol, element);
+    }
+
+    LookupStatus findIon(bool isCation, const string& symbol, IonRecord& ion) override {
+        IonLookup result = findIonAsync(isCation, symbol).get();
+        ion = result.ion;
+        return result.status;
+    }
+
+    future<IonLookup> findIonAsync(bool isCation, const string& symbol) override {
+        shared_future<size_t> ready = opening;
+        return async(launch::async, [this, ready, isCation, symbol]() {
+            TraceScope trace(TraceLookup, isCation ? "cation" : "anion");
+            IonLookup result;
+            if (connected(ready)) {
+                PooledConnection connection(pool);
+                result.status = connection->findIon(isCation, symbol, result.ion);
+            }
+            return result;
+        });
+    }
+
+    // Hands out the prefetched listing and starts fetching the next one
+    bool listElements(vector<ElementRecord>& elements) override {
+        if (!elementListing.valid()) {
+            prefetchElements();
+        }
+        bool ok = elementListing.get();
+        elements.swap(elementRows);
+        if (prefetch) {
+            prefetchElements();
+        }
+        return ok;
+    }
+
+    bool listIons(bool isCation, vector<IonRecord>& ions) override {
+        future<bool>& listing = isCation ? cationListing : anionListing;
+        if (!listing.valid()) {
+            prefetchIons(isCation);
+        }
+        bool ok = listing.get();
+        ions.swap(isCation ? cationRows : anionRows);
+        if (prefetch) {
+            prefetchIons(isCation);
+        }
+        return ok;
+    }
+
+private:
+    static bool connected(const shared_future<size_t>& ready) {
+        return ready.valid() && ready.get() > 0;
+    }
+
+    void prefetchElements() {
+        shared_future<size_t> ready = opening;
+        elementListing = async(launch::async, [this, ready]() {
+            elementRows.clear();
+            if (!connected(ready)) {
+                return false;
+            }
+            PooledConnection connection(pool);
+            return connection->listElements(elementRows);
+        });
+    }
+
+    void prefetchIons(bool isCation) {
+        shared_future<size_t> ready = opening;
+        vector<IonRecord>& rows = isCation ? cationRows : anionRows;
+        (isCation ? cationListing : anionListing) = async(launch::async, [this, ready, isCation, &rows]() {
+            rows.clear();
+            if (!connected(ready)) {
+                return false;
+            }
+            PooledConnection connection(pool);
+            return connection->listIons(isCation, rows);
+        });
+    }
+
+    function<StorageBackend*()> create;
+    size_t connections;
+    bool prefetch;
+    ConnectionPool pool;
+    shared_future<size_t> opening;
+    future<bool> elementListing, cationListing, anionListing;
+    vector<ElementRecord> elementRows;
+    vector<IonRecord> cationRows, anionRows;
+};
+
+// Result formats selectable per invocation with --format
+enum OutputFormat {
+    OutputTable,
+    OutputJson,
+    OutputCsv
+};
+
+static OutputFormat outputFormat = OutputTable;
+
+// Function to parse a --format argument
+bool parseOutputFormat(const string& name, OutputFormat& format) {
+    if (name == "table") {
+        format = OutputTable;
+    } else if (name == "json") {
+        format = OutputJson;
+    } else if (name == "csv") {
+        format = OutputCsv;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Function to parse a thread, worker or connection count. Zero, negative
+// and non-numeric values are rejected rather than wrapped to huge counts.
+bool parseCountArgument(const string& text, const char* what, unsigned& count) {
+    char* end = nullptr;
+    long value = strtol(text.c_str(), &end, 10);
+    if (end == text.c_str() || *end != '\0' || value <= 0 || value > 1000000) {
+        fprintf(stderr, "Invalid %s '%s' (expected a positive number).\n", what, text.c_str());
+        return false;
+    }
+    count = (unsigned)value;
+    return true;
+}
+
+// Function to parse a finite number from the command line
+bool parseNumberArgument(const string& text, const char* what, double& number) {
+    char* end = nullptr;
+    double value = strtod(text.c_str(), &end);
+    if (end == text.c_str() || *end != '\0' || !isfinite(value)) {
+        fprintf(stderr, "Invalid %s '%s' (expected a number).\n", what, text.c_str());
+        return false;
+    }
+    number = value;
+    return true;
+}
+
+// One cell or field: text is rendered quoted in JSON/CSV, numbers are not
+struct OutputValue {
+    string text;
+    bool isText = false;
+    bool isNull = false;
+};
+
+static OutputValue textValue(const string& text) {
+    OutputValue value;
+    value.text = text;
+    value.isText = true;
+    return value;
+}
+
+static OutputValue numberValue(double number, int precision) {
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%.*f", precision, number);
+    OutputValue value;
+    value.text = buffer;
+    return value;
+}
+
+static OutputValue intValue(long number) {
+    OutputValue value;
+    value.text = to_string(number);
+    return value;
+}
+
+static OutputValue nullValue() {
+    OutputValue value;
+    value.text = "NULL";
+    value.isNull = true;
+    return value;
+}
+
+// A table column: JSON/CSV key, table header and padded width (0 = last)
+struct OutputColumn {
+    const char* key;
+    const char* header;
+    int width;
+};
+
+// Bytes buffered before a write is issued
+const size_t OUTPUT_FLUSH_BYTES = 1 << 16;
+
+// Writes tables and single records as a human table, JSON lines or CSV.
+// Everything goes through one reusable buffer that is handed to fwrite
+// when it passes OUTPUT_FLUSH_BYTES and when the writer goes away, so a
+// listing of any size costs a handful of writes.
+class ResultWriter {
+public:
+    explicit ResultWriter(OutputFormat format, FILE* out = stdout) : format(format), out(out) {
+        buffer.reserve(OUTPUT_FLUSH_BYTES + 1024);
+    }
+
+    ~ResultWriter() {
+        if (!buffer.empty()) {
+            flush();
+        }
+    }
+
+    OutputFormat kind() const { return format; }
+
+    // Free text for the human format only, e.g. step-by-step explanations
+    void note(const char* fmt, ...) {
+        if (format != OutputTable) {
+            return;
+        }
+        char text[512];
+        va_list args;
+        va_start(args, fmt);
+        int length = vsnprintf(text, sizeof(text), fmt, args);
+        va_end(args);
+        if (length > 0) {
+            buffer.append(text, min((size_t)length, sizeof(text) - 1));
+        }
+        maybeFlush();
+    }
+
+    void beginTable(const char* name, const char* heading, const vector<OutputColumn>& tableColumns) {
+        columns = tableColumns;
+        cellIndex = 0;
+        rowCount = 0;
+        if (format == OutputTable) {
+            int width = 0;
+            for (const OutputColumn& column : columns) {
+                width += (width ? 3 : 0) + (column.width ? column.width : 10);
+            }
+            rule.assign(max(width, 24), '-');
+            rule += '\n';
+            buffer += '\n';
+            buffer += heading;
+            buffer += '\n';
+            buffer += rule;
+            for (size_t i = 0; i < columns.size(); i++) {
+                appendTableCell(i, columns[i].header);
+            }
+            buffer += '\n';
+            buffer += rule;
+        } else if (format == OutputJson) {
+            buffer += "{\"table\":";
+            buffer += jsonQuote(name);
+            buffer += ",\"rows\":[";
+        } else {
+            for (size_t i = 0; i < columns.size(); i++) {
+                buffer += i ? "," : "";
+                buffer += columns[i].key;
+            }
+            buffer += '\n';
+        }
+    }
+
+    void cell(const OutputValue& value) {
+        if (format == OutputTable) {
+            appendTableCell(cellIndex, value.text);
+        } else if (format == OutputJson) {
+            buffer += cellIndex == 0 ? (rowCount ? ",{" : "{") : ",";
+            buffer += jsonQuote(columns[cellIndex].key);
+            buffer += ':';
+            appendJsonValue(value);
+        } else {
+            buffer += cellIndex ? "," : "";
+            appendCsvValue(value);
+        }
+        cellIndex++;
+    }
+
+    void endRow() {
+        buffer += format == OutputJson ? "}" : "\n";
+        cellIndex = 0;
+        rowCount++;
+        maybeFlush();
+    }
+
+    void endTable() {
+        if (format == OutputTable) {
+            buffer += rule;
+        } else if (format == OutputJson) {
+            buffer += "]}\n";
+        }
+        maybeFlush();
+    }
+
+    // A single result as label/value lines, one JSON object or a CSV row
+    void beginRecord(const char* name, const char* heading) {
+        fieldKeys.clear();
+        fieldValues.clear();
+        recordName = name;
+        if (format == OutputTable) {
+            buffer += "\n--- ";
+            buffer += heading;
+            buffer += " ---\n";
+        }
+    }
+
+    void field(const char* key, const char* label, const OutputValue& value, const char* unit = "") {
+        if (format == OutputTable) {
+            char line[512];
+            snprintf(line, sizeof(line), "%-15s%s%s\n", (string(label) + ":").c_str(), value.text.c_str(), unit);
+            buffer += line;
+            return;
+        }
+        fieldKeys.push_back(key);
+        fieldValues.push_back(value);
+    }
+
+    void endRecord() {
+        if (format == OutputJson) {
+            buffer += "{\"result\":";
+            buffer += jsonQuote(recordName);
+            for (size_t i = 0; i < fieldKeys.size(); i++) {
+                buffer += ',';
+                buffer += jsonQuote(fieldKeys[i]);
+                buffer += ':';
+                appendJsonValue(fieldValues[i]);
+            }
+            buffer += "}\n";
+        } else if (format == OutputCsv) {
+            for (size_t i = 0; i < fieldKeys.size(); i++) {
+                buffer += i ? "," : "";
+                buffer += fieldKeys[i];
+            }
+            buffer += '\n';
+            for (size_t i = 0; i < fieldValues.size(); i++) {
+                buffer += i ? "," : "";
+                appendCsvValue(fieldValues[i]);
+            }
+            buffer += '\n';
+        }
+        maybeFlush();
+    }
+
+    void flush() {
+        if (!buffer.empty()) {
+            fwrite(buffer.data(), 1, buffer.size(), out);
+            buffer.clear();
+        }
+        fflush(out);
+    }
+
+private:
+    void maybeFlush() {
+        if (buffer.size() >= OUTPUT_FLUSH_BYTES) {
+            fwrite(buffer.data(), 1, buffer.size(), out);
+            buffer.clear();
+        }
+    }
+
+    void appendTableCell(size_t index, const string& text) {
+        bool last = index + 1 == columns.size();
+        buffer += text;
+        if (!last && (int)text.size() < columns[index].width) {
+            buffer.append(columns[index].width - text.size(), ' ');
+        }
+        if (!last) {
+            buffer += " | ";
+        }
+    }
+
+    void appendJsonValue(const OutputValue& value) {
+        if (value.isNull) {
+            buffer += "null";
+        } else if (value.isText) {
+            buffer += jsonQuote(value.text);
+        } else {
+            buffer += value.text;
+        }
+    }
+
+    void appendCsvValue(const OutputValue& value) {
+        if (value.isNull) {
+            return;
+        }
+        if (!value.isText) {
+            buffer += value.text;
+            return;
+        }
+        buffer += '"';
+        for (char c : value.text) {
+            buffer += c;
+            if (c == '"') {
+                buffer += '"';
+            }
+        }
+        buffer += '"';
+    }
+
+    OutputFormat format;
+    FILE* out;
+    string buffer;
+    vector<OutputColumn> columns;
+    string rule;
+    size_t cellIndex = 0;
+    size_t rowCount = 0;
+    string recordName;
+    vector<string> fieldKeys;
+    vector<OutputValue> fieldValues;
+};
+
+// One suggestion: a table row, its edit distance to the query and whether
+// it matched as a prefix rather than a whole key
+struct SearchMatch {
+    uint32_t row;
+    int distance;
+    bool prefix;
+};
+
+// Trie over the upper-cased symbols and names of one table. Answers
+// exact, prefix and typo-tolerant (edit distance) queries for prompts.
+class SearchIndex {
+public:
+    template <typename Record>
+    void build(const vector<Record>& rows) {
+        nodes.assign(1, Node());
+        for (size_t row = 0; row < rows.size(); row++) {
+            insert(rows[row].symbol, (uint32_t)row);
+            insert(rows[row].name, (uint32_t)row);
+        }
+    }
+
+    bool empty() const { return nodes.size() <= 1; }
+
+    // Best rows first: whole-key matches, then prefixes (shortest key
+    // first), then keys within maxDistance edits of the query
+    void suggest(const string& query, size_t limit, vector<SearchMatch>& out) const {
+        out.clear();
+        if (query.empty() || empty()) {
+            return;
+        }
+        string key = upperKey(query);
+        vector<bool> seen;
+        auto take = [&](uint32_t row, int distance, bool prefix) {
+            if (row >= seen.size()) {
+                seen.resize(row + 1, false);
+            }
+            if (!seen[row] && out.size() < limit) {
+                seen[row] = true;
+                out.push_back({ row, distance, prefix });
+            }
+        };
+
+        // Walk the query; every key below that node is a prefix match
+        uint32_t node = 0;
+        for (size_t i = 0; i < key.size() && node != NO_NODE; i++) {
+            node = child(node, key[i]);
+        }
+        if (node != NO_NODE) {
+            for (uint32_t row : nodes[node].rows) {
+                take(row, 0, false);
+            }
+            vector<pair<size_t, uint32_t>> below;
+            collect(node, 0, below);
+            stable_sort(below.begin(), below.end(),
+                        [](const pair<size_t, uint32_t>& a, const pair<size_t, uint32_t>& b) { return a.first < b.first; });
+            for (const pair<size_t, uint32_t>& entry : below) {
+                take(entry.second, 0, true);
+            }
+        }
+
+        // Typo tolerance: one edit for short queries, two for longer ones
+        int maxDistance = key.size() <= 4 ? 1 : 2;
+        vector<pair<int, uint32_t>> fuzzy;
+        vector<int> firstRow(key.size() + 1);
+        for (size_t i = 0; i <= key.size(); i++) {
+            firstRow[i] = (int)i;
+        }
+        for (const pair<char, uint32_t>& edge : nodes[0].children) {
+            fuzzyWalk(edge.second, edge.first, key, firstRow, maxDistance, fuzzy);
+        }
+        stable_sort(fuzzy.begin(), fuzzy.end(),
+                    [](const pair<int, uint32_t>& a, const pair<int, uint32_t>& b) { return a.first < b.first; });
+        for (const pair<int, uint32_t>& entry : fuzzy) {
+            take(entry.second, entry.first, false);
+        }
+    }
+
+private:
+    static const uint32_t NO_NODE = 0xFFFFFFFFu;
+
+    struct Node {
+        vector<pair<char, uint32_t>> children;
+        vector<uint32_t> rows;
+    };
+
+    static string upperKey(const string& text) {
+        string key = text;
+        for (char &c : key) {
+            c = toupper((unsigned char)c);
+        }
+        return key;
+    }
+
+    uint32_t child(uint32_t node, char c) const {
+        for (const pair<char, uint32_t>& edge : nodes[node].children) {
+            if (edge.first == c) {
+                return edge.second;
+            }
+        }
+        return NO_NODE;
+    }
+
+    void insert(const string& text, uint32_t row) {
+        if (text.empty() || text == "NULL") {
+            return;
+        }
+        uint32_t node = 0;
+        for (char c : upperKey(text)) {
+            uint32_t next = child(node, c);
+            if (next == NO_NODE) {
+                next = (uint32_t)nodes.size();
+                nodes[node].children.push_back({ c, next });
+                nodes.push_back(Node());
+            }
+            node = next;
+        }
+        if (find(nodes[node].rows.begin(), nodes[node].rows.end(), row) == nodes[node].rows.end()) {
+            nodes[node].rows.push_back(row);
+        }
+    }
+
+    // Rows strictly below node, with the depth at which their key ends
+    void collect(uint32_t node, size_t depth, vector<pair<size_t, uint32_t>>& out) const {
+        for (const pair<char, uint32_t>& edge : nodes[node].children) {
+            for (uint32_t row : nodes[edge.second].rows) {
+                out.push_back({ depth + 1, row });
+            }
+            collect(edge.second, depth + 1, out);
+        }
+    }
+
+    // Levenshtein rows computed along trie paths; a branch is dropped as
+    // soon as every cell of its row exceeds maxDistance
+    void fuzzyWalk(uint32_t node, char c, const string& key, const vector<int>& previous,
+                   int maxDistance, vector<pair<int, uint32_t>>& out) const {
+        vector<int> current(key.size() + 1);
+        current[0] = previous[0] + 1;
+        int best = current[0];
+        for (size_t i = 1; i <= key.size(); i++) {
+            int replace = previous[i - 1] + (key[i - 1] == c ? 0 : 1);
+            current[i] = min(min(current[i - 1] + 1, previous[i] + 1), replace);
+            best = min(best, current[i]);
+        }
+        if (current[key.size()] <= maxDistance) {
+            for (uint32_t row : nodes[node].rows) {
+                out.push_back({ current[key.size()], row });
+            }
+        }
+        if (best > maxDistance) {
+            return;
+        }
+        for (const pair<char, uint32_t>& edge : nodes[node].children) {
+            fuzzyWalk(edge.second, edge.first, key, current, maxDistance, out);
+        }
+    }
+
+    vector<Node> nodes;
+};
+
+// Search indexes over the cached tables, built on first use
+struct SymbolSearch {
+    SearchIndex elements;
+    SearchIndex cations;
+    SearchIndex anions;
+    bool built = false;
+
+    const SearchIndex& ions(bool isCation) const {
+        return isCation ? cations : anions;
+    }
+};
+
+// Function to build the search indexes from the cached tables
+void buildSymbolSearch(const ReferenceData& ref, SymbolSearch& search) {
+    search.elements.build(ref.elements.rows);
+    search.cations.build(ref.cations.rows);
+    search.anions.build(ref.anions.rows);
+    search.built = true;
+}
+
+// Suggestions shown when a symbol is not found
+const size_t SEARCH_SUGGESTIONS = 8;
+
+// Function to resolve user input against a cached table: by symbol, then
+// by exact name, else print the closest suggestions. On success symbol is
+// upper-cased and display takes the row's own casing if matched by name.
+template <typename Record>
+static bool resolveSymbol(const ReferenceTable<Record>& table, const SearchIndex& index, const char* kind,
+                          string& display, string& symbol) {
+    if (table.find(symbol) != nullptr) {
+        return true;
+    }
+
+    vector<SearchMatch> matches;
+    index.suggest(display, SEARCH_SUGGESTIONS, matches);
+    if (!matches.empty() && matches[0].distance == 0 && !matches[0].prefix) {
+        display = table.rows[matches[0].row].symbol;
+        symbol = display;
+        for (char &c : symbol) {
+            c = toupper(c);
+        }
+        return true;
+    }
+
+    printf("%s '%s' not found.", kind, display.c_str());
+    if (matches.empty()) {
+        printf(" Enter ? to list them all.\n");
+        return false;
+    }
+    printf(" Did you mean:\n");
+    for (const SearchMatch& match : matches) {
+        const Record& row = table.rows[match.row];
+        printf("  %-10s %s\n", row.symbol.c_str(), row.name.c_str());
+    }
+    return false;
+}
+
+// Function to print a symbol/name listing
+template <typename Record>
+static void printSymbolListing(ResultWriter& writer, const char* title, const vector<Record>& rows) {
+    TraceScope trace(TraceOutput, title);
+    string heading = string("Available ") + title + ":";
+    writer.beginTable(title, heading.c_str(), { { "symbol", "Symbol", 10 }, { "name", "Name", 0 } });
+    for (const Record& row : rows) {
+        writer.cell(textValue(row.symbol));
+        writer.cell(textValue(row.name));
+        writer.endRow();
+    }
+    writer.endTable();
+}
+
+// Function to list available elements
+void listAvailableElements(StorageBackend& backend, const ReferenceData& ref) {
+    ResultWriter writer(outputFormat);
+
+    // Serve the listing from memory when the tables are cached
+    if (ref.loaded) {
+        printSymbolListing(writer, "Elements", ref.elements.rows);
+        return;
+    }
+
+    vector<ElementRecord> elements;
+    if (backend.listElements(elements)) {
+        printSymbolListing(writer, "Elements", elements);
+    }
+}
+
+// Function to print one element as a result record
+void printElementRecord(const ElementRecord& element, const string& symbolDisplay) {
+    TraceScope trace(TraceOutput, "element");
+    ResultWriter writer(outputFormat);
+
+    writer.beginRecord("element", "Element Information");
+    // Fall back to the user's input if the row has no symbol
+    writer.field("symbol", "Symbol", textValue(element.symbol.empty() ? symbolDisplay : element.symbol));
+    writer.field("name", "Name", textValue(element.name));
+    writer.field("atomicNumber", "Atomic Number", element.hasAtomicNumber ? intValue(element.atomicNumber) : nullValue());
+    writer.field("atomicWeight", "Atomic Weight", numberValue(element.atomicWeight, 4), " g/mol");
+    writer.field("charge", "Charge", element.hasCharge ? intValue(element.charge) : nullValue());
+    writer.endRecord();
+}
+
+// Function to look up an upper-cased element symbol, answering from the
+// in-memory table when available, else asking the backend
+LookupStatus lookupElement(StorageBackend& backend, const ReferenceData& ref, const string& symbol, ElementRecord& element) {
+    TraceScope trace(TraceLookup, "element");
+    if (!ref.loaded) {
+        return backend.findElement(symbol, element);
+    }
+    const ElementRecord* found = ref.elements.find(symbol);
+    if (found == nullptr) {
+        return LookupNotFound;
+    }
+    element = *found;
+    return LookupFound;
+}
+
+// Menu sessions recorded with --record, appended one JSON object per
+// action, e.g. {"session":"4711-1718000000","at":3.250,"op":"element",
+// "symbol":"FE","ms":0.081,"ok":true}. at is seconds since the session
+// started, so the gaps between actions are the user's think time.
+class SessionRecorder {
+public:
+    bool open(const string& path) {
+        file = fopen(path.c_str(), "ab");
+        if (file == nullptr) {
+            return false;
+        }
+        char id[64];
+#ifdef _WIN32
+        snprintf(id, sizeof(id), "%lu-%lld", (unsigned long)GetCurrentProcessId(), (long long)time(nullptr));
+#else
+        snprintf(id, sizeof(id), "%ld-%lld", (long)getpid(), (long long)time(nullptr));
+#endif
+        session = id;
+        start = chrono::steady_clock::now();
+        return true;
+    }
+
+    void close() {
+        if (file != nullptr) {
+            fclose(file);
+            file = nullptr;
+        }
+    }
+
+    // first/second are the resolved symbols; started is when the lookup began
+    void record(const char* op, const char* firstKey, const string& first, const char* secondKey,
+                const string& second, chrono::steady_clock::time_point started, bool ok) {
+        auto now = chrono::steady_clock::now();
+        double at = chrono::duration<double>(started - start).count();
+        double ms = chrono::duration<double, milli>(now - started).count();
+        string line = "{\"session\":" + jsonQuote(session);
+        char numbers[64];
+        snprintf(numbers, sizeof(numbers), ",\"at\":%.3f,\"op\":", at);
+        line += numbers;
+        line += jsonQuote(op);
+        line += string(",\"") + firstKey + "\":" + jsonQuote(first);
+        if (secondKey != nullptr) {
+            line += string(",\"") + secondKey + "\":" + jsonQuote(second);
+        }
+        snprintf(numbers, sizeof(numbers), ",\"ms\":%.3f,\"ok\":%s}\n", ms, ok ? "true" : "false");
+        line += numbers;
+        fputs(line.c_str(), file);
+        fflush(file);
+    }
+
+private:
+    FILE* file = nullptr;
+    string session;
+    chrono::steady_clock::time_point start;
+};
+
+// Set by --record; null when sessions are not recorded
+static SessionRecorder* sessionRecorder = nullptr;
+
+// Function to get element information by symbol
+void getElementInfo(StorageBackend& backend, const ReferenceData& ref, SymbolSearch& search) {
+    string symbol, symbolDisplay;
+
+    printf("\n=== Element Information Lookup ===\n");
+    
+    // Suggest matches from the search index; without cached tables there
+    // is no index, so show the full list up front
+    if (!ref.loaded) {
+        listAvailableElements(backend, ref);
+    } else if (!search.built) {
+        buildSymbolSearch(ref, search);
+    }
+    
+    printf("Enter element symbol or name (e.g., H, Fe, Iron; ? lists all): ");
+    cin >> symbol;
+    if (symbol == "?") {
+        listAvailableElements(backend, ref);
+        printf("Enter element symbol or name: ");
+        cin >> symbol;
+    }
+
+    // Store original casing
+    symbolDisplay = symbol;
+    
+    // Convert to uppercase for consistent matching
+    for (char &c : symbol) {
+        c = toupper(c);
+    }
+
+    auto started = chrono::steady_clock::now();
+    if (ref.loaded && !resolveSymbol(ref.elements, search.elements, "Element", symbolDisplay, symbol)) {
+        if (sessionRecorder != nullptr) {
+            sessionRecorder->record("element", "symbol", symbol, nullptr, "", started, false);
+        }
+        return;
+    }
+
+    ElementRecord element;
+    LookupStatus status = lookupElement(backend, ref, symbol, element);
+    if (status == LookupNotFound) {
+        printf("Element with symbol '%s' not found.\n", symbol.c_str());
+    }
+    if (status == LookupFound) {
+        printElementRecord(element, symbolDisplay);
+    }
+    if (sessionRecorder != nullptr) {
+        sessionRecorder->record("element", "symbol", symbol, nullptr, "", started, status == LookupFound);
+    }
+}
+
+// Function to look an ion up in the in-memory table
+IonLookup findCachedIon(const ReferenceData& ref, const string& ionSymbol, bool isCation) {
+    TraceScope trace(TraceLookup, isCation ? "cation" : "anion");
+    IonLookup result;
+    const IonRecord* ion = ref.ions(isCation).find(ionSymbol);
+    if (ion != nullptr) {
+        result.status = LookupFound;
+        result.ion = *ion;
+    } else {
+        result.status = LookupNotFound;
+    }
+    return result;
+}
+
+// Function to start an ion lookup: answered at once from the in-memory
+// table when available, else by the backend, possibly in the background
+future<IonLookup> lookupIon(StorageBackend& backend, const ReferenceData& ref, const string& ionSymbol, bool isCation) {
+    if (!ref.loaded) {
+        return backend.findIonAsync(isCation, ionSymbol);
+    }
+
+    promise<IonLookup> answer;
+    answer.set_value(findCachedIon(ref, ionSymbol, isCation));
+    return answer.get_future();
+}
+
+// Function to take the charge and atomic weight from a finished lookup
+bool acceptIonLookup(const IonLookup& result, const ReferenceData& ref, const string& ionSymbol, bool isCation,
+                     double& charge, double& atomicMass) {
+    // Default values in case of error
+    charge = 0.0;
+    atomicMass = 0.0;
+
+    if (result.status == LookupNotFound) {
+        printf("%s with symbol '%s' not found.\n", (isCation ? "Cation" : "Anion"), ionSymbol.c_str());
+    }
+    if (result.status != LookupFound) {
+        return false;
+    }
+
+    charge = result.ion.charge;
+    atomicMass = result.ion.atomicWeight;
+    if (!ref.loaded) {
+        char retrieved[96];
+        snprintf(retrieved, sizeof(retrieved), "%s charge %.2f, atomic weight %.4f", ionSymbol.c_str(), charge, atomicMass);
+        traceEvent("retrieved", retrieved);
+    }
+    return true;
+}
+
+// Function to get ion information (cation or anion). Nothing overlaps a
+// single lookup, so it skips the future and its shared state.
+bool getIonInfo(StorageBackend& backend, const ReferenceData& ref, const string& ionSymbol, bool isCation, double& charge, double& atomicMass) {
+    IonLookup result;
+    if (ref.loaded) {
+        result = findCachedIon(ref, ionSymbol, isCation);
+    } else {
+        TraceScope trace(TraceLookup, isCation ? "cation" : "anion");
+        result.status = backend.findIon(isCation, ionSymbol, result.ion);
+    }
+    return acceptIonLookup(result, ref, ionSymbol, isCation, charge, atomicMass);
+}
+
+// Function to list available ions
+void listAvailableIons(StorageBackend& backend, const ReferenceData& ref, bool isCation) {
+    const char* title = isCation ? "Cations" : "Anions";
+
+    ResultWriter writer(outputFormat);
+
+    // Serve the listing from memory when the tables are cached
+    if (ref.loaded) {
+        printSymbolListing(writer, title, ref.ions(isCation).rows);
+        return;
+    }
+
+    vector<IonRecord> ions;
+    if (backend.listIons(isCation, ions)) {
+        printSymbolListing(writer, title, ions);
+    }
+}
+
+// Function to find the lowest set bit of a non-zero word
+static inline int lowestBit(uint64_t bits) {
+#if defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index;
+    _BitScanForward64(&index, bits);
+    return (int)index;
+#elif defined(__GNUC__)
+    return __builtin_ctzll(bits);
+#else
+    int index = 0;
+    while ((bits & 1) == 0) {
+        bits >>= 1;
+        index++;
+    }
+    return index;
+#endif
+}
+
+// Function to split a line into whitespace-separated words
+static void splitWords(const string& line, vector<string>& words) {
+    words.clear();
+    size_t pos = 0;
+    while (pos < line.size()) {
+        while (pos < line.size() && isspace((unsigned char)line[pos])) {
+            pos++;
+        }
+        size_t begin = pos;
+        while (pos < line.size() && !isspace((unsigned char)line[pos])) {
+            pos++;
+        }
+        if (pos > begin) {
+            words.push_back(line.substr(begin, pos - begin));
+        }
+    }
+}
+
+// Marks a missing charge or atomic number in a ColumnTable; no predicate matches it
+const int32_t COLUMN_NULL = INT32_MIN;
+
+// Numeric fields a column scan can filter and order by
+enum ScanField {
+    ScanWeight,
+    ScanCharge,
+    ScanNumber
+};
+
+// The numeric columns of Elements, Cations or Anions, one contiguous array
+// per field, so a filtered scan reads only the columns it tests. Row i of
+// every array is row i of the table the columns were built from.
+struct ColumnTable {
+    vector<double> weights;
+    vector<int32_t> charges;
+    vector<int32_t> numbers;
+    unsigned long generation = 0;
+    bool built = false;
+
+    size_t size() const { return weights.size(); }
+
+    void clear() {
+        weights.clear();
+        charges.clear();
+        numbers.clear();
+        built = false;
+    }
+};
+
+// Column copies of the three symbol tables, rebuilt on first use after
+// the reference generation changes
+struct ColumnStore {
+    ColumnTable elements;
+    ColumnTable cations;
+    ColumnTable anions;
+};
+
+// Function to fill the columns of the element table
+static void buildColumnTable(const vector<ElementRecord>& rows, ColumnTable& table) {
+    table.clear();
+    table.weights.reserve(rows.size());
+    table.charges.reserve(rows.size());
+    table.numbers.reserve(rows.size());
+    for (const ElementRecord& row : rows) {
+        table.weights.push_back(row.atomicWeight);
+        table.charges.push_back(row.hasCharge ? row.charge : COLUMN_NULL);
+        table.numbers.push_back(row.hasAtomicNumber ? row.atomicNumber : COLUMN_NULL);
+    }
+    table.built = true;
+}
+
+// Function to fill the columns of an ion table; ions have no atomic number
+static void buildColumnTable(const vector<IonRecord>& rows, ColumnTable& table) {
+    table.clear();
+    table.weights.reserve(rows.size());
+    table.charges.reserve(rows.size());
+    for (const IonRecord& row : rows) {
+        table.weights.push_back(row.atomicWeight);
+        table.charges.push_back(row.charge);
+    }
+    table.numbers.assign(rows.size(), COLUMN_NULL);
+    table.built = true;
+}
+
+// Function to get the up-to-date columns of one table
+template <typename Record>
+static const ColumnTable& currentColumns(const ReferenceData& ref, const ReferenceTable<Record>& source,
+                                         ColumnTable& table) {
+    if (!table.built || table.generation != ref.generation || table.size() != source.rows.size()) {
+        buildColumnTable(source.rows, table);
+        table.generation = ref.generation;
+    }
+    return table;
+}
+
+// One filter: low <= field <= high; equality has low == high
+struct ScanPredicate {
+    ScanField field;
+    double low;
+    double high;
+};
+
+// A filtered scan: every predicate must hold. Matching rows come back in
+// table order unless ordered is set; limit 0 returns them all.
+struct ScanQuery {
+    vector<ScanPredicate> where;
+    bool ordered = false;
+    ScanField orderBy = ScanWeight;
+    bool descending = false;
+    size_t limit = 0;
+};
+
+// Function to keep the rows of one 64-row word whose value lies in
+// [low, high]; count is at most 64
+static uint64_t scanWordDouble(const double* values, size_t count, double low, double high) {
+    uint64_t bits = 0;
+    size_t i = 0;
+#ifdef CHEMDB_SSE2
+    __m128d lowVector = _mm_set1_pd(low), highVector = _mm_set1_pd(high);
+    for (; i + 2 <= count; i += 2) {
+        __m128d value = _mm_loadu_pd(values + i);
+        __m128d inside = _mm_and_pd(_mm_cmpge_pd(value, lowVector), _mm_cmple_pd(value, highVector));
+        bits |= (uint64_t)_mm_movemask_pd(inside) << i;
+    }
+#endif
+    for (; i < count; i++) {
+        bits |= (uint64_t)(values[i] >= low && values[i] <= high) << i;
+    }
+    return bits;
+}
+
+static uint64_t scanWordInt(const int32_t* values, size_t count, int32_t low, int32_t high) {
+    uint64_t bits = 0;
+    size_t i = 0;
+#ifdef CHEMDB_SSE2
+    __m128i lowVector = _mm_set1_epi32(low), highVector = _mm_set1_epi32(high);
+    for (; i + 4 <= count; i += 4) {
+        __m128i value = _mm_loadu_si128((const __m128i*)(values + i));
+        __m128i outside = _mm_or_si128(_mm_cmplt_epi32(value, lowVector), _mm_cmpgt_epi32(value, highVector));
+        bits |= (uint64_t)(~_mm_movemask_ps(_mm_castsi128_ps(outside)) & 0xF) << i;
+    }
+#endif
+    for (; i < count; i++) {
+        bits |= (uint64_t)(values[i] >= low && values[i] <= high) << i;
+    }
+    return bits;
+}
+
+// Function to AND one predicate into the selection bitmap, 64 rows per
+// word. Words with no rows left are skipped, so later predicates only
+// touch the parts of their column that can still match.
+static void applyScanPredicate(const ColumnTable& table, const ScanPredicate& predicate, vector<uint64_t>& mask) {
+    size_t rows = table.size();
+    if (predicate.field == ScanWeight) {
+        for (size_t word = 0; word < mask.size(); word++) {
+            if (mask[word] != 0) {
+                size_t base = word * 64;
+                mask[word] &= scanWordDouble(table.weights.data() + base, min<size_t>(64, rows - base),
+                                             predicate.low, predicate.high);
+            }
+        }
+        return;
+    }
+
+    // Integer bounds; COLUMN_NULL stays below every low bound
+    double low = max(ceil(predicate.low), (double)COLUMN_NULL + 1);
+    double high = min(floor(predicate.high), (double)INT32_MAX);
+    if (low > high) {
+        fill(mask.begin(), mask.end(), 0);
+        return;
+    }
+    const vector<int32_t>& column = predicate.field == ScanCharge ? table.charges : table.numbers;
+    for (size_t word = 0; word < mask.size(); word++) {
+        if (mask[word] != 0) {
+            size_t base = word * 64;
+            mask[word] &= scanWordInt(column.data() + base, min<size_t>(64, rows - base), (int32_t)low, (int32_t)high);
+        }
+    }
+}
+
+// Function to read the value a scan orders by; nulls sort last
+static double scanSortKey(const ColumnTable& table, ScanField field, uint32_t row, bool descending) {
+    if (field == ScanWeight) {
+        return table.weights[row];
+    }
+    int32_t value = field == ScanCharge ? table.charges[row] : table.numbers[row];
+    if (value == COLUMN_NULL) {
+        return descending ? -numeric_limits<double>::infinity() : numeric_limits<double>::infinity();
+    }
+    return value;
+}
+
+// Function to run a filtered scan, returning the matching row numbers
+void scanColumns(const ColumnTable& table, const ScanQuery& query, vector<uint32_t>& rows) {
+    TraceScope trace(TraceLookup, "column scan");
+    rows.clear();
+    size_t count = table.size();
+    vector<uint64_t> mask((count + 63) / 64, ~0ull);
+    if (count % 64 != 0) {
+        mask.back() = (1ull << (count % 64)) - 1;
+    }
+    for (const ScanPredicate& predicate : query.where) {
+        applyScanPredicate(table, predicate, mask);
+    }
+
+    for (size_t word = 0; word < mask.size(); word++) {
+        uint64_t bits = mask[word];
+        while (bits != 0) {
+            rows.push_back((uint32_t)(word * 64 + lowestBit(bits)));
+            bits &= bits - 1;
+        }
+    }
+    if (!query.ordered) {
+        if (query.limit > 0 && rows.size() > query.limit) {
+            rows.resize(query.limit);
+        }
+        return;
+    }
+
+    auto before = [&](uint32_t a, uint32_t b) {
+        double keyA = scanSortKey(table, query.orderBy, a, query.descending);
+        double keyB = scanSortKey(table, query.orderBy, b, query.descending);
+        if (keyA != keyB) {
+            return query.descending ? keyA > keyB : keyA < keyB;
+        }
+        return a < b;
+    };
+    if (query.limit > 0 && rows.size() > query.limit) {
+        partial_sort(rows.begin(), rows.begin() + query.limit, rows.end(), before);
+        rows.resize(query.limit);
+    } else {
+        sort(rows.begin(), rows.end(), before);
+    }
+}
+
+// Function to read a scan field name
+static bool parseScanField(const string& text, ScanField& field) {
+    if (text == "weight") {
+        field = ScanWeight;
+    } else if (text == "charge") {
+        field = ScanCharge;
+    } else if (text == "number") {
+        field = ScanNumber;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Function to read scan terms: field=value or field=low..high filters
+// (field is weight, charge or number; either end of a range may be left
+// out), "order" or "desc" followed by a field, and "limit" and a count
+bool parseScanQuery(const vector<string>& terms, ScanQuery& query, string& error) {
+    query = ScanQuery();
+    for (size_t i = 0; i < terms.size(); i++) {
+        const string& term = terms[i];
+        if (term == "order" || term == "desc" || term == "limit") {
+            if (i + 1 >= terms.size()) {
+                error = "'" + term + "' needs a value";
+                return false;
+            }
+            const string& value = terms[++i];
+            if (term == "limit") {
+                char* end;
+                long limit = strtol(value.c_str(), &end, 10);
+                if (end == value.c_str() || *end != '\0' || limit < 0) {
+                    error = "cannot read limit '" + value + "' (expected a count, 0 for no limit)";
+                    return false;
+                }
+                query.limit = (size_t)limit;
+            } else if (!parseScanField(value, query.orderBy)) {
+                error = "unknown field '" + value + "' (expected weight, charge or number)";
+                return false;
+            } else {
+                query.ordered = true;
+                query.descending = term == "desc";
+            }
+            continue;
+        }
+
+        size_t equals = term.find('=');
+        ScanPredicate predicate;
+        if (equals == string::npos || !parseScanField(term.substr(0, equals), predicate.field)) {
+            error = "cannot read '" + term + "' (expected e.g. weight=40..60 or charge=2)";
+            return false;
+        }
+        // Split at ".." first, since strtod would read "40." as a number
+        string value = term.substr(equals + 1);
+        size_t dots = value.find("..");
+        string lowText = value.substr(0, dots);
+        string highText = dots == string::npos ? lowText : value.substr(dots + 2);
+        char* lowEnd;
+        char* highEnd;
+        predicate.low = strtod(lowText.c_str(), &lowEnd);
+        predicate.high = strtod(highText.c_str(), &highEnd);
+        if ((dots == string::npos && lowText.empty()) || *lowEnd != '\0' || *highEnd != '\0') {
+            error = "cannot read the value in '" + term + "'";
+            return false;
+        }
+        // "..60" and "40.." leave one end open
+        if (lowText.empty()) {
+            predicate.low = -numeric_limits<double>::infinity();
+        }
+        if (highText.empty()) {
+            predicate.high = numeric_limits<double>::infinity();
+        }
+        if (predicate.low > predicate.high) {
+            swap(predicate.low, predicate.high);
+        }
+        query.where.push_back(predicate);
+    }
+    return true;
+}
+
+// Function to run a scan over Elements, Cations or Anions and print the
+// matching rows
+template <typename Record>
+static void printScanResult(const char* title, const vector<Record>& source, const ColumnTable& columns,
+                            const ScanQuery& query) {
+    vector<uint32_t> rows;
+    auto start = chrono::steady_clock::now();
+    scanColumns(columns, query, rows);
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+    TraceScope trace(TraceOutput, title);
+    ResultWriter writer(outputFormat);
+    string heading = string("Matching ") + title + ":";
+    writer.beginTable(title, heading.c_str(), { { "symbol", "Symbol", 10 }, { "name", "Name", 20 },
+                                                { "atomicWeight", "Atomic Weight", 13 }, { "charge", "Charge", 6 },
+                                                { "atomicNumber", "Number", 6 } });
+    for (uint32_t row : rows) {
+        writer.cell(textValue(source[row].symbol));
+        writer.cell(textValue(source[row].name));
+        writer.cell(numberValue(columns.weights[row], 4));
+        writer.cell(columns.charges[row] == COLUMN_NULL ? nullValue() : intValue(columns.charges[row]));
+        writer.cell(columns.numbers[row] == COLUMN_NULL ? nullValue() : intValue(columns.numbers[row]));
+        writer.endRow();
+    }
+    writer.endTable();
+    writer.note("%zu of %zu rows matched; scanned in %.3f ms.\n", rows.size(), columns.size(), ms);
+}
+
+// Function to filter one of the cached symbol tables, e.g. elements with
+// "weight=40..60 charge=2 order weight"
+bool runTableScan(const ReferenceData& ref, ColumnStore& store, const string& tableName,
+                  const vector<string>& terms, string& error) {
+    ScanQuery query;
+    if (!parseScanQuery(terms, query, error)) {
+        return false;
+    }
+    if (tableName == "elements") {
+        printScanResult("Elements", ref.elements.rows, currentColumns(ref, ref.elements, store.elements), query);
+    } else if (tableName == "cations") {
+        printScanResult("Cations", ref.cations.rows, currentColumns(ref, ref.cations, store.cations), query);
+    } else if (tableName == "anions") {
+        printScanResult("Anions", ref.anions.rows, currentColumns(ref, ref.anions, store.anions), query);
+    } else {
+        error = "unknown table '" + tableName + "' (expected elements, cations or anions)";
+        return false;
+    }
+    return true;
+}
+
+// Function to prompt for a filtered scan of one of the symbol tables
+void filterTablesPrompt(const ReferenceData& ref, ColumnStore& store) {
+    string line, error;
+
+    printf("\n=== Filter Elements and Ions ===\n");
+
+    if (!ref.loaded) {
+        printf("Filtering needs the reference tables in memory.\n");
+        return;
+    }
+
+    printf("Enter table and filters (e.g., elements weight=40..60 charge=2 order weight,\n"
+           "anions charge=-1 order weight limit 10): ");
+    cin >> ws;
+    getline(cin, line);
+    cin.unget(); // Leave the newline for the menu loop to discard
+
+    for (char &c : line) {
+        c = tolower(c);
+    }
+    vector<string> terms;
+    splitWords(line, terms);
+    if (terms.empty()) {
+        printf("No table given.\n");
+        return;
+    }
+    string table = terms[0];
+    terms.erase(terms.begin());
+    if (!runTableScan(ref, store, table, terms, error)) {
+        printf("Could not filter: %s\n", error.c_str());
+    }
+}
+
+// Result of balancing one cation with one anion
+struct IonicFormula {
+    int cationCount;
+    int anionCount;
+    double molarMass;
+};
+
+// Function to balance an ionic compound by cross-multiplying the charges
+// and reducing by their GCD. Pure and allocation-free so batch workers can
+// call it directly; returns false unless cation > 0 and anion < 0.
+inline bool balanceIonicCompound(int cationCharge, double cationMass, int anionCharge, double anionMass,
+                                 IonicFormula& formula) {
+    if (cationCharge <= 0 || anionCharge >= 0) {
+        return false;
+    }
+
+    int cationCount = -anionCharge;
+    int anionCount = cationCharge;
+
+    int a = cationCount;
+    int b = anionCount;
+    while (b != 0) {
+        int temp = b;
+        b = a % b;
+        a = temp;
+    }
+
+    formula.cationCount = cationCount / a;
+    formula.anionCount = anionCount / a;
+    formula.molarMass = formula.cationCount * cationMass + formula.anionCount * anionMass;
+    return true;
+}
+
+// Function to append one ion of a formula, bracketing polyatomic ions
+// that repeat, e.g. Ca(NO3)2. Returns the number of characters written.
+static size_t appendIonTerm(char* out, size_t capacity, const char* symbol, int count) {
+    bool polyatomic = false;
+    int capitals = 0;
+    for (const char* p = symbol; *p; p++) {
+        if (isdigit((unsigned char)*p) || (isupper((unsigned char)*p) && ++capitals > 1)) {
+            polyatomic = true;
+        }
+    }
+
+    int written;
+    if (count <= 1) {
+        written = snprintf(out, capacity, "%s", symbol);
+    } else if (polyatomic) {
+        written = snprintf(out, capacity, "(%s)%d", symbol, count);
+    } else {
+        written = snprintf(out, capacity, "%s%d", symbol, count);
+    }
+    if (written < 0) {
+        return 0;
+    }
+    return (size_t)written < capacity ? (size_t)written : capacity - 1;
+}
+
+// Function to write the formula of a balanced compound into out
+size_t formatIonicFormula(char* out, size_t capacity, const char* cation, const char* anion,
+                          const IonicFormula& formula) {
+    size_t length = appendIonTerm(out, capacity, cation, formula.cationCount);
+    length += appendIonTerm(out + length, capacity - length, anion, formula.anionCount);
+    return length;
+}
+
+// Function to print a balanced ionic compound: the step-by-step
+// explanation in table format, one result record otherwise
+void reportMolarMass(const IonRecord& cation, const string& cationSymbolDisplay,
+                     const IonRecord& anion, const string& anionSymbolDisplay) {
+    TraceScope trace(TraceOutput, "molar mass");
+    ResultWriter writer(outputFormat);
+
+    // Balance the charges and total the mass
+    IonicFormula formula;
+    if (!balanceIonicCompound(cation.charge, cation.atomicWeight, anion.charge, anion.atomicWeight, formula)) {
+        return;
+    }
+    double cationCharge = cation.charge, cationMass = cation.atomicWeight;
+    double anionCharge = anion.charge, anionMass = anion.atomicWeight;
+    int cationCount = formula.cationCount;
+    int anionCount = formula.anionCount;
+    double totalMolarMass = formula.molarMass;
+
+    char formulaText[64];
+    formatIonicFormula(formulaText, sizeof(formulaText), cationSymbolDisplay.c_str(), anionSymbolDisplay.c_str(), formula);
+
+    if (writer.kind() != OutputTable) {
+        writer.beginRecord("molarMass", "Calculation Results");
+        writer.field("cation", "Cation", textValue(cationSymbolDisplay));
+        writer.field("cationCharge", "Charge", intValue(cation.charge));
+        writer.field("cationWeight", "Atomic Weight", numberValue(cationMass, 4));
+        writer.field("anion", "Anion", textValue(anionSymbolDisplay));
+        writer.field("anionCharge", "Charge", intValue(anion.charge));
+        writer.field("anionWeight", "Atomic Weight", numberValue(anionMass, 4));
+        writer.field("cationCount", "Cations", intValue(cationCount));
+        writer.field("anionCount", "Anions", intValue(anionCount));
+        writer.field("formula", "Formula", textValue(formulaText));
+        writer.field("molarMass", "Molar Mass", numberValue(totalMolarMass, 4));
+        writer.endRecord();
+        return;
+    }
+
+    // Check if charges are equal
+    if (cationCount == 1 && anionCount == 1) {
+        // Display the result
+        writer.note("\n--- Calculation Results ---\n");
+        writer.note("Cation:        %s\n", cationSymbolDisplay.c_str());
+        writer.note("Charge:        %.2f\n", cationCharge);
+        writer.note("Atomic Weight: %.4f g/mol\n", cationMass);
+        writer.note("\n");
+        writer.note("Anion:         %s\n", anionSymbolDisplay.c_str());
+        writer.note("Charge:        %.2f\n", anionCharge);
+        writer.note("Atomic Weight: %.4f g/mol\n", anionMass);
+        
+        writer.note("\nThe charges have the same magnitude, so we have a 1:1 ratio.\n");
+        writer.note("\nChemical formula: %s\n", formulaText);
+        writer.note("Molar mass calculation: %.4f g/mol + %.4f g/mol = %.4f g/mol\n", 
+                    cationMass, anionMass, totalMolarMass);
+    } else {
+        // Display the result
+        writer.note("\n--- Calculation Results ---\n");
+        writer.note("Cation:        %s\n", cation.symbol.c_str());
+        writer.note("Charge:        %.2f\n", cationCharge);
+        writer.note("Atomic Weight: %.4f g/mol\n", cationMass);
+        writer.note("\n");
+        writer.note("Anion:         %s\n", anion.symbol.c_str());
+        writer.note("Charge:        %.2f\n", anionCharge);
+        writer.note("Atomic Weight: %.4f g/mol\n", anionMass);
+        
+        writer.note("\nCharge Balancing:\n");
+        writer.note("To balance charges (%.2f and %.2f), we need:\n", cationCharge, anionCharge);
+        writer.note("- %d %s ions (total charge: %.2f)\n", cationCount, cationSymbolDisplay.c_str(), cationCount * cationCharge);
+        writer.note("- %d %s ions (total charge: %.2f)\n", anionCount, anionSymbolDisplay.c_str(), anionCount * anionCharge);
+        writer.note("Total charge: %.2f (should be 0)\n", (cationCount * cationCharge) + (anionCount * anionCharge));
+        
+        writer.note("\nChemical formula: %s\n", formulaText);
+        
+        writer.note("Molar mass calculation: ");
+        writer.note("(%.4f g/mol x %d) + ", cationMass, cationCount);
+        writer.note("(%.4f g/mol x %d) = ", anionMass, anionCount);
+        writer.note("%.4f g/mol\n", totalMolarMass);
+    }
+}
+
+// Function to calculate molar mass of ionic compound
+void calculateMolarMass(StorageBackend& backend, const ReferenceData& ref, SymbolSearch& search) {
+    string cationSymbol, anionSymbol;
+    double cationCharge = 0.0, cationMass = 0.0, anionCharge = 0.0, anionMass = 0.0;
+    
+    printf("\n=== Ionic Compound Molar Mass Calculator ===\n");
+
+    if (ref.loaded && !search.built) {
+        buildSymbolSearch(ref, search);
+    }
+    
+    // List available cations when there is no search index to suggest from
+    if (!ref.loaded) {
+        listAvailableIons(backend, ref, true);
+    }
+    
+    // Get cation info
+    printf("Enter cation symbol or name (? lists all): ");
+    cin >> cationSymbol;
+    if (cationSymbol == "?") {
+        listAvailableIons(backend, ref, true);
+        printf("Enter cation symbol or name: ");
+        cin >> cationSymbol;
+    }
+    
+    // Store original symbol for display
+    string cationSymbolDisplay = cationSymbol;
+    
+    // Convert to uppercase for database lookup only
+    for (char &c : cationSymbol) {
+        c = toupper(c);
+    }
+    
+    if (ref.loaded && !resolveSymbol(ref.cations, search.cations, "Cation", cationSymbolDisplay, cationSymbol)) {
+        printf("Could not calculate molar mass due to missing cation information.\n");
+        return;
+    }
+    
+    // Start the cation lookup; against the database it runs while the
+    // anion listing and prompt are shown
+    future<IonLookup> cationLookup = lookupIon(backend, ref, cationSymbol, true);
+    
+    // List available anions when there is no search index to suggest from
+    if (!ref.loaded) {
+        listAvailableIons(backend, ref, false);
+    }
+    
+    // Get anion info
+    printf("Enter anion symbol or name (? lists all): ");
+    cin >> anionSymbol;
+    if (anionSymbol == "?") {
+        listAvailableIons(backend, ref, false);
+        printf("Enter anion symbol or name: ");
+        cin >> anionSymbol;
+    }
+    
+    // Store original symbol for display
+    string anionSymbolDisplay = anionSymbol;
+    
+    // Convert to uppercase for database lookup only
+    for (char &c : anionSymbol) {
+        c = toupper(c);
+    }
+    
+    // Record the pair however the calculation ends
+    auto started = chrono::steady_clock::now();
+    bool priced = false;
+    struct RecordOnExit {
+        function<void()> done;
+        ~RecordOnExit() { done(); }
+    } recordOnExit{ [&]() {
+        if (sessionRecorder != nullptr) {
+            sessionRecorder->record("molarmass", "cation", cationSymbol, "anion", anionSymbol, started, priced);
+        }
+    } };
+
+    if (ref.loaded && !resolveSymbol(ref.anions, search.anions, "Anion", anionSymbolDisplay, anionSymbol)) {
+        printf("Could not calculate molar mass due to missing anion information.\n");
+        return;
+    }
+    
+    future<IonLookup> anionLookup = lookupIon(backend, ref, anionSymbol, false);
+    
+    if (!acceptIonLookup(cationLookup.get(), ref, cationSymbol, true, cationCharge, cationMass)) {
+        printf("Could not calculate molar mass due to missing cation information.\n");
+        return;
+    }
+    
+    // Verify cation charge is positive
+    if (cationCharge <= 0) {
+        printf("Error: Cation charge must be positive. The database shows %s with charge %.2f\n", 
+               cationSymbol.c_str(), cationCharge);
+        return;
+    }
+    
+    if (!acceptIonLookup(anionLookup.get(), ref, anionSymbol, false, anionCharge, anionMass)) {
+        printf("Could not calculate molar mass due to missing anion information.\n");
+        return;
+    }
+    
+    // Verify anion charge is negative
+    if (anionCharge >= 0) {
+        printf("Error: Anion charge must be negative. The database shows %s with charge %.2f\n",
+               anionSymbol.c_str(), anionCharge);
+        return;
+    }
+    priced = true;
+    
+    IonRecord cation, anion;
+    cation.symbol = cationSymbol;
+    cation.charge = (int)cationCharge;
+    cation.atomicWeight = cationMass;
+    anion.symbol = anionSymbol;
+    anion.charge = (int)anionCharge;
+    anion.atomicWeight = anionMass;
+    reportMolarMass(cation, cationSymbolDisplay, anion, anionSymbolDisplay);
+}
+
+// Every neutral cation/anion salt from the cached ion tables, kept as
+// parallel arrays sorted by molar mass. Entries refer to ion rows, so the
+// formula text is produced by formatIonicFormula only when printed.
+struct CompoundIndex {
+    vector<double> masses;
+    vector<uint32_t> cationRows;
+    vector<uint32_t> anionRows;
+    vector<uint8_t> cationCounts;
+    vector<uint8_t> anionCounts;
+    bool built = false;
+
+    size_t size() const { return masses.size(); }
+
+    void clear() {
+        masses.clear();
+        cationRows.clear();
+        anionRows.clear();
+        cationCounts.clear();
+        anionCounts.clear();
+        built = false;
+    }
+
+    void push(double mass, uint32_t cation, uint32_t anion, const IonicFormula& formula) {
+        masses.push_back(mass);
+        cationRows.push_back(cation);
+        anionRows.push_back(anion);
+        cationCounts.push_back((uint8_t)formula.cationCount);
+        anionCounts.push_back((uint8_t)formula.anionCount);
+    }
+};
+
+// Function to append every valid salt of one cation (or one anion) to out
+static void enumerateCompounds(const ReferenceData& ref, bool isCation, uint32_t row, CompoundIndex& out) {
+    IonicFormula formula;
+    if (isCation) {
+        const IonRecord& cation = ref.cations.rows[row];
+        for (uint32_t a = 0; a < ref.anions.rows.size(); a++) {
+            const IonRecord& anion = ref.anions.rows[a];
+            if (balanceIonicCompound(cation.charge, cation.atomicWeight, anion.charge, anion.atomicWeight, formula)) {
+                out.push(formula.molarMass, row, a, formula);
+            }
+        }
+    } else {
+        const IonRecord& anion = ref.anions.rows[row];
+        for (uint32_t c = 0; c < ref.cations.rows.size(); c++) {
+            const IonRecord& cation = ref.cations.rows[c];
+            if (balanceIonicCompound(cation.charge, cation.atomicWeight, anion.charge, anion.atomicWeight, formula)) {
+                out.push(formula.molarMass, c, row, formula);
+            }
+        }
+    }
+}
+
+// Function to reorder all five arrays by an index permutation
+static void permuteCompounds(CompoundIndex& index, const vector<uint32_t>& order) {
+    CompoundIndex sorted;
+    sorted.masses.reserve(order.size());
+    sorted.cationRows.reserve(order.size());
+    sorted.anionRows.reserve(order.size());
+    sorted.cationCounts.reserve(order.size());
+    sorted.anionCounts.reserve(order.size());
+    for (uint32_t i : order) {
+        sorted.masses.push_back(index.masses[i]);
+        sorted.cationRows.push_back(index.cationRows[i]);
+        sorted.anionRows.push_back(index.anionRows[i]);
+        sorted.cationCounts.push_back(index.cationCounts[i]);
+        sorted.anionCounts.push_back(index.anionCounts[i]);
+    }
+    sorted.built = true;
+    index = std::move(sorted);
+}
+
+// Function to sort the index arrays by molar mass
+static void sortCompounds(CompoundIndex& index) {
+    vector<uint32_t> order(index.size());
+    for (uint32_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    const vector<double>& masses = index.masses;
+    stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return masses[a] < masses[b]; });
+    permuteCompounds(index, order);
+}
+
+// Function to build the compound index from the cached ion tables
+void buildCompoundIndex(const ReferenceData& ref, CompoundIndex& index) {
+    index.clear();
+    for (uint32_t c = 0; c < ref.cations.rows.size(); c++) {
+        enumerateCompounds(ref, true, c, index);
+    }
+    sortCompounds(index);
+}
+
+// Function to refresh the salts of one changed or newly added ion row.
+// Its old entries are compacted out and the new ones merged in, which is
+// linear in the index size instead of a full re-sort.
+void refreshCompoundIndex(const ReferenceData& ref, bool isCation, uint32_t row, CompoundIndex& index) {
+    if (!index.built) {
+        buildCompoundIndex(ref, index);
+        return;
+    }
+
+    // Drop the stale entries of this ion, keeping the survivors in order
+    const vector<uint32_t>& rows = isCation ? index.cationRows : index.anionRows;
+    size_t kept = 0;
+    for (size_t i = 0; i < index.size(); i++) {
+        if (rows[i] == row) {
+            continue;
+        }
+        index.masses[kept] = index.masses[i];
+        index.cationRows[kept] = index.cationRows[i];
+        index.anionRows[kept] = index.anionRows[i];
+        index.cationCounts[kept] = index.cationCounts[i];
+        index.anionCounts[kept] = index.anionCounts[i];
+        kept++;
+    }
+    index.masses.resize(kept);
+    index.cationRows.resize(kept);
+    index.anionRows.resize(kept);
+    index.cationCounts.resize(kept);
+    index.anionCounts.resize(kept);
+
+    // Append the ion's current salts, sort just those and merge
+    if (row < ref.ions(isCation).rows.size()) {
+        enumerateCompounds(ref, isCation, row, index);
+    }
+    vector<uint32_t> order(index.size());
+    for (uint32_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    const vector<double>& masses = index.masses;
+    auto byMass = [&](uint32_t a, uint32_t b) { return masses[a] < masses[b]; };
+    stable_sort(order.begin() + kept, order.end(), byMass);
+    inplace_merge(order.begin(), order.begin() + kept, order.end(), byMass);
+    permuteCompounds(index, order);
+}
+
+// Function to find the entries with minMass <= mass <= maxMass; the
+// matches are the contiguous slice [first, last) of the sorted arrays
+void findCompoundsInRange(const CompoundIndex& index, double minMass, double maxMass, size_t& first, size_t& last) {
+    first = lower_bound(index.masses.begin(), index.masses.end(), minMass) - index.masses.begin();
+    last = upper_bound(index.masses.begin() + first, index.masses.end(), maxMass) - index.masses.begin();
+}
+
+// Function to collect the k entries closest in mass to target, nearest first
+void findNearestCompounds(const CompoundIndex& index, double target, size_t k, vector<size_t>& out) {
+    out.clear();
+    size_t right = lower_bound(index.masses.begin(), index.masses.end(), target) - index.masses.begin();
+    size_t left = right;
+    while (out.size() < k && (left > 0 || right < index.size())) {
+        bool takeLeft = right >= index.size() ||
+            (left > 0 && target - index.masses[left - 1] <= index.masses[right] - target);
+        out.push_back(takeLeft ? --left : right++);
+    }
+}
+
+// Function to print one row of the compound index
+static void printCompound(const ReferenceData& ref, const CompoundIndex& index, size_t i) {
+    IonicFormula formula;
+    formula.cationCount = index.cationCounts[i];
+    formula.anionCount = index.anionCounts[i];
+    formula.molarMass = index.masses[i];
+
+    char text[64];
+    formatIonicFormula(text, sizeof(text), ref.cations.rows[index.cationRows[i]].symbol.c_str(),
+                       ref.anions.rows[index.anionRows[i]].symbol.c_str(), formula);
+    printf("%-20s | %12.4f\n", text, index.masses[i]);
+}
+
+// Function to list ionic compounds within a molar mass range
+void findCompoundsByMass(const ReferenceData& ref, CompoundIndex& index) {
+    const size_t maxShown = 50;
+    double minMass, maxMass;
+
+    printf("\n=== Ionic Compounds by Molar Mass ===\n");
+
+    if (!ref.loaded) {
+        printf("The compound search needs the ion tables in memory.\n");
+        return;
+    }
+    if (!index.built) {
+        buildCompoundIndex(ref, index);
+    }
+
+    printf("Enter molar mass range in g/mol (min max): ");
+    if (!(cin >> minMass >> maxMass)) {
+        cin.clear();
+        printf("Invalid range.\n");
+        return;
+    }
+    if (minMass > maxMass) {
+        swap(minMass, maxMass);
+    }
+
+    size_t first, last;
+    findCompoundsInRange(index, minMass, maxMass, first, last);
+
+    printf("\n%-20s | %12s\n", "Formula", "Molar Mass");
+    printf("-----------------------------------\n");
+    if (first == last) {
+        // Nothing inside the range, so show what lies closest to it
+        vector<size_t> nearest;
+        findNearestCompounds(index, (minMass + maxMass) / 2, 5, nearest);
+        for (size_t i : nearest) {
+            printCompound(ref, index, i);
+        }
+        printf("-----------------------------------\n");
+        printf("No compounds in range; showing the %zu closest of %zu.\n", nearest.size(), index.size());
+        return;
+    }
+    for (size_t i = first; i < last && i < first + maxShown; i++) {
+        printCompound(ref, index, i);
+    }
+    printf("-----------------------------------\n");
+    printf("%zu compounds in range", last - first);
+    if (last - first > maxShown) {
+        printf(" (first %zu shown)", maxShown);
+    }
+    printf(".\n");
+}
+
+// One building block of a reverse mass search: an element (charge is its
+// valence, taken from the Charge column) or an ion (charge is its charge)
+struct MassBlock {
+    string symbol;
+    double mass;
+    int charge;
+};
+
+// Relative slack added to the tolerance, so a mass exactly at its edge is
+// not lost to rounding in the running remainder
+const double MASS_SEARCH_EPSILON = 1e-9;
+
+// Limits of a reverse mass search
+struct MassSearchSettings {
+    double tolerance = 0.01;   // g/mol either side of the target
+    size_t maxSpecies = 0;     // distinct blocks per formula, 0 for no limit
+    size_t maxResults = 1000;  // closest candidates kept
+    unsigned threads = 0;      // 0 uses every core
+};
+
+// One formula found by the search; counts[i] belongs to blocks[i]
+struct MassCandidate {
+    vector<uint16_t> counts;
+    double mass;
+};
+
+// Result of a reverse mass search; candidates are nearest to the target first
+struct MassSearchResult {
+    vector<MassCandidate> candidates;
+    size_t matches = 0;        // all formulas within tolerance
+    size_t nodes = 0;          // partial formulas visited
+};
+
+// A partial formula: blocks [0, next) are decided, the rest are zero
+struct MassSearchNode {
+    size_t next;
+    double remaining;          // target minus the mass so far
+    int balance;               // charge (ions) or sum of valence - 2 (elements)
+    int valenceSum;
+    size_t species;
+    vector<uint16_t> counts;
+};
+
+// Branch-and-bound enumeration of every combination of blocks whose mass
+// is within tolerance of a target. Blocks are sorted by descending mass,
+// so each branch tries the heavy blocks first and a block's count is
+// capped by the mass still missing. Ion formulas must be charge-neutral;
+// element formulas must satisfy Senior's rules (even valence sum and a
+// non-negative ring/double-bond count). Both conditions are bounded on
+// every branch by the largest charge or unsaturation per unit mass that
+// the remaining blocks could still add.
+class MassSearch {
+public:
+    MassSearch(const vector<MassBlock>& blocks, bool ions, double target, const MassSearchSettings& settings)
+        : blocks(blocks), ions(ions), target(target), settings(settings),
+          tolerance(settings.tolerance + MASS_SEARCH_EPSILON * target) {
+        size_t count = blocks.size();
+        maxPositive.assign(count + 1, 0.0);
+        maxNegative.assign(count + 1, 0.0);
+        for (size_t i = count; i-- > 0;) {
+            double density = (ions ? blocks[i].charge : blocks[i].charge - 2) / blocks[i].mass;
+            maxPositive[i] = max(maxPositive[i + 1], density);
+            maxNegative[i] = max(maxNegative[i + 1], -density);
+        }
+    }
+
+    // Function to search from one node, collecting into the given result
+    void run(const MassSearchNode& node, MassSearchResult& result) {
+        MassSearchNode child = node;
+        search(child, result);
+    }
+
+    // Function to visit one node without descending, appending its
+    // children to out; used to split the tree between threads
+    void expand(const MassSearchNode& node, MassSearchResult& result, vector<MassSearchNode>& out) {
+        result.nodes++;
+        check(node, result);
+        if (node.species >= limit()) {
+            return;
+        }
+        for (size_t j = node.next; j < blocks.size(); j++) {
+            for (int n = 1; n <= maxCount(j, node.remaining); n++) {
+                MassSearchNode child = node;
+                place(child, j, n);
+                if (feasible(child)) {
+                    out.push_back(std::move(child));
+                }
+            }
+        }
+    }
+
+private:
+    const vector<MassBlock>& blocks;
+    bool ions;
+    double target;
+    const MassSearchSettings& settings;
+    double tolerance;             // settings.tolerance plus rounding slack
+    vector<double> maxPositive;   // largest balance per g/mol among blocks [i, end)
+    vector<double> maxNegative;
+
+    size_t limit() const { return settings.maxSpecies == 0 ? blocks.size() : settings.maxSpecies; }
+
+    int maxCount(size_t j, double remaining) const {
+        double count = floor((remaining + tolerance) / blocks[j].mass);
+        return count < 0 ? 0 : (int)min(count, 65535.0);
+    }
+
+    void place(MassSearchNode& node, size_t j, int n) const {
+        node.counts[j] = (uint16_t)n;
+        node.next = j + 1;
+        node.remaining -= n * blocks[j].mass;
+        node.balance += n * (ions ? blocks[j].charge : blocks[j].charge - 2);
+        node.valenceSum += n * blocks[j].charge;
+        node.species++;
+    }
+
+    // Function to tell whether the blocks after node.next can still fix the balance
+    bool feasible(const MassSearchNode& node) const {
+        double reach = max(0.0, node.remaining + tolerance);
+        if (ions) {
+            return node.balance + reach * maxPositive[node.next] >= -0.5 &&
+                   node.balance - reach * maxNegative[node.next] <= 0.5;
+        }
+        return node.balance + reach * maxPositive[node.next] >= -2.5;
+    }
+
+    void check(const MassSearchNode& node, MassSearchResult& result) {
+        if (node.species == 0 || fabs(node.remaining) > tolerance) {
+            return;
+        }
+        bool valid = ions ? node.balance == 0 : node.balance >= -2 && node.valenceSum % 2 == 0;
+        if (!valid) {
+            return;
+        }
+        if (ions) {
+            // Zn3F6 is ZnF2; only the smallest formula unit counts
+            int common = 0;
+            for (uint16_t count : node.counts) {
+                int a = common, b = count;
+                while (b != 0) {
+                    int t = a % b;
+                    a = b;
+                    b = t;
+                }
+                common = a;
+            }
+            if (common > 1) {
+                return;
+            }
+        }
+        result.matches++;
+        result.candidates.push_back({ node.counts, target - node.remaining });
+        if (result.candidates.size() >= settings.maxResults * 2) {
+            trim(result.candidates, target, settings.maxResults);
+        }
+    }
+
+    void search(MassSearchNode& node, MassSearchResult& result) {
+        result.nodes++;
+        check(node, result);
+        if (node.species >= limit()) {
+            return;
+        }
+        // Children are placed in node and undone, so nothing is copied
+        size_t next = node.next, species = node.species;
+        double remaining = node.remaining;
+        int balance = node.balance, valenceSum = node.valenceSum;
+        for (size_t j = next; j < blocks.size(); j++) {
+            int most = maxCount(j, remaining);
+            int least = 1;
+            if (j + 1 == blocks.size()) {
+                // The last block has to close the gap on its own
+                least = max(1, (int)ceil((remaining - tolerance) / blocks[j].mass));
+            }
+            for (int n = least; n <= most; n++) {
+                place(node, j, n);
+                if (feasible(node)) {
+                    search(node, result);
+                }
+                node.next = next;
+                node.species = species;
+                node.remaining = remaining;
+                node.balance = balance;
+                node.valenceSum = valenceSum;
+            }
+            node.counts[j] = 0;
+        }
+    }
+
+public:
+    // Function to keep the count candidates nearest to the target
+    static void trim(vector<MassCandidate>& candidates, double target, size_t count) {
+        auto nearer = [&](const MassCandidate& a, const MassCandidate& b) {
+            double da = fabs(a.mass - target), db = fabs(b.mass - target);
+            return da != db ? da < db : a.counts < b.counts;
+        };
+        if (candidates.size() > count) {
+            nth_element(candidates.begin(), candidates.begin() + count, candidates.end(), nearer);
+            candidates.resize(count);
+        }
+        sort(candidates.begin(), candidates.end(), nearer);
+    }
+};
+
+// Function to find every formula over the given blocks whose mass lies
+// within tolerance of target. The top of the search tree is expanded
+// until there are enough subtrees to keep every core busy; threads then
+// take subtrees from a shared counter and their results are merged.
+bool searchFormulasByMass(vector<MassBlock> blocks, bool ions, double target, const MassSearchSettings& settings,
+                          vector<MassBlock>& sortedBlocks, MassSearchResult& result, string& error) {
+    result = MassSearchResult();
+    if (blocks.empty()) {
+        error = "no elements or ions to build formulas from";
+        return false;
+    }
+    if (!(target > 0) || !(settings.tolerance >= 0)) {
+        error = "the target mass must be positive and the tolerance non-negative";
+        return false;
+    }
+    for (const MassBlock& block : blocks) {
+        if (!(block.mass > 0)) {
+            error = block.symbol + " has no mass";
+            return false;
+        }
+    }
+    stable_sort(blocks.begin(), blocks.end(), [](const MassBlock& a, const MassBlock& b) { return a.mass > b.mass; });
+    sortedBlocks = blocks;
+
+    MassSearch search(sortedBlocks, ions, target, settings);
+    unsigned threadCount = settings.threads;
+    if (threadCount == 0) {
+        threadCount = max(1u, thread::hardware_concurrency());
+    }
+
+    // Split the tree breadth-first into subtrees
+    MassSearchNode root{ 0, target, 0, 0, 0, vector<uint16_t>(sortedBlocks.size(), 0) };
+    vector<MassSearchNode> tasks{ root };
+    const size_t wanted = threadCount * 64;
+    for (int depth = 0; depth < 3 && tasks.size() < wanted; depth++) {
+        vector<MassSearchNode> next;
+        for (const MassSearchNode& node : tasks) {
+            search.expand(node, result, next);
+        }
+        tasks.swap(next);
+    }
+
+    vector<MassSearchResult> partial(threadCount);
+    atomic<size_t> nextTask(0);
+    vector<thread> workers;
+    for (unsigned t = 0; t < threadCount; t++) {
+        workers.emplace_back([&, t]() {
+            for (size_t i = nextTask++; i < tasks.size(); i = nextTask++) {
+                search.run(tasks[i], partial[t]);
+            }
+        });
+    }
+    for (thread& worker : workers) {
+        worker.join();
+    }
+
+    for (MassSearchResult& part : partial) {
+        result.matches += part.matches;
+        result.nodes += part.nodes;
+        result.candidates.insert(result.candidates.end(), part.candidates.begin(), part.candidates.end());
+    }
+    MassSearch::trim(result.candidates, target, settings.maxResults);
+    return true;
+}
+
+// Function to write a found formula: Hill order (C, H, then alphabetical)
+// for elements, cations then anions for ions
+static string formatMassCandidate(const vector<MassBlock>& blocks, bool ions, const MassCandidate& candidate) {
+    vector<size_t> order;
+    bool carbon = false;
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if (candidate.counts[i] > 0) {
+            order.push_back(i);
+            carbon = carbon || blocks[i].symbol == "C";
+        }
+    }
+    auto rank = [&](size_t i) {
+        if (ions) {
+            return blocks[i].charge > 0 ? 0 : 1;
+        }
+        if (carbon && blocks[i].symbol == "C") {
+            return 0;
+        }
+        return carbon && blocks[i].symbol == "H" ? 1 : 2;
+    };
+    stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return rank(a) != rank(b) ? rank(a) < rank(b) : blocks[a].symbol < blocks[b].symbol;
+    });
+
+    string text;
+    char term[64];
+    for (size_t i : order) {
+        if (ions) {
+            appendIonTerm(term, sizeof(term), blocks[i].symbol.c_str(), candidate.counts[i]);
+        } else if (candidate.counts[i] > 1) {
+            snprintf(term, sizeof(term), "%s%d", blocks[i].symbol.c_str(), candidate.counts[i]);
+        } else {
+            snprintf(term, sizeof(term), "%s", blocks[i].symbol.c_str());
+        }
+        text += term;
+    }
+    return text;
+}
+
+// Function to collect the search blocks named in symbols (any case), or
+// every element and ion with a non-zero charge when symbols is empty
+bool collectMassBlocks(const ReferenceData& ref, bool ions, const vector<string>& symbols,
+                       vector<MassBlock>& blocks, string& error) {
+    blocks.clear();
+    for (string symbol : symbols) {
+        for (char &c : symbol) {
+            c = toupper(c);
+        }
+        if (!ions) {
+            const ElementRecord* element = ref.elements.find(symbol);
+            if (element == nullptr) {
+                error = "unknown element '" + symbol + "'";
+                return false;
+            }
+            blocks.push_back({ element->symbol, element->atomicWeight, abs(element->charge) });
+            continue;
+        }
+        const IonRecord* ion = ref.cations.find(symbol);
+        if (ion == nullptr) {
+            ion = ref.anions.find(symbol);
+        }
+        if (ion == nullptr) {
+            error = "unknown ion '" + symbol + "'";
+            return false;
+        }
+        blocks.push_back({ ion->symbol, ion->atomicWeight, ion->charge });
+    }
+    if (!symbols.empty()) {
+        return true;
+    }
+
+    if (!ions) {
+        for (const ElementRecord& element : ref.elements.rows) {
+            if (element.hasCharge && element.charge != 0) {
+                blocks.push_back({ element.symbol, element.atomicWeight, abs(element.charge) });
+            }
+        }
+        return true;
+    }
+    for (const ReferenceTable<IonRecord>* table : { &ref.cations, &ref.anions }) {
+        for (const IonRecord& ion : table->rows) {
+            if (ion.charge != 0) {
+                blocks.push_back({ ion.symbol, ion.atomicWeight, ion.charge });
+            }
+        }
+    }
+    return true;
+}
+
+// Function to print the candidates of a reverse mass search
+static void printMassCandidates(const vector<MassBlock>& blocks, bool ions, double target,
+                                const MassSearchResult& result, double ms) {
+    TraceScope trace(TraceOutput, "mass search");
+    ResultWriter writer(outputFormat);
+    char heading[96];
+    snprintf(heading, sizeof(heading), "Formulas near %.4f g/mol, closest first:", target);
+    writer.beginTable("massCandidates", heading, { { "formula", "Formula", 24 }, { "molarMass", "Molar Mass", 12 },
+                                                   { "error", "Error", 10 } });
+    for (const MassCandidate& candidate : result.candidates) {
+        writer.cell(textValue(formatMassCandidate(blocks, ions, candidate)));
+        writer.cell(numberValue(candidate.mass, 4));
+        writer.cell(numberValue(candidate.mass - target, 4));
+        writer.endRow();
+    }
+    writer.endTable();
+    writer.note("%zu formulas within tolerance (%zu shown); searched %zu partial formulas in %.2f ms.\n",
+                result.matches, result.candidates.size(), result.nodes, ms);
+}
+
+// Function to list the formulas whose molar mass matches a measured one
+void findFormulasByMass(const ReferenceData& ref) {
+    double target, tolerance;
+    string mode, line, error;
+
+    printf("\n=== Formulas for a Measured Mass ===\n");
+
+    if (!ref.loaded) {
+        printf("The formula search needs the reference tables in memory.\n");
+        return;
+    }
+
+    printf("Enter target mass and tolerance in g/mol (e.g., 180.16 0.05): ");
+    if (!(cin >> target >> tolerance)) {
+        cin.clear();
+        printf("Invalid mass.\n");
+        return;
+    }
+    printf("Build from (E)lements or (I)ons? ");
+    cin >> mode;
+    bool ions = !mode.empty() && toupper((unsigned char)mode[0]) == 'I';
+    printf("Allowed %s separated by spaces (blank for %s): ", ions ? "ions" : "elements",
+           ions ? "any three ions" : "C H N O P S");
+    cin.ignore(numeric_limits<streamsize>::max(), '\n');
+    getline(cin, line);
+    cin.unget(); // Leave the newline for the menu loop to discard
+
+    vector<string> symbols;
+    splitWords(line, symbols);
+    MassSearchSettings settings;
+    settings.tolerance = tolerance;
+    settings.maxResults = 50;
+    if (symbols.empty()) {
+        if (ions) {
+            settings.maxSpecies = 3;
+        } else {
+            symbols = { "C", "H", "N", "O", "P", "S" };
+        }
+    }
+
+    vector<MassBlock> blocks, sorted;
+    MassSearchResult result;
+    auto start = chrono::steady_clock::now();
+    if (!collectMassBlocks(ref, ions, symbols, blocks, error) ||
+        !searchFormulasByMass(blocks, ions, target, settings, sorted, result, error)) {
+        printf("Could not search: %s\n", error.c_str());
+        return;
+    }
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    printMassCandidates(sorted, ions, target, result, ms);
+}
+
+// Function to run one reverse mass search from the command line:
+// --mass-search <mass> <tolerance> <elements|ions> [symbols...] with
+// --max-species, --max-results and --threads options among the symbols
+bool runMassSearch(const ReferenceData& ref, const vector<string>& args) {
+    if (!ref.loaded) {
+        fprintf(stderr, "The formula search needs the reference tables in memory.\n");
+        return false;
+    }
+    if (args[3] != "elements" && args[3] != "ions") {
+        fprintf(stderr, "Unknown building blocks '%s' (expected elements or ions).\n", args[3].c_str());
+        return false;
+    }
+    bool ions = args[3] == "ions";
+    double target;
+    MassSearchSettings settings;
+    if (!parseNumberArgument(args[1], "target mass", target) ||
+        !parseNumberArgument(args[2], "tolerance", settings.tolerance)) {
+        return false;
+    }
+    if (target <= 0 || settings.tolerance < 0) {
+        fprintf(stderr, "The target mass must be positive and the tolerance non-negative.\n");
+        return false;
+    }
+    vector<string> symbols;
+    unsigned count;
+    for (size_t i = 4; i < args.size(); i++) {
+        if (args[i] == "--max-species" && i + 1 < args.size()) {
+            if (!parseCountArgument(args[++i], "species limit", count)) {
+                return false;
+            }
+            settings.maxSpecies = count;
+        } else if (args[i] == "--max-results" && i + 1 < args.size()) {
+            if (!parseCountArgument(args[++i], "result limit", count)) {
+                return false;
+            }
+            settings.maxResults = count;
+        } else if (args[i] == "--threads" && i + 1 < args.size()) {
+            if (!parseCountArgument(args[++i], "thread count", settings.threads)) {
+                return false;
+            }
+        } else {
+            symbols.push_back(args[i]);
+        }
+    }
+
+    vector<MassBlock> blocks, sorted;
+    MassSearchResult result;
+    string error;
+    auto start = chrono::steady_clock::now();
+    if (!collectMassBlocks(ref, ions, symbols, blocks, error) ||
+        !searchFormulasByMass(blocks, ions, target, settings, sorted, result, error)) {
+        fprintf(stderr, "Could not search: %s\n", error.c_str());
+        return false;
+    }
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    printMassCandidates(sorted, ions, target, result, ms);
+    return true;
+}
+
+// Parsed formulas kept by each FormulaCache
+const size_t FORMULA_CACHE_SIZE = 4096;
+
+// Element counts of a parsed formula, one entry per element sorted by
+// its row in ReferenceData::elements
+struct ParsedFormula {
+    vector<pair<int, int>> counts; // (element row, atom count)
+    int charge = 0;
+    double molarMass = 0.0;
+};
+
+// Character classes usable in constant expressions, unlike <cctype>
+constexpr bool asciiDigit(char c) { return c >= '0' && c <= '9'; }
+constexpr bool asciiUpper(char c) { return c >= 'A' && c <= 'Z'; }
+constexpr bool asciiLower(char c) { return c >= 'a' && c <= 'z'; }
+constexpr bool asciiSpace(char c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+
+// Most atoms of one element a formula may hold, and the largest count or
+// multiplier it may write; keeps input like (H2O)2147483647 from overflowing
+const int MAX_FORMULA_ATOMS = 1000000;
+
+// Function to read an unsigned count at pos, or 1 when there is none.
+// Counts past MAX_FORMULA_ATOMS come back as MAX_FORMULA_ATOMS + 1.
+constexpr int readCount(const char* text, size_t& pos, size_t end) {
+    if (pos >= end || !asciiDigit(text[pos])) {
+        return 1;
+    }
+    int value = 0;
+    while (pos < end && asciiDigit(text[pos])) {
+        if (value <= MAX_FORMULA_ATOMS) {
+            value = value * 10 + (text[pos] - '0');
+        }
+        pos++;
+    }
+    return value <= MAX_FORMULA_ATOMS ? value : MAX_FORMULA_ATOMS + 1;
+}
+
+// Function to scale an atom count by a multiplier; false, leaving count
+// alone, when the product would pass MAX_FORMULA_ATOMS
+constexpr bool multiplyCount(int& count, int multiplier) {
+    long long product = (long long)count * multiplier;
+    if (product > MAX_FORMULA_ATOMS) {
+        return false;
+    }
+    count = (int)product;
+    return true;
+}
+
+static int readCount(const string& text, size_t& pos, size_t end) {
+    return readCount(text.c_str(), pos, end);
+}
+
+// Function to strip an ionic charge from the end of a formula and return
+// where the atoms end. Accepts "^2+", "+2", "+", "]4-" and "SO4 2-";
+// other digits before a sign are an atom count, so NO3- has charge -1.
+constexpr size_t parseChargeSuffix(const char* text, size_t size, int& charge) {
+    charge = 0;
+    size_t end = size;
+    while (end > 0 && asciiSpace(text[end - 1])) {
+        end--;
+    }
+    if (end == 0) {
+        return 0;
+    }
+
+    // Sign last, e.g. "4-" or "-"
+    if (text[end - 1] == '+' || text[end - 1] == '-') {
+        int sign = text[end - 1] == '+' ? 1 : -1;
+        size_t digits = end - 1;
+        while (digits > 0 && asciiDigit(text[digits - 1])) {
+            digits--;
+        }
+        bool explicitMagnitude = digits < end - 1 && digits > 0 &&
+            (text[digits - 1] == '^' || text[digits - 1] == ']' || asciiSpace(text[digits - 1]));
+        if (explicitMagnitude) {
+            size_t pos = digits;
+            charge = sign * readCount(text, pos, end);
+            return text[digits - 1] == '^' ? digits - 1 : digits;
+        }
+        charge = sign;
+        size_t cut = end - 1;
+        if (cut > 0 && text[cut - 1] == '^') {
+            cut--;
+        }
+        return cut;
+    }
+
+    // Sign then magnitude, e.g. "+2" or "^-3"
+    size_t digits = end;
+    while (digits > 0 && asciiDigit(text[digits - 1])) {
+        digits--;
+    }
+    if (digits < end && digits > 0 && (text[digits - 1] == '+' || text[digits - 1] == '-')) {
+        size_t pos = digits;
+        charge = (text[digits - 1] == '+' ? 1 : -1) * readCount(text, pos, end);
+        size_t cut = digits - 1;
+        if (cut > 0 && text[cut - 1] == '^') {
+            cut--;
+        }
+        return cut;
+    }
+
+    return end;
+}
+
+static size_t parseChargeSuffix(const string& text, int& charge) {
+    return parseChargeSuffix(text.c_str(), text.size(), charge);
+}
+
+// Function to parse a formula such as Ca(OH)2, CuSO4·5H2O or [Fe(CN)6]4-
+// into element counts. Groups may nest with () or [], hydrate parts are
+// joined by '·', '.' or '*' with an optional leading multiplier.
+bool parseFormula(const ReferenceData& ref, const string& formula, ParsedFormula& parsed, string& error) {
+    parsed.counts.clear();
+    parsed.molarMass = 0.0;
+
+    size_t end = parseChargeSuffix(formula, parsed.charge);
+
+    // Flat (element row, count) terms; groups multiply their own tail
+    vector<pair<int, int>> terms;
+    vector<size_t> groupStarts;
+    vector<char> groupClosers;
+    size_t partStart = 0;
+    int partMultiplier = 1;
+    string symbol;
+    size_t pos = 0;
+
+    auto finishPart = [&]() {
+        for (size_t i = partStart; i < terms.size(); i++) {
+            if (!multiplyCount(terms[i].second, partMultiplier)) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    while (pos < end) {
+        unsigned char c = (unsigned char)formula[pos];
+
+        if (isupper(c)) {
+            // Element symbol: one capital followed by lower-case letters
+            size_t start = pos++;
+            while (pos < end && islower((unsigned char)formula[pos])) {
+                pos++;
+            }
+            symbol.assign(formula, start, pos - start);
+            for (char &ch : symbol) {
+                ch = toupper(ch);
+            }
+            auto it = ref.elements.index.find(symbol);
+            if (it == ref.elements.index.end()) {
+                error = "unknown element '" + formula.substr(start, pos - start) + "'";
+                return false;
+            }
+            int count = readCount(formula, pos, end);
+            if (count > MAX_FORMULA_ATOMS) {
+                error = "count too large";
+                return false;
+            }
+            terms.push_back(make_pair((int)it->second, count));
+        } else if (c == '(' || c == '[') {
+            groupStarts.push_back(terms.size());
+            groupClosers.push_back(c == '(' ? ')' : ']');
+            pos++;
+        } else if (c == ')' || c == ']') {
+            if (groupStarts.empty() || groupClosers.back() != (char)c) {
+                error = "unbalanced brackets";
+                return false;
+            }
+            pos++;
+            int multiplier = readCount(formula, pos, end);
+            for (size_t i = groupStarts.back(); i < terms.size(); i++) {
+                if (!multiplyCount(terms[i].second, multiplier)) {
+                    error = "count too large";
+                    return false;
+                }
+            }
+            groupStarts.pop_back();
+            groupClosers.pop_back();
+        } else if (c == '.' || c == '*' || (c == 0xC2 && pos + 1 < end && (unsigned char)formula[pos + 1] == 0xB7)) {
+            // Hydrate separator; the middle dot is UTF-8 C2 B7
+            if (!groupStarts.empty()) {
+                error = "hydrate separator inside brackets";
+                return false;
+            }
+            if (!finishPart()) {
+                error = "count too large";
+                return false;
+            }
+            pos += c == 0xC2 ? 2 : 1;
+            partStart = terms.size();
+            partMultiplier = readCount(formula, pos, end);
+        } else if (isspace(c)) {
+            pos++;
+        } else {
+            error = string("unexpected character '") + (char)c + "'";
+            return false;
+        }
+    }
+
+    if (!groupStarts.empty()) {
+        error = "unbalanced brackets";
+        return false;
+    }
+    if (terms.empty()) {
+        error = "empty formula";
+        return false;
+    }
+    if (!finishPart()) {
+        error = "count too large";
+        return false;
+    }
+
+    // Merge repeated elements into one sorted count per element
+    sort(terms.begin(), terms.end());
+    for (const pair<int, int>& term : terms) {
+        if (!parsed.counts.empty() && parsed.counts.back().first == term.first) {
+            parsed.counts.back().second += term.second;
+            if (parsed.counts.back().second > MAX_FORMULA_ATOMS) {
+                error = "count too large";
+                return false;
+            }
+        } else {
+            parsed.counts.push_back(term);
+        }
+    }
+
+    for (const pair<int, int>& count : parsed.counts) {
+        parsed.molarMass += count.second * ref.elements.rows[count.first].atomicWeight;
+    }
+    return true;
+}
+
+// One row of the element table compiled into the program, for formulas
+// that are known when compiling
+struct StaticElement {
+    const char* symbol;
+    double atomicWeight;
+    int atomicNumber;
+};
+
+// dbo.Elements as generated into elements.inc by --emit-element-table.
+// The build task regenerates it from the dbo.Elements seed script before
+// compiling; loading reference data warns when the database has drifted.
+// The generator build (CHEMDB_ELEMENT_GENERATOR) only needs a placeholder.
+constexpr StaticElement staticElements[] = {
+#ifdef CHEMDB_ELEMENT_GENERATOR
+    { "H", 1.01, 1 },
+#else
+#include "elements.inc"
+#endif
+};
+
+const size_t STATIC_ELEMENT_COUNT = sizeof(staticElements) / sizeof(staticElements[0]);
+
+// Deepest bracket nesting and most element terms a constant formula may have
+const size_t STATIC_FORMULA_DEPTH = 16;
+const size_t STATIC_FORMULA_TERMS = 64;
+
+// Function to find a symbol in the compiled-in table, ignoring case the
+// way ReferenceData's index does; -1 when it is not there
+constexpr int staticElementIndex(const char* symbol, size_t length) {
+    for (size_t i = 0; i < STATIC_ELEMENT_COUNT; i++) {
+        const char* candidate = staticElements[i].symbol;
+        size_t j = 0;
+        while (j < length && candidate[j] != '\0') {
+            char a = asciiLower(symbol[j]) ? (char)(symbol[j] - 'a' + 'A') : symbol[j];
+            char b = asciiLower(candidate[j]) ? (char)(candidate[j] - 'a' + 'A') : candidate[j];
+            if (a != b) {
+                break;
+            }
+            j++;
+        }
+        if (j == length && candidate[j] == '\0') {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+// Deliberately not constexpr: reaching it while evaluating a constant
+// formula makes the compiler reject the formula
+inline double invalidConstantFormula() {
+    return numeric_limits<double>::quiet_NaN();
+}
+
+// Atom counts of a formula over the compiled-in table, indexed like
+// staticElements. error is set when the formula did not parse.
+struct ElementCounts {
+    int atoms[STATIC_ELEMENT_COUNT] = {};
+    int charge = 0;
+    const char* error = nullptr;
+
+    constexpr int count(const char* symbol) const {
+        size_t length = 0;
+        while (symbol[length] != '\0') {
+            length++;
+        }
+        int index = staticElementIndex(symbol, length);
+        return index < 0 ? 0 : atoms[index];
+    }
+
+    constexpr double molarMass() const {
+        if (error != nullptr) {
+            return invalidConstantFormula();
+        }
+        double mass = 0.0;
+        for (size_t i = 0; i < STATIC_ELEMENT_COUNT; i++) {
+            mass += atoms[i] * staticElements[i].atomicWeight;
+        }
+        return mass;
+    }
+};
+
+// Function to count the atoms of a formula at compile time. Accepts the
+// same syntax as parseFormula, with fixed limits on nesting and terms.
+constexpr ElementCounts countElements(const char* formula, size_t size) {
+    ElementCounts result;
+    // Reaching invalidConstantFormula() makes a constant evaluation fail,
+    // so a bad literal is rejected by _atoms as well as by _mm
+    auto fail = [&result](const char* message) {
+        result.error = message;
+        invalidConstantFormula();
+        return result;
+    };
+    size_t end = parseChargeSuffix(formula, size, result.charge);
+
+    int termElements[STATIC_FORMULA_TERMS] = {};
+    int termCounts[STATIC_FORMULA_TERMS] = {};
+    size_t terms = 0;
+    size_t groupStarts[STATIC_FORMULA_DEPTH] = {};
+    char groupClosers[STATIC_FORMULA_DEPTH] = {};
+    size_t depth = 0;
+    size_t partStart = 0;
+    int partMultiplier = 1;
+    size_t pos = 0;
+
+    while (pos < end) {
+        char c = formula[pos];
+
+        if (asciiUpper(c)) {
+            size_t start = pos++;
+            while (pos < end && asciiLower(formula[pos])) {
+                pos++;
+            }
+            int element = staticElementIndex(formula + start, pos - start);
+            if (element < 0) {
+                return fail("unknown element");
+            }
+            if (terms == STATIC_FORMULA_TERMS) {
+                return fail("too many terms");
+            }
+            termElements[terms] = element;
+            termCounts[terms] = readCount(formula, pos, end);
+            if (termCounts[terms] > MAX_FORMULA_ATOMS) {
+                return fail("count too large");
+            }
+            terms++;
+        } else if (c == '(' || c == '[') {
+            if (depth == STATIC_FORMULA_DEPTH) {
+                return fail("brackets nested too deeply");
+            }
+            groupStarts[depth] = terms;
+            groupClosers[depth] = c == '(' ? ')' : ']';
+            depth++;
+            pos++;
+        } else if (c == ')' || c == ']') {
+            if (depth == 0 || groupClosers[depth - 1] != c) {
+                return fail("unbalanced brackets");
+            }
+            pos++;
+            int multiplier = readCount(formula, pos, end);
+            depth--;
+            for (size_t i = groupStarts[depth]; i < terms; i++) {
+                if (!multiplyCount(termCounts[i], multiplier)) {
+                    return fail("count too large");
+                }
+            }
+        } else if (c == '.' || c == '*' || ((unsigned char)c == 0xC2 && pos + 1 < end && (unsigned char)formula[pos + 1] == 0xB7)) {
+            if (depth != 0) {
+                return fail("hydrate separator inside brackets");
+            }
+            for (size_t i = partStart; i < terms; i++) {
+                if (!multiplyCount(termCounts[i], partMultiplier)) {
+                    return fail("count too large");
+                }
+            }
+            pos += (unsigned char)c == 0xC2 ? 2 : 1;
+            partStart = terms;
+            partMultiplier = readCount(formula, pos, end);
+        } else if (asciiSpace(c)) {
+            pos++;
+        } else {
+            return fail("unexpected character");
+        }
+    }
+
+    if (depth != 0) {
+        return fail("unbalanced brackets");
+    }
+    if (terms == 0) {
+        return fail("empty formula");
+    }
+    for (size_t i = 0; i < terms; i++) {
+        int count = termCounts[i];
+        if ((i >= partStart && !multiplyCount(count, partMultiplier)) ||
+            result.atoms[termElements[i]] + count > MAX_FORMULA_ATOMS) {
+            return fail("count too large");
+        }
+        result.atoms[termElements[i]] += count;
+    }
+    return result;
+}
+
+// "Ca(OH)2"_atoms and "Ca(OH)2"_mm give the atom counts and molar mass of
+// a constant formula; used in a constant expression they cost nothing at
+// run time, and a formula that does not parse fails to compile.
+constexpr ElementCounts operator""_atoms(const char* formula, size_t size) {
+    return countElements(formula, size);
+}
+
+constexpr double operator""_mm(const char* formula, size_t size) {
+    return countElements(formula, size).molarMass();
+}
+
+// A formula evaluated when compiling. The benchmark runs these through the
+// run-time parser, and checkStaticElements compares both parsers on them.
+struct ConstantFormula {
+    const char* text;
+    ElementCounts atoms;
+    double molarMass;
+};
+
+#ifndef CHEMDB_ELEMENT_GENERATOR
+static_assert("H2O"_atoms.count("H") == 2 && "Ca(OH)2"_atoms.count("O") == 2 &&
+              "CuSO4.5H2O"_atoms.count("O") == 9 && "[Fe(CN)6]4-"_atoms.charge == -4,
+              "constant formula parser miscounts atoms");
+
+constexpr ConstantFormula constantFormulas[] = {
+    { "Ca(OH)2", "Ca(OH)2"_atoms, "Ca(OH)2"_mm },
+    { "CuSO4.5H2O", "CuSO4.5H2O"_atoms, "CuSO4.5H2O"_mm },
+    { "K4[Fe(CN)6]", "K4[Fe(CN)6]"_atoms, "K4[Fe(CN)6]"_mm },
+    { "C6H12O6", "C6H12O6"_atoms, "C6H12O6"_mm },
+    { "Al2(SO4)3", "Al2(SO4)3"_atoms, "Al2(SO4)3"_mm },
+    { "NaCl", "NaCl"_atoms, "NaCl"_mm },
+    { "H2O", "H2O"_atoms, "H2O"_mm },
+};
+#else
+constexpr ConstantFormula constantFormulas[] = {
+    { "H2", "H2"_atoms, "H2"_mm },
+};
+#endif
+
+const size_t CONSTANT_FORMULA_COUNT = sizeof(constantFormulas) / sizeof(constantFormulas[0]);
+
+// Function to tell whether parseFormula agrees with the compile-time
+// parser on a constant formula: same atoms, same molar mass
+static bool constantFormulaMatches(const ReferenceData& ref, const ConstantFormula& constant) {
+    ParsedFormula parsed;
+    string error;
+    if (!parseFormula(ref, constant.text, parsed, error)) {
+        return false;
+    }
+    int parsedAtoms = 0, constantAtoms = 0;
+    for (const pair<int, int>& count : parsed.counts) {
+        parsedAtoms += count.second;
+        if (constant.atoms.count(ref.elements.rows[count.first].symbol.c_str()) != count.second) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < STATIC_ELEMENT_COUNT; i++) {
+        constantAtoms += constant.atoms.atoms[i];
+    }
+    return parsedAtoms == constantAtoms && parsed.charge == constant.atoms.charge &&
+           fabs(parsed.molarMass - constant.molarMass) <= 1e-9 * max(1.0, constant.molarMass);
+}
+
+// Function to warn when the loaded Elements table no longer matches the
+// compiled-in copy, so constant formulas would disagree with lookups
+void checkStaticElements(const ReferenceData& ref) {
+    size_t differing = 0;
+    for (size_t i = 0; i < STATIC_ELEMENT_COUNT; i++) {
+        const StaticElement& known = staticElements[i];
+        string symbol = known.symbol;
+        for (char &c : symbol) {
+            c = toupper(c);
+        }
+        const ElementRecord* element = ref.elements.find(symbol);
+        if (element == nullptr || element->atomicWeight != known.atomicWeight) {
+            differing++;
+        }
+    }
+    if (differing > 0 || ref.elements.rows.size() != STATIC_ELEMENT_COUNT) {
+        fprintf(statusOut, "Warning: %zu compiled-in elements differ from dbo.Elements (%zu rows loaded, %zu compiled in); "
+                "regenerate elements.inc with --emit-element-table and rebuild.\n",
+                differing, ref.elements.rows.size(), STATIC_ELEMENT_COUNT);
+    }
+    for (const ConstantFormula& constant : constantFormulas) {
+        if (!constantFormulaMatches(ref, constant)) {
+            fprintf(statusOut, "Warning: constant formula %s evaluates differently at run time.\n", constant.text);
+        }
+    }
+}
+
+// Function to write elements.inc, the staticElements initializer for the
+// loaded Elements rows
+bool writeStaticElementTable(const ReferenceData& ref, const string& outputPath) {
+    FILE* output = outputPath == "-" ? stdout : fopen(outputPath.c_str(), "wb");
+    if (output == nullptr) {
+        fprintf(stderr, "Could not open output file '%s'.\n", outputPath.c_str());
+        return false;
+    }
+    fprintf(output, "// Generated from dbo.Elements by --emit-element-table; do not edit.\n");
+    for (const ElementRecord& element : ref.elements.rows) {
+        fprintf(output, "    { \"%s\", %.17g, %d },\n", element.symbol.c_str(), element.atomicWeight, element.atomicNumber);
+    }
+    if (output != stdout) {
+        fclose(output);
+    }
+    return true;
+}
+
+// Least-recently-used cache of parsed formulas keyed by the formula text.
+// Not synchronised: give each thread its own cache.
+class FormulaCache {
+public:
+    explicit FormulaCache(size_t capacity) : capacity(capacity) {}
+
+    // Returns the cached parse, parsing and inserting it on a miss;
+    // nullptr (with error set) when the formula does not parse
+    const ParsedFormula* lookup(const ReferenceData& ref, const string& formula, string& error) {
+        // Parses hold element rows and masses, so a refresh invalidates them
+        if (ref.generation != generation) {
+            clear();
+            generation = ref.generation;
+        }
+
+        auto it = entries.find(formula);
+        if (it != entries.end()) {
+            hits++;
+            order.splice(order.begin(), order, it->second);
+            return &it->second->second;
+        }
+
+        misses++;
+        ParsedFormula parsed;
+        if (!parseFormula(ref, formula, parsed, error)) {
+            return nullptr;
+        }
+
+        if (entries.size() >= capacity && !order.empty()) {
+            entries.erase(order.back().first);
+            order.pop_back();
+        }
+        order.emplace_front(formula, std::move(parsed));
+        entries[formula] = order.begin();
+        return &order.front().second;
+    }
+
+    void clear() {
+        order.clear();
+        entries.clear();
+    }
+
+    unsigned long hits = 0;
+    unsigned long misses = 0;
+
+private:
+    size_t capacity;
+    unsigned long generation = 0;
+    list<pair<string, ParsedFormula>> order;
+    unordered_map<string, list<pair<string, ParsedFormula>>::iterator> entries;
+};
+
+// Function to calculate the molar mass of a general formula
+void calculateFormulaMass(const ReferenceData& ref, FormulaCache& cache) {
+    string formula, error;
+
+    printf("\n=== Formula Molar Mass Calculator ===\n");
+
+    if (!ref.loaded) {
+        printf("Formula parsing needs the element table in memory.\n");
+        return;
+    }
+
+    printf("Enter formula (e.g., Ca(OH)2, CuSO4.5H2O, [Fe(CN)6]4-): ");
+    cin >> ws;
+    getline(cin, formula);
+    cin.unget(); // Leave the newline for the menu loop to discard
+
+    const ParsedFormula* parsed = cache.lookup(ref, formula, error);
+    if (parsed == nullptr) {
+        printf("Could not parse '%s': %s\n", formula.c_str(), error.c_str());
+        return;
+    }
+
+    TraceScope trace(TraceOutput, "formula");
+    ResultWriter writer(outputFormat);
+
+    if (writer.kind() != OutputTable) {
+        writer.beginTable("formulaElements", "", { { "element", "", 0 }, { "count", "", 0 },
+                                                   { "atomicWeight", "", 0 }, { "subtotal", "", 0 } });
+        for (const pair<int, int>& count : parsed->counts) {
+            const ElementRecord& element = ref.elements.rows[count.first];
+            writer.cell(textValue(element.symbol));
+            writer.cell(intValue(count.second));
+            writer.cell(numberValue(element.atomicWeight, 4));
+            writer.cell(numberValue(count.second * element.atomicWeight, 4));
+            writer.endRow();
+        }
+        writer.endTable();
+        writer.beginRecord("formula", "Calculation Results");
+        writer.field("formula", "Formula", textValue(formula));
+        writer.field("charge", "Charge", intValue(parsed->charge));
+        writer.field("molarMass", "Molar mass", numberValue(parsed->molarMass, 4));
+        writer.endRecord();
+        return;
+    }
+
+    writer.note("\n--- Calculation Results ---\n");
+    writer.note("%-10s | %6s | %12s | %12s\n", "Element", "Count", "Weight", "Subtotal");
+    writer.note("------------------------------------------------\n");
+    for (const pair<int, int>& count : parsed->counts) {
+        const ElementRecord& element = ref.elements.rows[count.first];
+        writer.note("%-10s | %6d | %12.4f | %12.4f\n", element.symbol.c_str(), count.second,
+                    element.atomicWeight, count.second * element.atomicWeight);
+    }
+    writer.note("------------------------------------------------\n");
+    if (parsed->charge != 0) {
+        writer.note("Charge:     %+d\n", parsed->charge);
+    }
+    writer.note("Molar mass: %.4f g/mol\n", parsed->molarMass);
+}
+
+// Function to print the molar mass of every formula in a file, one per
+// line, as CSV (or JSON with --format json). Repeated formulas are served
+// from the LRU cache.
+bool runFormulaBatch(const ReferenceData& ref, const string& inputPath, const string& outputPath) {
+    if (!ref.loaded) {
+        fprintf(stderr, "Formula batches need the element table in memory.\n");
+        return false;
+    }
+
+    ifstream input(inputPath);
+    if (!input) {
+        fprintf(stderr, "Could not open input file '%s'.\n", inputPath.c_str());
+        return false;
+    }
+
+    FILE* output = outputPath == "-" ? stdout : fopen(outputPath.c_str(), "wb");
+    if (output == nullptr) {
+        fprintf(stderr, "Could not open output file '%s'.\n", outputPath.c_str());
+        return false;
+    }
+    FormulaCache cache(FORMULA_CACHE_SIZE);
+    string line, error;
+    size_t total = 0, failed = 0;
+    auto start = chrono::steady_clock::now();
+
+    ResultWriter writer(outputFormat == OutputJson ? OutputJson : OutputCsv, output);
+    writer.beginTable("formulas", "", { { "formula", "", 0 }, { "charge", "", 0 },
+                                        { "molar_mass", "", 0 }, { "error", "", 0 } });
+    while (getline(input, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.empty()) {
+            continue;
+        }
+        total++;
+
+        const ParsedFormula* parsed = cache.lookup(ref, line, error);
+        writer.cell(textValue(line));
+        if (parsed == nullptr) {
+            failed++;
+            writer.cell(nullValue());
+            writer.cell(nullValue());
+            writer.cell(textValue(error));
+        } else {
+            writer.cell(intValue(parsed->charge));
+            writer.cell(numberValue(parsed->molarMass, 4));
+            writer.cell(nullValue());
+        }
+        writer.endRow();
+    }
+    writer.endTable();
+    writer.flush();
+
+    if (output != stdout) {
+        fclose(output);
+    }
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    fprintf(stderr, "Evaluated %zu formulas (%zu failed, %lu cache hits) in %.3f s\n",
+            total, failed, cache.hits, seconds);
+    return true;
+}
+
+// Mass of the electron in u, for the m/z of charged formulas
+const double ELECTRON_MASS = 0.000548579909;
+
+// Peaks below this share of the largest peak are not shown in the menu
+const double ISOTOPE_DISPLAY_MIN = 0.001;
+
+// Peak pairs one convolution may form before merging. Huge atom counts or
+// a near-zero threshold fail the formula instead of exhausting memory.
+const size_t MAX_ISOTOPE_PRODUCTS = 1 << 22;
+
+// One peak of an isotopic distribution
+struct IsotopePeak {
+    double mass;
+    double probability;
+};
+
+// Pruning for the convolution: after every multiplication peaks below
+// threshold times the largest one are dropped, and peaks closer than
+// resolution (u) are merged at their weighted mean mass. The default
+// resolution keeps the fine structure (13C vs 2H is 0.0029 u apart).
+struct IsotopeSettings {
+    double threshold = 1e-6;
+    double resolution = 1e-5;
+};
+
+// Isotopic fine structure of a formula, sorted by mass. Masses are m/z
+// for charged formulas. coverage is the probability kept after pruning.
+struct IsotopePattern {
+    vector<IsotopePeak> peaks;
+    double monoisotopic = 0.0;
+    double average = 0.0;
+    double coverage = 0.0;
+};
+
+// Function to sort peaks by mass, merge those within the resolution and
+// drop those below the threshold
+static void mergeIsotopePeaks(vector<IsotopePeak>& peaks, const IsotopeSettings& settings) {
+    sort(peaks.begin(), peaks.end(), [](const IsotopePeak& a, const IsotopePeak& b) { return a.mass < b.mass; });
+
+    size_t kept = 0;
+    double largest = 0.0;
+    for (size_t i = 0; i < peaks.size(); i++) {
+        if (kept > 0 && peaks[i].mass - peaks[kept - 1].mass <= settings.resolution) {
+            IsotopePeak& merged = peaks[kept - 1];
+            double probability = merged.probability + peaks[i].probability;
+            merged.mass = (merged.mass * merged.probability + peaks[i].mass * peaks[i].probability) / probability;
+            merged.probability = probability;
+        } else {
+            peaks[kept++] = peaks[i];
+        }
+        largest = max(largest, peaks[kept - 1].probability);
+    }
+    peaks.resize(kept);
+
+    double cutoff = largest * settings.threshold;
+    peaks.erase(remove_if(peaks.begin(), peaks.end(), [cutoff](const IsotopePeak& p) { return p.probability < cutoff; }),
+                peaks.end());
+}
+
+// Function to multiply two distributions. Pairs whose product falls below
+// the threshold are never formed: b is walked in falling probability, so
+// each row of the product stops at the first pair under the cutoff.
+// Returns false once more than MAX_ISOTOPE_PRODUCTS pairs would be formed.
+static bool convolveIsotopes(const vector<IsotopePeak>& a, const vector<IsotopePeak>& b,
+                             const IsotopeSettings& settings, vector<IsotopePeak>& out) {
+    vector<IsotopePeak> byProbability(b);
+    sort(byProbability.begin(), byProbability.end(),
+         [](const IsotopePeak& x, const IsotopePeak& y) { return x.probability > y.probability; });
+
+    double largestA = 0.0;
+    for (const IsotopePeak& peak : a) {
+        largestA = max(largestA, peak.probability);
+    }
+    double cutoff = settings.threshold * largestA * (byProbability.empty() ? 0.0 : byProbability[0].probability);
+
+    out.clear();
+    for (const IsotopePeak& x : a) {
+        for (const IsotopePeak& y : byProbability) {
+            double probability = x.probability * y.probability;
+            if (probability < cutoff) {
+                break;
+            }
+            if (out.size() >= MAX_ISOTOPE_PRODUCTS) {
+                out.clear();
+                return false;
+            }
+            out.push_back({ x.mass + y.mass, probability });
+        }
+    }
+    mergeIsotopePeaks(out, settings);
+    return true;
+}
+
+// Function to raise one element's distribution to an atom count by squaring
+static bool isotopePower(const vector<IsotopePeak>& element, int count, const IsotopeSettings& settings,
+                         vector<IsotopePeak>& out) {
+    vector<IsotopePeak> base = element, scratch;
+    out.assign(1, { 0.0, 1.0 });
+    while (count > 0) {
+        if (count & 1) {
+            if (!convolveIsotopes(out, base, settings, scratch)) {
+                return false;
+            }
+            out.swap(scratch);
+        }
+        count >>= 1;
+        if (count > 0) {
+            if (!convolveIsotopes(base, base, settings, scratch)) {
+                return false;
+            }
+            base.swap(scratch);
+        }
+    }
+    return true;
+}
+
+// Function to compute the isotopic pattern of a parsed formula
+bool computeIsotopePattern(const ReferenceData& ref, const ParsedFormula& parsed, const IsotopeSettings& settings,
+                           IsotopePattern& pattern, string& error) {
+    pattern = IsotopePattern();
+    vector<IsotopePeak> total(1, { 0.0, 1.0 }), element, power, scratch;
+
+    for (const pair<int, int>& count : parsed.counts) {
+        const string& symbol = ref.elements.rows[count.first].symbol;
+        const vector<IsotopeRecord>* isotopes = ref.isotopes.find(symbol);
+        if (isotopes == nullptr) {
+            error = "no isotope data for " + symbol;
+            return false;
+        }
+
+        // The monoisotopic mass uses the most abundant isotope of each element
+        element.clear();
+        const IsotopeRecord* mostAbundant = &(*isotopes)[0];
+        for (const IsotopeRecord& isotope : *isotopes) {
+            element.push_back({ isotope.mass, isotope.abundance });
+            if (isotope.abundance > mostAbundant->abundance) {
+                mostAbundant = &isotope;
+            }
+        }
+        pattern.monoisotopic += count.second * mostAbundant->mass;
+
+        if (!isotopePower(element, count.second, settings, power) || !convolveIsotopes(total, power, settings, scratch)) {
+            error = "isotope pattern too large";
+            return false;
+        }
+        total.swap(scratch);
+    }
+
+    // Report m/z for ions: remove the electrons and divide by the charge
+    int charge = parsed.charge;
+    auto toMz = [charge](double mass) { return charge == 0 ? mass : (mass - charge * ELECTRON_MASS) / abs(charge); };
+    pattern.monoisotopic = toMz(pattern.monoisotopic);
+    for (IsotopePeak& peak : total) {
+        peak.mass = toMz(peak.mass);
+        pattern.coverage += peak.probability;
+        pattern.average += peak.mass * peak.probability;
+    }
+    if (pattern.coverage > 0.0) {
+        pattern.average /= pattern.coverage;
+    }
+    pattern.peaks.swap(total);
+    return true;
+}
+
+// Function to show the isotopic pattern of a formula
+void calculateIsotopePattern(const ReferenceData& ref, FormulaCache& cache) {
+    string formula, error;
+
+    printf("\n=== Isotopic Pattern Calculator ===\n");
+
+    if (!ref.loaded || !ref.isotopesLoaded) {
+        printf("Isotopic patterns need the element and isotope tables in memory.\n");
+        return;
+    }
+
+    printf("Enter formula (e.g., C8H10N4O2, CuSO4.5H2O, [Fe(CN)6]4-): ");
+    cin >> ws;
+    getline(cin, formula);
+    cin.unget(); // Leave the newline for the menu loop to discard
+
+    const ParsedFormula* parsed = cache.lookup(ref, formula, error);
+    IsotopePattern pattern;
+    auto start = chrono::steady_clock::now();
+    if (parsed == nullptr || !computeIsotopePattern(ref, *parsed, IsotopeSettings(), pattern, error)) {
+        printf("Could not compute '%s': %s\n", formula.c_str(), error.c_str());
+        return;
+    }
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+    double largest = 0.0;
+    for (const IsotopePeak& peak : pattern.peaks) {
+        largest = max(largest, peak.probability);
+    }
+
+    TraceScope trace(TraceOutput, "isotopes");
+    ResultWriter writer(outputFormat);
+    const char* massHeader = parsed->charge == 0 ? "Mass (u)" : "m/z";
+    char heading[64];
+    snprintf(heading, sizeof(heading), "Isotopic peaks above %.1f%% of the largest:", ISOTOPE_DISPLAY_MIN * 100);
+    writer.beginTable("isotopePeaks", heading, { { "mass", massHeader, 14 }, { "probability", "Probability", 12 },
+                                            { "relative", "Relative %", 10 } });
+    for (const IsotopePeak& peak : pattern.peaks) {
+        if (peak.probability < largest * ISOTOPE_DISPLAY_MIN) {
+            continue;
+        }
+        writer.cell(numberValue(peak.mass, 6));
+        writer.cell(numberValue(peak.probability, 6));
+        writer.cell(numberValue(100.0 * peak.probability / largest, 2));
+        writer.endRow();
+    }
+    writer.endTable();
+    writer.beginRecord("isotopePattern", "Pattern Summary");
+    writer.field("formula", "Formula", textValue(formula));
+    writer.field("monoisotopic", "Monoisotopic", numberValue(pattern.monoisotopic, 6));
+    writer.field("average", "Average", numberValue(pattern.average, 6));
+    writer.field("peaks", "Peaks", intValue((long)pattern.peaks.size()));
+    writer.field("coverage", "Coverage", numberValue(pattern.coverage, 6));
+    writer.endRecord();
+    writer.note("Computed in %.2f ms.\n", ms);
+}
+
+// Function to write the isotopic pattern of every formula in a file as CSV
+// (or JSON with --format json), one row per peak. Formulas are split over
+// threads; rows come out in input order.
+bool runIsotopeBatch(const ReferenceData& ref, const string& inputPath, const string& outputPath,
+                     double threshold, unsigned threadCount) {
+    if (!ref.loaded || !ref.isotopesLoaded) {
+        fprintf(stderr, "Isotope batches need the element and isotope tables in memory.\n");
+        return false;
+    }
+
+    ifstream input(inputPath);
+    if (!input) {
+        fprintf(stderr, "Could not open input file '%s'.\n", inputPath.c_str());
+        return false;
+    }
+    vector<string> formulas;
+    string line;
+    while (getline(input, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (!line.empty()) {
+            formulas.push_back(line);
+        }
+    }
+
+    FILE* output = outputPath == "-" ? stdout : fopen(outputPath.c_str(), "wb");
+    if (output == nullptr) {
+        fprintf(stderr, "Could not open output file '%s'.\n", outputPath.c_str());
+        return false;
+    }
+
+    if (threadCount == 0) {
+        threadCount = max(1u, thread::hardware_concurrency());
+    }
+    threadCount = (unsigned)max<size_t>(1, min<size_t>(threadCount, formulas.size()));
+
+    IsotopeSettings settings;
+    if (threshold > 0.0) {
+        settings.threshold = threshold;
+    }
+    vector<IsotopePattern> patterns(formulas.size());
+    vector<string> errors(formulas.size());
+    auto start = chrono::steady_clock::now();
+
+    // Each worker parses with its own cache; the reference data is read-only
+    vector<thread> workers;
+    size_t slice = (formulas.size() + threadCount - 1) / threadCount;
+    for (unsigned t = 0; t < threadCount; t++) {
+        size_t begin = t * slice, end = min(formulas.size(), begin + slice);
+        workers.emplace_back([&, begin, end]() {
+            FormulaCache cache(FORMULA_CACHE_SIZE);
+            for (size_t i = begin; i < end; i++) {
+                const ParsedFormula* parsed = cache.lookup(ref, formulas[i], errors[i]);
+                if (parsed != nullptr && computeIsotopePattern(ref, *parsed, settings, patterns[i], errors[i])) {
+                    errors[i].clear();
+                }
+            }
+        });
+    }
+    for (thread& worker : workers) {
+        worker.join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    size_t failed = 0, peaks = 0;
+    ResultWriter writer(outputFormat == OutputJson ? OutputJson : OutputCsv, output);
+    writer.beginTable("isotopes", "", { { "formula", "", 0 }, { "mass", "", 0 }, { "probability", "", 0 },
+                                        { "relative", "", 0 }, { "error", "", 0 } });
+    for (size_t i = 0; i < formulas.size(); i++) {
+        if (!errors[i].empty()) {
+            failed++;
+            writer.cell(textValue(formulas[i]));
+            writer.cell(nullValue());
+            writer.cell(nullValue());
+            writer.cell(nullValue());
+            writer.cell(textValue(errors[i]));
+            writer.endRow();
+            continue;
+        }
+        double largest = 0.0;
+        for (const IsotopePeak& peak : patterns[i].peaks) {
+            largest = max(largest, peak.probability);
+        }
+        for (const IsotopePeak& peak : patterns[i].peaks) {
+            writer.cell(textValue(formulas[i]));
+            writer.cell(numberValue(peak.mass, 6));
+            writer.cell(numberValue(peak.probability, 9));
+            writer.cell(numberValue(100.0 * peak.probability / largest, 4));
+            writer.cell(nullValue());
+            writer.endRow();
+        }
+        peaks += patterns[i].peaks.size();
+    }
+    writer.endTable();
+    writer.flush();
+
+    if (output != stdout) {
+        fclose(output);
+    }
+
+    fprintf(stderr, "Computed %zu isotopic patterns (%zu failed, %zu peaks) in %.3f s on %u threads\n",
+            formulas.size(), failed, peaks, seconds, threadCount);
+    return true;
+}
+
+// A balanced reaction resolved against the thermodynamic table;
+// reactant coefficients are stored negative
+struct Reaction {
+    vector<pair<double, size_t>> terms; // (signed coefficient, thermo row)
+};
+
+// Standard reaction values: dH and dG in kJ/mol, dS in kJ/(mol K)
+struct ReactionEnergetics {
+    double enthalpy;
+    double entropy;
+    double gibbs;
+};
+
+// One "<coefficient> <species>" term of an equation; coefficient is 0
+// when none was written
+struct EquationTerm {
+    double coefficient = 0.0;
+    string species;
+};
+
+// Function to split one side of an equation on " + " into terms.
+// Species may contain '+', e.g. "Na+(aq)", so terms must be separated by
+// a plus surrounded by blanks.
+static bool parseEquationSide(const string& side, vector<EquationTerm>& terms, string& error) {
+    size_t start = 0;
+    while (start <= side.size()) {
+        size_t plus = side.find(" + ", start);
+        size_t stop = plus == string::npos ? side.size() : plus;
+
+        string term;
+        trimField(side, start, stop, term);
+        if (term.empty()) {
+            error = "empty term";
+            return false;
+        }
+
+        // Optional leading coefficient such as 2, 0.5 or 3/2
+        size_t pos = 0;
+        EquationTerm parsed;
+        if (isdigit((unsigned char)term[0])) {
+            parsed.coefficient = strtod(term.c_str(), nullptr);
+            while (pos < term.size() && (isdigit((unsigned char)term[pos]) || term[pos] == '.')) {
+                pos++;
+            }
+            if (pos < term.size() && term[pos] == '/') {
+                double denominator = strtod(term.c_str() + pos + 1, nullptr);
+                pos++;
+                while (pos < term.size() && isdigit((unsigned char)term[pos])) {
+                    pos++;
+                }
+                if (denominator == 0.0) {
+                    error = "zero denominator in '" + term + "'";
+                    return false;
+                }
+                parsed.coefficient /= denominator;
+            }
+            while (pos < term.size() && isspace((unsigned char)term[pos])) {
+                pos++;
+            }
+        }
+        parsed.species = term.substr(pos);
+        terms.push_back(parsed);
+
+        if (plus == string::npos) {
+            break;
+        }
+        start = plus + 3;
+    }
+    return true;
+}
+
+// Function to split an equation such as "2 H2(g) + O2(g) -> 2 H2O(l)" into
+// reactant and product terms. The arrow may be "->", "=>", "=" or the
+// UTF-8 arrow.
+bool parseEquation(const string& equation, vector<EquationTerm>& reactants, vector<EquationTerm>& products,
+                   string& error) {
+    static const char* arrows[] = { "->", "=>", "\xE2\x86\x92", "=" };
+
+    reactants.clear();
+    products.clear();
+    for (const char* arrow : arrows) {
+        size_t pos = equation.find(arrow);
+        if (pos == string::npos) {
+            continue;
+        }
+        return parseEquationSide(equation.substr(0, pos), reactants, error) &&
+               parseEquationSide(equation.substr(pos + strlen(arrow)), products, error);
+    }
+    error = "missing '->' between reactants and products";
+    return false;
+}
+
+// Function to resolve the terms of one side against the thermodynamic table
+static bool resolveReactionSide(const ThermoTable& thermo, const vector<EquationTerm>& terms, double sign,
+                                Reaction& reaction, string& error) {
+    for (const EquationTerm& term : terms) {
+        auto it = thermo.index.find(term.species);
+        if (it == thermo.index.end()) {
+            error = "no thermodynamic data for '" + term.species + "'";
+            return false;
+        }
+        double coefficient = term.coefficient == 0.0 ? 1.0 : term.coefficient;
+        reaction.terms.push_back(make_pair(sign * coefficient, it->second));
+    }
+    return true;
+}
+
+// Function to parse a balanced equation such as "2 H2(g) + O2(g) -> 2 H2O(l)"
+// against the thermodynamic table
+bool parseReaction(const ThermoTable& thermo, const string& equation, Reaction& reaction, string& error) {
+    vector<EquationTerm> reactants, products;
+    reaction.terms.clear();
+    return parseEquation(equation, reactants, products, error) &&
+           resolveReactionSide(thermo, reactants, -1.0, reaction, error) &&
+           resolveReactionSide(thermo, products, 1.0, reaction, error);
+}
+
+// Function to total products minus reactants for a parsed reaction
+ReactionEnergetics computeReactionEnergetics(const ThermoTable& thermo, const Reaction& reaction) {
+    ReactionEnergetics result = { 0.0, 0.0, 0.0 };
+    for (const pair<double, size_t>& term : reaction.terms) {
+        const ThermoRecord& record = thermo.rows[term.second];
+        result.enthalpy += term.first * record.enthalpy;
+        result.entropy += term.first * record.entropy;
+        result.gibbs += term.first * record.gibbs;
+    }
+    return result;
+}
+
+// A balanced equation: species text per side with the smallest positive
+// integer coefficients. inputBalanced is set when the coefficients as
+// written (1 where none was given) already conserved atoms and charge.
+struct BalancedEquation {
+    vector<string> reactants;
+    vector<string> products;
+    vector<long long> coefficients; // reactants first, then products
+    bool inputBalanced = false;
+};
+
+// Function to drop a trailing phase such as "(aq)" so the species parses as a formula
+static string stripPhase(const string& species) {
+    static const char* phases[] = { "(s)", "(l)", "(g)", "(aq)" };
+    for (const char* phase : phases) {
+        size_t length = strlen(phase);
+        if (species.size() > length && species.compare(species.size() - length, length, phase) == 0) {
+            return species.substr(0, species.size() - length);
+        }
+    }
+    return species;
+}
+
+// Overflow-checked helpers for the elimination below
+static bool checkedMultiply(long long a, long long b, long long& out) {
+    if (a != 0 && llabs(b) > LLONG_MAX / llabs(a)) {
+        return false;
+    }
+    out = a * b;
+    return true;
+}
+
+static bool checkedSubtract(long long a, long long b, long long& out) {
+    if ((b > 0 && a < LLONG_MIN + b) || (b < 0 && a > LLONG_MAX + b)) {
+        return false;
+    }
+    out = a - b;
+    return true;
+}
+
+static long long gcdOf(long long a, long long b) {
+    a = llabs(a);
+    b = llabs(b);
+    while (b != 0) {
+        long long t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Function to divide a row by the gcd of its entries
+static void reduceRow(vector<long long>& row) {
+    long long g = 0;
+    for (long long value : row) {
+        g = gcdOf(g, value);
+    }
+    if (g > 1) {
+        for (long long& value : row) {
+            value /= g;
+        }
+    }
+}
+
+// Function to balance an equation such as "Fe + O2 -> Fe2O3". Each species
+// becomes a column of atom counts (plus a charge row for ionic equations),
+// positive for reactants and negative for products, and the coefficients
+// span the null space of that matrix. The elimination is exact rational
+// arithmetic kept fraction-free: rows are combined by cross-multiplying
+// and divided by their gcd, so no rounding can fake or hide a solution.
+bool balanceEquation(const ReferenceData& ref, FormulaCache& cache, const string& equation,
+                     BalancedEquation& balanced, string& error) {
+    vector<EquationTerm> reactants, products;
+    if (!parseEquation(equation, reactants, products, error)) {
+        return false;
+    }
+
+    balanced = BalancedEquation();
+    vector<const EquationTerm*> terms;
+    for (const EquationTerm& term : reactants) {
+        balanced.reactants.push_back(term.species);
+        terms.push_back(&term);
+    }
+    for (const EquationTerm& term : products) {
+        balanced.products.push_back(term.species);
+        terms.push_back(&term);
+    }
+    size_t n = terms.size();
+
+    // Counts are copied out at once; the cache may evict earlier parses
+    unordered_map<int, size_t> elementRows;
+    vector<vector<long long>> matrix;
+    vector<long long> charges(n, 0);
+    bool charged = false;
+    for (size_t j = 0; j < n; j++) {
+        const ParsedFormula* parsed = cache.lookup(ref, stripPhase(terms[j]->species), error);
+        if (parsed == nullptr) {
+            error = "'" + terms[j]->species + "': " + error;
+            return false;
+        }
+        long long sign = j < reactants.size() ? 1 : -1;
+        for (const pair<int, int>& count : parsed->counts) {
+            auto row = elementRows.emplace(count.first, matrix.size());
+            if (row.second) {
+                matrix.emplace_back(n, 0);
+            }
+            matrix[row.first->second][j] += sign * count.second;
+        }
+        charges[j] = sign * parsed->charge;
+        charged = charged || parsed->charge != 0;
+    }
+    if (charged) {
+        matrix.push_back(charges);
+    }
+    size_t m = matrix.size();
+
+    // Note whether the written coefficients already balance
+    balanced.inputBalanced = true;
+    for (const vector<long long>& row : matrix) {
+        double sum = 0.0, scale = 0.0;
+        for (size_t j = 0; j < n; j++) {
+            double coefficient = terms[j]->coefficient == 0.0 ? 1.0 : terms[j]->coefficient;
+            sum += row[j] * coefficient;
+            scale += fabs(row[j] * coefficient);
+        }
+        balanced.inputBalanced = balanced.inputBalanced && fabs(sum) <= 1e-9 * max(1.0, scale);
+    }
+
+    // Reduced row echelon form
+    vector<size_t> pivots;
+    for (size_t col = 0; col < n && pivots.size() < m; col++) {
+        size_t rank = pivots.size(), pivot = rank;
+        while (pivot < m && matrix[pivot][col] == 0) {
+            pivot++;
+        }
+        if (pivot == m) {
+            continue;
+        }
+        swap(matrix[pivot], matrix[rank]);
+        for (size_t r = 0; r < m; r++) {
+            if (r == rank || matrix[r][col] == 0) {
+                continue;
+            }
+            long long factor = matrix[r][col], lead = matrix[rank][col];
+            for (size_t c = 0; c < n; c++) {
+                long long left, right;
+                if (!checkedMultiply(matrix[r][c], lead, left) || !checkedMultiply(matrix[rank][c], factor, right) ||
+                    !checkedSubtract(left, right, matrix[r][c])) {
+                    error = "coefficients too large";
+                    return false;
+                }
+            }
+            reduceRow(matrix[r]);
+        }
+        pivots.push_back(col);
+    }
+
+    size_t freeCount = n - pivots.size();
+    if (freeCount == 0) {
+        error = "cannot be balanced: no coefficients conserve every element" + string(charged ? " and the charge" : "");
+        return false;
+    }
+    if (freeCount > 1) {
+        error = "underdetermined: " + to_string(freeCount) +
+                " independent reactions combine here; balance them separately";
+        return false;
+    }
+
+    // One free species: give it the lcm of the pivots so the rest stay integral
+    vector<bool> isPivot(n, false);
+    for (size_t col : pivots) {
+        isPivot[col] = true;
+    }
+    size_t freeCol = find(isPivot.begin(), isPivot.end(), false) - isPivot.begin();
+    long long scale = 1;
+    for (size_t r = 0; r < pivots.size(); r++) {
+        long long lead = llabs(matrix[r][pivots[r]]);
+        if (!checkedMultiply(scale / gcdOf(scale, lead), lead, scale)) {
+            error = "coefficients too large";
+            return false;
+        }
+    }
+    vector<long long>& x = balanced.coefficients;
+    x.assign(n, 0);
+    x[freeCol] = scale;
+    for (size_t r = 0; r < pivots.size(); r++) {
+        if (!checkedMultiply(-matrix[r][freeCol], scale / matrix[r][pivots[r]], x[pivots[r]])) {
+            error = "coefficients too large";
+            return false;
+        }
+    }
+    reduceRow(x);
+    if (x[0] < 0) {
+        for (long long& value : x) {
+            value = -value;
+        }
+    }
+
+    for (size_t j = 0; j < n; j++) {
+        if (x[j] == 0) {
+            error = "'" + terms[j]->species + "' takes no part in the reaction";
+            return false;
+        }
+        if (x[j] < 0) {
+            error = "cannot be balanced with '" + terms[j]->species + "' on the " +
+                    (j < reactants.size() ? "reactant" : "product") + " side";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Function to write a balanced equation back as text, e.g. "4 Fe + 3 O2 -> 2 Fe2O3"
+string formatEquation(const BalancedEquation& balanced) {
+    string text;
+    size_t j = 0;
+    for (size_t side = 0; side < 2; side++) {
+        const vector<string>& species = side == 0 ? balanced.reactants : balanced.products;
+        for (size_t i = 0; i < species.size(); i++, j++) {
+            if (i > 0) {
+                text += " + ";
+            }
+            if (balanced.coefficients[j] != 1) {
+                text += to_string(balanced.coefficients[j]) + " ";
+            }
+            text += species[i];
+        }
+        if (side == 0) {
+            text += " -> ";
+        }
+    }
+    return text;
+}
+
+// Function to turn an equation into one parseReaction can use: written
+// coefficients that already balance are kept (so "H2 + 1/2 O2 -> H2O"
+// stays per mole of water), anything else is balanced first
+static bool prepareReaction(const ReferenceData& ref, FormulaCache& cache, const string& equation,
+                            string& prepared, string& error) {
+    BalancedEquation balanced;
+    if (!balanceEquation(ref, cache, equation, balanced, error)) {
+        return false;
+    }
+    prepared = balanced.inputBalanced ? equation : formatEquation(balanced);
+    return true;
+}
+
+// Function to balance an equation entered at the prompt
+void balanceEquationPrompt(const ReferenceData& ref, FormulaCache& cache) {
+    string equation, error;
+    BalancedEquation balanced;
+
+    printf("\n=== Equation Balancer ===\n");
+
+    if (!ref.loaded) {
+        printf("Balancing needs the element table in memory.\n");
+        return;
+    }
+
+    printf("Enter reaction (e.g., Fe + O2 -> Fe2O3, MnO4- + Fe^2+ + H+ -> Mn^2+ + Fe^3+ + H2O): ");
+    cin >> ws;
+    getline(cin, equation);
+    cin.unget(); // Leave the newline for the menu loop to discard
+
+    if (!balanceEquation(ref, cache, equation, balanced, error)) {
+        printf("Could not balance: %s\n", error.c_str());
+        return;
+    }
+
+    ResultWriter writer(outputFormat);
+    writer.beginRecord("balance", "Balanced Equation");
+    writer.field("equation", "Equation", textValue(formatEquation(balanced)));
+    if (balanced.inputBalanced) {
+        writer.note("The coefficients as entered were already balanced.\n");
+    }
+    writer.endRecord();
+}
+
+// Function to balance every equation in a file (one per line), writing
+// CSV (or JSON with --format json) with the balanced text or the reason
+bool runBalanceBatch(const ReferenceData& ref, const string& inputPath, const string& outputPath) {
+    if (!ref.loaded) {
+        fprintf(stderr, "Balancing needs the element table in memory.\n");
+        return false;
+    }
+
+    ifstream input(inputPath);
+    if (!input) {
+        fprintf(stderr, "Could not open input file '%s'.\n", inputPath.c_str());
+        return false;
+    }
+
+    FILE* output = outputPath == "-" ? stdout : fopen(outputPath.c_str(), "wb");
+    if (output == nullptr) {
+        fprintf(stderr, "Could not open output file '%s'.\n", outputPath.c_str());
+        return false;
+    }
+    FormulaCache cache(FORMULA_CACHE_SIZE);
+    BalancedEquation balanced;
+    string line, error;
+    size_t total = 0, failed = 0;
+    auto start = chrono::steady_clock::now();
+
+    ResultWriter writer(outputFormat == OutputJson ? OutputJson : OutputCsv, output);
+    writer.beginTable("equations", "", { { "equation", "", 0 }, { "balanced", "", 0 }, { "error", "", 0 } });
+    while (getline(input, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.empty()) {
+            continue;
+        }
+        total++;
+
+        writer.cell(textValue(line));
+        if (balanceEquation(ref, cache, line, balanced, error)) {
+            writer.cell(textValue(formatEquation(balanced)));
+            writer.cell(nullValue());
+        } else {
+            failed++;
+            writer.cell(nullValue());
+            writer.cell(textValue(error));
+        }
+        writer.endRow();
+    }
+    writer.endTable();
+    writer.flush();
+
+    if (output != stdout) {
+        fclose(output);
+    }
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    fprintf(stderr, "Balanced %zu equations (%zu failed) in %.3f s (%.0f equations/s)\n", total - failed, failed,
+            seconds, seconds > 0 ? total / seconds : 0.0);
+    return true;
+}
+
+// Temperatures evaluated per inner block of the sweep kernel
+const size_t SWEEP_BLOCK = 64;
+
+// Function to evaluate dG(T) = dH - T dS for every reaction at every
+// temperature into out[r * temperatureCount + t]. The inner loop is a
+// plain multiply-add over contiguous arrays so the compiler vectorises it
+// (SSE/AVX at -O2/-O3); reactions are split across threads.
+void sweepGibbs(const double* enthalpy, const double* entropy, size_t reactionCount,
+                const double* temperatures, size_t temperatureCount, double* out, unsigned threadCount) {
+    if (threadCount == 0) {
+        threadCount = max(1u, thread::hardware_concurrency());
+    }
+    threadCount = (unsigned)min<size_t>(threadCount, max<size_t>(1, reactionCount));
+
+    auto kernel = [=](size_t begin, size_t end) {
+        for (size_t block = 0; block < temperatureCount; block += SWEEP_BLOCK) {
+            size_t blockEnd = min(temperatureCount, block + SWEEP_BLOCK);
+            for (size_t r = begin; r < end; r++) {
+                const double dH = enthalpy[r];
+                const double dS = entropy[r];
+                double* row = out + r * temperatureCount;
+                for (size_t t = block; t < blockEnd; t++) {
+                    row[t] = dH - temperatures[t] * dS;
+                }
+            }
+        }
+    };
+
+    if (threadCount == 1) {
+        kernel(0, reactionCount);
+        return;
+    }
+
+    vector<thread> workers;
+    size_t slice = (reactionCount + threadCount - 1) / threadCount;
+    for (unsigned t = 0; t < threadCount; t++) {
+        size_t begin = min(reactionCount, t * slice);
+        size_t end = min(reactionCount, begin + slice);
+        workers.emplace_back(kernel, begin, end);
+    }
+    for (thread& worker : workers) {
+        worker.join();
+    }
+}
+
+// Function to build an evenly spaced temperature grid
+static vector<double> temperatureGrid(double minTemp, double maxTemp, size_t steps) {
+    vector<double> grid(max<size_t>(1, steps));
+    double step = grid.size() > 1 ? (maxTemp - minTemp) / (grid.size() - 1) : 0.0;
+    for (size_t i = 0; i < grid.size(); i++) {
+        grid[i] = minTemp + step * i;
+    }
+    return grid;
+}
+
+// Function to report the energetics of a reaction typed by the user
+void calculateReactionThermo(const ReferenceData& ref, FormulaCache& cache) {
+    string equation, prepared, error;
+    Reaction reaction;
+
+    printf("\n=== Reaction Thermodynamics ===\n");
+
+    if (!ref.thermoLoaded) {
+        printf("Thermodynamic data is not available.\n");
+        return;
+    }
+
+    printf("Enter reaction, coefficients optional (e.g., H2(g) + O2(g) -> H2O(l)): ");
+    cin >> ws;
+    getline(cin, equation);
+    cin.unget(); // Leave the newline for the menu loop to discard
+
+    // Balance unless the coefficients given already do
+    if (ref.loaded && prepareReaction(ref, cache, equation, prepared, error)) {
+        if (prepared != equation) {
+            printf("Balanced: %s\n", prepared.c_str());
+        }
+        equation = prepared;
+    } else if (ref.loaded) {
+        printf("Could not balance (%s); using the coefficients as entered.\n", error.c_str());
+    }
+
+    if (!parseReaction(ref.thermo, equation, reaction, error)) {
+        printf("Could not parse reaction: %s\n", error.c_str());
+        return;
+    }
+
+    ReactionEnergetics result = computeReactionEnergetics(ref.thermo, reaction);
+
+    printf("\n--- Standard Reaction Values (298.15 K) ---\n");
+    printf("Delta H: %10.2f kJ/mol\n", result.enthalpy);
+    printf("Delta S: %10.4f kJ/(mol K)\n", result.entropy);
+    printf("Delta G: %10.2f kJ/mol\n", result.gibbs);
+    if (result.entropy != 0.0 && result.enthalpy / result.entropy > 0.0) {
+        printf("Delta G changes sign near %.1f K.\n", result.enthalpy / result.entropy);
+    }
+
+    // A short sweep using dG(T) = dH - T dS
+    vector<double> grid = temperatureGrid(200.0, 1200.0, 6);
+    vector<double> gibbs(grid.size());
+    sweepGibbs(&result.enthalpy, &result.entropy, 1, grid.data(), grid.size(), gibbs.data(), 1);
+
+    printf("\n%-10s | %12s\n", "T (K)", "Delta G");
+    printf("---------------------------\n");
+    for (size_t i = 0; i < grid.size(); i++) {
+        printf("%-10.1f | %12.2f\n", grid[i], gibbs[i]);
+    }
+    printf("---------------------------\n");
+}
+
+// Function to sweep dG(T) for every reaction in a file (one per line)
+// over an evenly spaced temperature grid, writing long-form CSV or JSON
+bool runThermoSweep(const ReferenceData& ref, const string& inputPath, double minTemp, double maxTemp,
+                    size_t steps, const string& outputPath) {
+    if (!ref.thermoLoaded) {
+        fprintf(stderr, "Thermodynamic sweeps need dbo.Thermodynamics in memory.\n");
+        return false;
+    }
+
+    ifstream input(inputPath);
+    if (!input) {
+        fprintf(stderr, "Could not open input file '%s'.\n", inputPath.c_str());
+        return false;
+    }
+
+    FILE* output = outputPath == "-" ? stdout : fopen(outputPath.c_str(), "wb");
+    if (output == nullptr) {
+        fprintf(stderr, "Could not open output file '%s'.\n", outputPath.c_str());
+        return false;
+    }
+
+    // Parse every reaction first so the kernel sees flat dH/dS arrays;
+    // unbalanced ones are balanced on the way
+    FormulaCache cache(FORMULA_CACHE_SIZE);
+    vector<string> equations;
+    vector<double> enthalpy, entropy;
+    string line, prepared, error;
+    Reaction reaction;
+    size_t failed = 0;
+    while (getline(input, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.empty()) {
+            continue;
+        }
+        if (ref.loaded && prepareReaction(ref, cache, line, prepared, error)) {
+            line = prepared;
+        }
+        if (!parseReaction(ref.thermo, line, reaction, error)) {
+            fprintf(stderr, "Skipping '%s': %s\n", line.c_str(), error.c_str());
+            failed++;
+            continue;
+        }
+        ReactionEnergetics result = computeReactionEnergetics(ref.thermo, reaction);
+        equations.push_back(line);
+        enthalpy.push_back(result.enthalpy);
+        entropy.push_back(result.entropy);
+    }
+
+    vector<double> grid = temperatureGrid(minTemp, maxTemp, steps);
+    vector<double> gibbs(equations.size() * grid.size());
+
+    auto start = chrono::steady_clock::now();
+    sweepGibbs(enthalpy.data(), entropy.data(), equations.size(), grid.data(), grid.size(), gibbs.data(), 0);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    {
+        ResultWriter writer(outputFormat == OutputJson ? OutputJson : OutputCsv, output);
+        writer.beginTable("sweep", "", { { "reaction", "", 0 }, { "delta_h", "", 0 }, { "delta_s", "", 0 },
+                                         { "temperature", "", 0 }, { "delta_g", "", 0 } });
+        for (size_t r = 0; r < equations.size(); r++) {
+            OutputValue reactionValue = textValue(equations[r]);
+            OutputValue enthalpyValue = numberValue(enthalpy[r], 2);
+            OutputValue entropyValue = numberValue(entropy[r], 4);
+            for (size_t t = 0; t < grid.size(); t++) {
+                writer.cell(reactionValue);
+                writer.cell(enthalpyValue);
+                writer.cell(entropyValue);
+                writer.cell(numberValue(grid[t], 2));
+                writer.cell(numberValue(gibbs[r * grid.size() + t], 4));
+                writer.endRow();
+            }
+        }
+        writer.endTable();
+    }
+
+    if (output != stdout) {
+        fclose(output);
+    }
+
+    fprintf(stderr, "Swept %zu reactions (%zu skipped) over %zu temperatures in %.3f ms\n",
+            equations.size(), failed, grid.size(), seconds * 1000.0);
+    return true;
+}
+
+// Input lines read and priced per batch step
+const size_t BATCH_CHUNK_LINES = 1 << 16;
+
+// One priced line of batch input
+struct BatchResult {
+    const IonRecord* cation;
+    const IonRecord* anion;
+    IonicFormula formula;
+    const char* error; // nullptr when the pair was priced
+    // Hold the ions when they are looked up in place rather than cached;
+    // reused from chunk to chunk
+    IonRecord cationRecord;
+    IonRecord anionRecord;
+};
+
+// Function to read "key": "value" from a flat JSON object on one line
+static bool jsonStringField(const string& line, const char* key, string& out) {
+    string quotedKey = string("\"") + key + "\"";
+    size_t pos = line.find(quotedKey);
+    if (pos == string::npos) {
+        return false;
+    }
+    pos = line.find(':', pos + quotedKey.size());
+    if (pos == string::npos) {
+        return false;
+    }
+    size_t begin = line.find('"', pos + 1);
+    if (begin == string::npos) {
+        return false;
+    }
+    size_t end = line.find('"', begin + 1);
+    if (end == string::npos) {
+        return false;
+    }
+    out.assign(line, begin + 1, end - begin - 1);
+    return true;
+}
+
+// Function to split one input line into its cation and anion symbols
+static bool parseBatchLine(const string& line, bool jsonl, string& cation, string& anion) {
+    if (jsonl) {
+        return jsonStringField(line, "cation", cation) && jsonStringField(line, "anion", anion);
+    }
+    size_t comma = line.find(',');
+    if (comma == string::npos) {
+        return false;
+    }
+    size_t next = line.find(',', comma + 1);
+    trimField(line, 0, comma, cation);
+    trimField(line, comma + 1, next == string::npos ? line.size() : next, anion);
+    return !cation.empty() && !anion.empty();
+}
+
+// Function to price lines [begin, end) of a chunk against the cached ions,
+// or through direct when the tables are read in place
+static void priceBatchRange(StorageBackend* direct, const ReferenceData& ref, const vector<string>& lines, bool jsonl,
+                            size_t begin, size_t end, vector<BatchResult>& results) {
+    string cation, anion;
+    for (size_t i = begin; i < end; i++) {
+        BatchResult& result = results[i];
+        result.cation = nullptr;
+        result.anion = nullptr;
+        result.error = nullptr;
+
+        if (!parseBatchLine(lines[i], jsonl, cation, anion)) {
+            result.error = "unparsable line";
+            continue;
+        }
+        for (char &c : cation) {
+            c = toupper(c);
+        }
+        for (char &c : anion) {
+            c = toupper(c);
+        }
+
+        if (direct == nullptr) {
+            result.cation = ref.cations.find(cation);
+            result.anion = ref.anions.find(anion);
+        } else {
+            if (direct->findIon(true, cation, result.cationRecord) == LookupFound) {
+                result.cation = &result.cationRecord;
+            }
+            if (direct->findIon(false, anion, result.anionRecord) == LookupFound) {
+                result.anion = &result.anionRecord;
+            }
+        }
+        if (result.cation == nullptr) {
+            result.error = "unknown cation";
+        } else if (result.anion == nullptr) {
+            result.error = "unknown anion";
+        } else if (!balanceIonicCompound(result.cation->charge, result.cation->atomicWeight,
+                                         result.anion->charge, result.anion->atomicWeight, result.formula)) {
+            result.error = "charges cannot balance";
+        }
+    }
+}
+
+// Function to append a CSV field, quoted only when it holds a separator,
+// a quote or a line break
+static void appendCsvField(string& out, const string& text) {
+    if (text.find_first_of(",\"\r\n") == string::npos) {
+        out += text;
+        return;
+    }
+    out += '"';
+    for (char c : text) {
+        out += c;
+        if (c == '"') {
+            out += '"';
+        }
+    }
+    out += '"';
+}
+
+// Function to format results [begin, end) of a chunk into out, as CSV
+// rows or as one JSON object per line. Symbols are escaped either way
+// since failed rows echo whatever the input held.
+static void formatBatchRange(const vector<string>& lines, bool jsonlInput, bool jsonlOutput,
+                             const vector<BatchResult>& results, size_t begin, size_t end, string& out) {
+    char formula[64];
+    char numbers[96];
+    string cation, anion;
+
+    out.clear();
+    for (size_t i = begin; i < end; i++) {
+        const BatchResult& result = results[i];
+
+        if (result.error == nullptr) {
+            cation = result.cation->symbol;
+            anion = result.anion->symbol;
+        } else if (!parseBatchLine(lines[i], jsonlInput, cation, anion)) {
+            // Echo what was asked for so failures can be matched to input
+            cation.clear();
+            anion.clear();
+        }
+
+        if (jsonlOutput) {
+            out += "{\"cation\":";
+            out += jsonQuote(cation);
+            out += ",\"anion\":";
+            out += jsonQuote(anion);
+        } else {
+            appendCsvField(out, cation);
+            out += ',';
+            appendCsvField(out, anion);
+            out += ',';
+        }
+
+        if (result.error == nullptr) {
+            formatIonicFormula(formula, sizeof(formula), cation.c_str(), anion.c_str(), result.formula);
+            if (jsonlOutput) {
+                out += ",\"formula\":";
+                out += jsonQuote(formula);
+                snprintf(numbers, sizeof(numbers), ",\"cationCount\":%d,\"anionCount\":%d,\"molarMass\":%.4f}\n",
+                         result.formula.cationCount, result.formula.anionCount, result.formula.molarMass);
+            } else {
+                appendCsvField(out, formula);
+                snprintf(numbers, sizeof(numbers), ",%d,%d,%.4f,\n",
+                         result.formula.cationCount, result.formula.anionCount, result.formula.molarMass);
+            }
+            out += numbers;
+        } else if (jsonlOutput) {
+            out += ",\"error\":";
+            out += jsonQuote(result.error);
+            out += "}\n";
+        } else {
+            out += ",,,,";
+            out += result.error;
+            out += '\n';
+        }
+    }
+}
+
+// Function to price every cation/anion pair of a CSV or JSONL file.
+// Input is streamed in chunks; each chunk is resolved, balanced and
+// formatted on all cores and written out in input order. Ions come from
+// ref when it is loaded, otherwise from a backend that reads them in place.
+bool runBatch(StorageBackend& backend, const ReferenceData& ref, const string& inputPath, const string& outputPath,
+              unsigned threadCount) {
+    if (!ref.loaded && !backend.lookupsInPlace()) {
+        fprintf(stderr, "Batch mode needs the reference tables in memory.\n");
+        return false;
+    }
+    StorageBackend* direct = ref.loaded ? nullptr : &backend;
+
+    ifstream input(inputPath);
+    if (!input) {
+        fprintf(stderr, "Could not open input file '%s'.\n", inputPath.c_str());
+        return false;
+    }
+
+    FILE* output = outputPath == "-" ? stdout : fopen(outputPath.c_str(), "wb");
+    if (output == nullptr) {
+        fprintf(stderr, "Could not open output file '%s'.\n", outputPath.c_str());
+        return false;
+    }
+    setvbuf(output, nullptr, _IOFBF, 1 << 20);
+
+    bool jsonl = inputPath.size() >= 6 && inputPath.compare(inputPath.size() - 6, 6, ".jsonl") == 0;
+    // --format picks the output; by default it follows the input
+    bool jsonlOutput = outputFormat == OutputJson || (outputFormat == OutputTable && jsonl);
+    if (threadCount == 0) {
+        threadCount = max(1u, thread::hardware_concurrency());
+    }
+
+    if (!jsonlOutput) {
+        fputs("cation,anion,formula,cation_count,anion_count,molar_mass,error\n", output);
+    }
+
+    vector<string> lines(BATCH_CHUNK_LINES);
+    vector<BatchResult> results(BATCH_CHUNK_LINES);
+    vector<string> buffers(threadCount);
+    vector<thread> workers;
+    size_t total = 0, failed = 0;
+    bool firstLine = true;
+
+    auto start = chrono::steady_clock::now();
+
+    while (input) {
+        // Read the next chunk, reusing line storage between chunks
+        size_t count = 0;
+        while (count < BATCH_CHUNK_LINES && getline(input, lines[count])) {
+            string& line = lines[count];
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            bool header = firstLine && !jsonl && line.find("cation") != string::npos;
+            firstLine = false;
+            if (line.empty() || header) {
+                continue;
+            }
+            count++;
+        }
+        if (count == 0) {
+            break;
+        }
+
+        // Price and format slices of the chunk in parallel
+        size_t slice = (count + threadCount - 1) / threadCount;
+        workers.clear();
+        for (unsigned t = 0; t < threadCount; t++) {
+            size_t begin = min(count, t * slice);
+            size_t end = min(count, begin + slice);
+            workers.emplace_back([&, t, begin, end]() {
+                priceBatchRange(direct, ref, lines, jsonl, begin, end, results);
+                formatBatchRange(lines, jsonl, jsonlOutput, results, begin, end, buffers[t]);
+            });
+        }
+        for (thread& worker : workers) {
+            worker.join();
+        }
+
+        for (const string& buffer : buffers) {
+            fwrite(buffer.data(), 1, buffer.size(), output);
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (results[i].error != nullptr) {
+                failed++;
+            }
+        }
+        total += count;
+    }
+
+    fflush(output);
+    if (output != stdout) {
+        fclose(output);
+    }
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    fprintf(stderr, "Priced %zu pairs (%zu failed) in %.3f s using %u threads: %.0f pairs/s\n",
+            total, failed, seconds, threadCount, seconds > 0 ? total / seconds : 0.0);
+    return true;
+}
+
+// Publishes the reference data as immutable snapshots, RCU style. Readers
+// take the current snapshot once per request and keep it to the end, so
+// they never wait for a refresh or see one half applied. A refresh patches
+// a private copy and swaps it in; the old snapshot is freed by its last reader.
+class ReferenceStore {
+public:
+    shared_ptr<const ReferenceData> snapshot() const { return atomic_load(&current); }
+    void publish(shared_ptr<const ReferenceData> next) { atomic_store(&current, std::move(next)); }
+
+private:
+    shared_ptr<const ReferenceData> current;
+};
+
+// Function to refresh a copy of the current snapshot and publish it if
+// anything changed. The copy is only made once a probe shows a change.
+bool refreshReferenceStore(StorageBackend& backend, ReferenceStore& store, RefreshResult& result) {
+    shared_ptr<const ReferenceData> current = store.snapshot();
+    bool changed = false;
+    if (!backend.referenceDataChanged(*current, changed)) {
+        return false;
+    }
+    if (!changed) {
+        return true;
+    }
+    shared_ptr<ReferenceData> next = make_shared<ReferenceData>(*current);
+    if (!backend.refreshReferenceData(*next, result)) {
+        return false;
+    }
+    if (result.any()) {
+        next->generation++;
+        store.publish(next);
+    }
+    return true;
+}
+
+// Function to bring the menu's derived indexes in line with a refresh:
+// changed ions are patched into the compound index, reloaded ion tables
+// rebuild it, and the search indexes are rebuilt on next use. The formula
+// cache notices the new generation by itself.
+void applyRefresh(const ReferenceData& ref, const RefreshResult& result, CompoundIndex& compounds, SymbolSearch& search) {
+    if (compounds.built) {
+        if (result.reloaded[RefCations] || result.reloaded[RefAnions]) {
+            compounds.clear();
+        } else {
+            for (uint32_t row : result.changed[RefCations]) {
+                refreshCompoundIndex(ref, true, row, compounds);
+            }
+            for (uint32_t row : result.changed[RefAnions]) {
+                refreshCompoundIndex(ref, false, row, compounds);
+            }
+        }
+    }
+    search.built = false;
+}
+
+// Function to count the rows a refresh touched
+static size_t refreshedRows(const ReferenceData& ref, const RefreshResult& result) {
+    size_t rows = 0;
+    for (int t = 0; t < RefTableCount; t++) {
+        if (result.reloaded[t]) {
+            rows += t == RefElements ? ref.elements.rows.size() : ref.ions(t == RefCations).rows.size();
+        } else {
+            rows += result.changed[t].size();
+        }
+    }
+    return rows;
+}
+
+// Function to build an error reply
+static string jsonError(const string& message) {
+    return "{\"ok\":false,\"error\":" + jsonQuote(message) + "}";
+}
+
+// Shared state of the query server
+struct QueryServer {
+    ReferenceStore* store = nullptr;
+    ConnectionPool* pool = nullptr;
+    StorageBackend* direct = nullptr; // set when lookups read the source in place
+    atomic<unsigned long> requests{0};
+    atomic<unsigned long> errors{0};
+
+    // Tables copied out of direct for FORMULA requests, on first use and
+    // again after each refresh
+    mutex tablesGuard;
+    shared_ptr<const ReferenceData> tables;
+};
+
+// Function to resolve an ion from memory, in place or through a pooled connection
+static LookupStatus serverFindIon(QueryServer& server, const ReferenceData& ref, bool isCation, const string& symbol,
+                                  IonRecord& ion) {
+    if (ref.loaded) {
+        const IonRecord* found = ref.ions(isCation).find(symbol);
+        if (found == nullptr) {
+            return LookupNotFound;
+        }
+        ion = *found;
+        return LookupFound;
+    }
+    if (server.direct != nullptr) {
+        return server.direct->findIon(isCation, symbol, ion);
+    }
+    PooledConnection connection(*server.pool);
+    return connection->findIon(isCation, symbol, ion);
+}
+
+// Function to get the tables formula parsing needs when the server reads
+// them in place, copying them for the current generation if not done yet
+static shared_ptr<const ReferenceData> serverFormulaTables(QueryServer& server, unsigned long generation) {
+    lock_guard<mutex> lock(server.tablesGuard);
+    if (server.tables == nullptr || server.tables->generation != generation) {
+        shared_ptr<ReferenceData> tables = make_shared<ReferenceData>();
+        if (!server.direct->loadReferenceData(*tables)) {
+            return nullptr;
+        }
+        tables->generation = generation;
+        server.tables = tables;
+    }
+    return server.tables;
+}
+
+// Function to answer one request line. Requests are either words
+// ("ELEMENT Na", "CATION Ca", "ANION PO4", "MOLARMASS Ca PO4",
+// "FORMULA CuSO4.5H2O", "PING", "STATS") or a JSON object with "op" and the
+// matching "symbol", "cation", "anion" or "formula" fields.
+static string handleServerRequest(QueryServer& server, FormulaCache& formulas, const string& line) {
+    string op, first, second;
+
+    if (!line.empty() && line[0] == '{') {
+        jsonStringField(line, "op", op);
+        if (!jsonStringField(line, "symbol", first) && !jsonStringField(line, "cation", first)) {
+            jsonStringField(line, "formula", first);
+        }
+        jsonStringField(line, "anion", second);
+    } else {
+        size_t pos = 0;
+        string* fields[] = { &op, &first, &second };
+        for (string* field : fields) {
+            while (pos < line.size() && isspace((unsigned char)line[pos])) {
+                pos++;
+            }
+            size_t start = pos;
+            while (pos < line.size() && !isspace((unsigned char)line[pos])) {
+                pos++;
+            }
+            field->assign(line, start, pos - start);
+        }
+    }
+    for (char &c : op) {
+        c = toupper(c);
+    }
+
+    string formulaText = first; // formulas are case-sensitive
+    for (char &c : first) {
+        c = toupper(c);
+    }
+    for (char &c : second) {
+        c = toupper(c);
+    }
+
+    char buffer[512];
+
+    // One snapshot serves the whole request, even if a refresh lands meanwhile
+    shared_ptr<const ReferenceData> snapshot = server.store->snapshot();
+    const ReferenceData& ref = *snapshot;
+
+    if (op == "PING") {
+        return "{\"ok\":true}";
+    }
+
+    if (op == "STATS") {
+        return "{\"ok\":true,\"phases\":" + traceSummaryJson() + "}";
+    }
+
+    if (op == "ELEMENT" && !first.empty()) {
+        ElementRecord element;
+        LookupStatus status;
+        if (ref.loaded) {
+            const ElementRecord* found = ref.elements.find(first);
+            status = found ? LookupFound : LookupNotFound;
+            if (found) {
+                element = *found;
+            }
+        } else if (server.direct != nullptr) {
+            status = server.direct->findElement(first, element);
+        } else {
+            PooledConnection connection(*server.pool);
+            status = connection->findElement(first, element);
+        }
+        if (status != LookupFound) {
+            return jsonError(status == LookupNotFound ? "element not found" : "lookup failed");
+        }
+        snprintf(buffer, sizeof(buffer), ",\"atomicNumber\":%s,\"atomicWeight\":%.4f,\"charge\":%s}",
+                 element.hasAtomicNumber ? to_string(element.atomicNumber).c_str() : "null",
+                 element.atomicWeight,
+                 element.hasCharge ? to_string(element.charge).c_str() : "null");
+        return "{\"ok\":true,\"symbol\":" + jsonQuote(element.symbol) + ",\"name\":" + jsonQuote(element.name) + buffer;
+    }
+
+    if ((op == "CATION" || op == "ANION") && !first.empty()) {
+        IonRecord ion;
+        LookupStatus status = serverFindIon(server, ref, op == "CATION", first, ion);
+        if (status != LookupFound) {
+            return jsonError(status == LookupNotFound ? "ion not found" : "lookup failed");
+        }
+        snprintf(buffer, sizeof(buffer), ",\"charge\":%d,\"atomicWeight\":%.4f}", ion.charge, ion.atomicWeight);
+        return "{\"ok\":true,\"symbol\":" + jsonQuote(ion.symbol) + ",\"name\":" + jsonQuote(ion.name) + buffer;
+    }
+
+    if (op == "MOLARMASS" && !first.empty() && !second.empty()) {
+        IonRecord cation, anion;
+        LookupStatus status = serverFindIon(server, ref, true, first, cation);
+        if (status != LookupFound) {
+            return jsonError(status == LookupNotFound ? "cation not found" : "lookup failed");
+        }
+        status = serverFindIon(server, ref, false, second, anion);
+        if (status != LookupFound) {
+            return jsonError(status == LookupNotFound ? "anion not found" : "lookup failed");
+        }
+        IonicFormula formula;
+        if (!balanceIonicCompound(cation.charge, cation.atomicWeight, anion.charge, anion.atomicWeight, formula)) {
+            return jsonError("charges cannot balance");
+        }
+        char text[64];
+        formatIonicFormula(text, sizeof(text), cation.symbol.c_str(), anion.symbol.c_str(), formula);
+        snprintf(buffer, sizeof(buffer), ",\"cationCount\":%d,\"anionCount\":%d,\"molarMass\":%.4f}",
+                 formula.cationCount, formula.anionCount, formula.molarMass);
+        return "{\"ok\":true,\"formula\":" + jsonQuote(text) + buffer;
+    }
+
+    if (op == "FORMULA" && !formulaText.empty()) {
+        shared_ptr<const ReferenceData> tables = snapshot;
+        if (!ref.loaded && server.direct != nullptr) {
+            tables = serverFormulaTables(server, ref.generation);
+        }
+        if (tables == nullptr || !tables->loaded) {
+            return jsonError("formula parsing needs the element table in memory");
+        }
+        string error;
+        const ParsedFormula* parsed = formulas.lookup(*tables, formulaText, error);
+        if (parsed == nullptr) {
+            return jsonError(error);
+        }
+        snprintf(buffer, sizeof(buffer), ",\"charge\":%d,\"molarMass\":%.4f}", parsed->charge, parsed->molarMass);
+        return "{\"ok\":true,\"formula\":" + jsonQuote(formulaText) + buffer;
+    }
+
+    return jsonError("unknown request");
+}
+
+#ifndef _WIN32
+// Set by SIGINT/SIGTERM to stop the server loops
+static volatile sig_atomic_t serverStopping = 0;
+
+static void stopServer(int) {
+    serverStopping = 1;
+}
+
+// Longest request line a client may send; more without a newline closes it
+const size_t MAX_REQUEST_BYTES = 64 * 1024;
+
+// One connected client. pending belongs to the poll loop; busy and closing
+// are shared with the workers under QueryServer's queue lock.
+struct ServerClient {
+    int fd = -1;
+    string pending;
+    bool busy = false;    // a worker is answering its lines
+    bool closing = false; // QUIT received or a reply could not be sent
+};
+
+// Complete request lines of one client, answered in order by one worker
+struct ServerJob {
+    shared_ptr<ServerClient> client;
+    vector<string> lines;
+};
+
+// Function to answer a batch of lines from one client; replies go out in
+// one send. Returns false when the client quit or can no longer be written.
+static bool answerClientLines(QueryServer& server, FormulaCache& formulas, int client, const vector<string>& lines) {
+    string reply;
+    bool quit = false;
+    for (const string& line : lines) {
+        if (line == "QUIT" || line == "quit") {
+            quit = true;
+            break;
+        }
+        string answer;
+        {
+            TraceScope trace(TraceRequest);
+            answer = handleServerRequest(server, formulas, line);
+        }
+        server.requests++;
+        if (answer.compare(0, 11, "{\"ok\":false") == 0) {
+            server.errors++;
+        }
+        reply += answer;
+        reply += '\n';
+    }
+
+    size_t sent = 0;
+    while (sent < reply.size()) {
+        ssize_t n = send(client, reply.data() + sent, reply.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        sent += n;
+    }
+    return !quit;
+}
+
+// Function to move the complete lines out of a client's pending bytes
+static void takeRequestLines(string& pending, vector<string>& lines) {
+    size_t start = 0, newline;
+    while ((newline = pending.find('\n', start)) != string::npos) {
+        string line = pending.substr(start, newline - start);
+        start = newline + 1;
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (!line.empty()) {
+            lines.push_back(std::move(line));
+        }
+    }
+    pending.erase(0, start);
+}
+
+// Function to run the query daemon on a Unix socket. One thread polls the
+// listener and every client and queues each client's complete request
+// lines for a fixed set of workers, so idle clients hold no worker. A
+// client has at most one batch in flight, which keeps its replies in
+// order. Lookups use the in-memory tables when loaded, a mapped snapshot
+// in place, otherwise a connection leased from the pool.
+bool runServer(ReferenceStore& store, StorageBackend& backend, unsigned refreshSeconds, ConnectionPool& pool,
+               const string& socketPath, unsigned workerCount) {
+    if (workerCount == 0) {
+        workerCount = max(1u, thread::hardware_concurrency());
+    }
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        perror("socket");
+        return false;
+    }
+
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path is too long.\n");
+        ::close(listener);
+        return false;
+    }
+    strcpy(address.sun_path, socketPath.c_str());
+    unlink(socketPath.c_str());
+
+    if (bind(listener, (sockaddr*)&address, sizeof(address)) < 0 || listen(listener, 128) < 0) {
+        perror("bind");
+        ::close(listener);
+        return false;
+    }
+
+    // Workers write a byte here when a client becomes idle again
+    int wake[2];
+    if (pipe(wake) < 0) {
+        perror("pipe");
+        ::close(listener);
+        return false;
+    }
+    fcntl(wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake[1], F_SETFL, O_NONBLOCK);
+
+    signal(SIGINT, stopServer);
+    signal(SIGTERM, stopServer);
+    signal(SIGPIPE, SIG_IGN);
+
+    QueryServer server;
+    server.store = &store;
+    server.pool = &pool;
+    if (!store.snapshot()->loaded && backend.lookupsInPlace()) {
+        server.direct = &backend;
+    }
+
+    deque<ServerJob> jobs;
+    mutex jobsGuard;
+    condition_variable jobsReady;
+
+    vector<thread> workers;
+    for (unsigned i = 0; i < workerCount; i++) {
+        workers.emplace_back([&]() {
+            FormulaCache formulas(FORMULA_CACHE_SIZE);
+            while (true) {
+                ServerJob job;
+                {
+                    unique_lock<mutex> lock(jobsGuard);
+                    jobsReady.wait_for(lock, chrono::milliseconds(250),
+                                       [&]() { return !jobs.empty() || serverStopping; });
+                    if (jobs.empty()) {
+                        if (serverStopping) {
+                            return;
+                        }
+                        continue;
+                    }
+                    job = std::move(jobs.front());
+                    jobs.pop_front();
+                }
+                bool open = answerClientLines(server, formulas, job.client->fd, job.lines);
+                {
+                    lock_guard<mutex> lock(jobsGuard);
+                    job.client->busy = false;
+                    job.client->closing = job.client->closing || !open;
+                }
+                char byte = 1;
+                if (write(wake[1], &byte, 1) < 0) {
+                    // The pipe is full, so the poll loop is already due to wake
+                }
+            }
+        });
+    }
+
+    // Refresh the cached tables in the background and publish new snapshots
+    thread refresher;
+    if (refreshSeconds > 0 && (store.snapshot()->loaded || server.direct != nullptr)) {
+        refresher = thread([&]() {
+            auto due = chrono::steady_clock::now() + chrono::seconds(refreshSeconds);
+            while (!serverStopping) {
+                this_thread::sleep_for(chrono::milliseconds(250));
+                if (chrono::steady_clock::now() < due) {
+                    continue;
+                }
+                RefreshResult result;
+                if (!refreshReferenceStore(backend, store, result)) {
+                    fprintf(stderr, "Reference data refresh failed; keeping the current snapshot.\n");
+                } else if (result.any() && server.direct != nullptr) {
+                    printf("Remapped the snapshot (generation %lu).\n", store.snapshot()->generation);
+                    fflush(stdout);
+                } else if (result.any()) {
+                    shared_ptr<const ReferenceData> current = store.snapshot();
+                    printf("Refreshed %zu reference rows (generation %lu).\n", refreshedRows(*current, result),
+                           current->generation);
+                    fflush(stdout);
+                }
+                due = chrono::steady_clock::now() + chrono::seconds(refreshSeconds);
+            }
+        });
+    }
+
+    printf("Serving on %s with %u workers (%s).\n", socketPath.c_str(), workerCount,
+           store.snapshot()->loaded ? "in-memory tables"
+           : server.direct != nullptr ? "mapped snapshot"
+                                      : (to_string(pool.size()) + " pooled connections").c_str());
+    fflush(stdout);
+
+    vector<shared_ptr<ServerClient>> clients;
+    vector<pollfd> waits;
+    vector<ServerClient*> polled;
+    char chunk[4096];
+    while (!serverStopping) {
+        // Drop finished clients and queue the lines idle ones have buffered
+        {
+            lock_guard<mutex> lock(jobsGuard);
+            size_t kept = 0;
+            for (shared_ptr<ServerClient>& client : clients) {
+                if (client->busy) {
+                    clients[kept++] = std::move(client);
+                    continue;
+                }
+                if (client->closing) {
+                    ::close(client->fd);
+                    continue;
+                }
+                ServerJob job;
+                takeRequestLines(client->pending, job.lines);
+                if (!job.lines.empty()) {
+                    client->busy = true;
+                    job.client = client;
+                    jobs.push_back(std::move(job));
+                    jobsReady.notify_one();
+                }
+                clients[kept++] = std::move(client);
+            }
+            clients.resize(kept);
+        }
+
+        // Busy clients are not read until their replies are out
+        waits.assign(1, pollfd{ listener, POLLIN, 0 });
+        waits.push_back(pollfd{ wake[0], POLLIN, 0 });
+        polled.clear();
+        {
+            lock_guard<mutex> lock(jobsGuard);
+            for (const shared_ptr<ServerClient>& client : clients) {
+                if (!client->busy) {
+                    waits.push_back(pollfd{ client->fd, POLLIN, 0 });
+                    polled.push_back(client.get());
+                }
+            }
+        }
+        if (poll(waits.data(), waits.size(), 250) <= 0) {
+            continue;
+        }
+
+        if (waits[1].revents & POLLIN) {
+            while (read(wake[0], chunk, sizeof(chunk)) > 0) {
+            }
+        }
+        for (size_t i = 0; i < polled.size(); i++) {
+            if (waits[i + 2].revents == 0) {
+                continue;
+            }
+            ServerClient& client = *polled[i];
+            ssize_t received = recv(client.fd, chunk, sizeof(chunk), 0);
+            if (received <= 0) {
+                client.closing = true;
+                continue;
+            }
+            client.pending.append(chunk, received);
+            size_t lastNewline = client.pending.rfind('\n');
+            size_t partial = lastNewline == string::npos ? client.pending.size() : client.pending.size() - lastNewline - 1;
+            if (partial > MAX_REQUEST_BYTES) {
+                string reply = jsonError("request line too long") + "\n";
+                send(client.fd, reply.data(), reply.size(), MSG_NOSIGNAL);
+                client.pending.clear();
+                client.closing = true;
+            }
+        }
+        if (waits[0].revents & POLLIN) {
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd >= 0) {
+                // A client that stops reading must not hold a worker in send() for long
+                timeval sendTimeout = { 5, 0 };
+                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout, sizeof(sendTimeout));
+                shared_ptr<ServerClient> client = make_shared<ServerClient>();
+                client->fd = fd;
+                clients.push_back(client);
+            }
+        }
+    }
+
+    jobsReady.notify_all();
+    for (thread& worker : workers) {
+        worker.join();
+    }
+    if (refresher.joinable()) {
+        refresher.join();
+    }
+    for (const shared_ptr<ServerClient>& client : clients) {
+        ::close(client->fd);
+    }
+    ::close(wake[0]);
+    ::close(wake[1]);
+    ::close(listener);
+    unlink(socketPath.c_str());
+
+    printf("Server stopped after %lu requests (%lu errors).\n", server.requests.load(), server.errors.load());
+    return true;
+}
+#else
+bool runServer(ReferenceStore&, StorageBackend&, unsigned, ConnectionPool&, const string&, unsigned) {
+    fprintf(stderr, "Server mode needs Unix domain sockets and is not available in Windows builds.\n");
+    return false;
+}
+#endif
+
+// One measured value of the benchmark suite
+struct BenchResult {
+    string name;
+    string unit;
+    double value;
+};
+
+// Function to read a percentile (0-100) from unsorted samples
+static double percentile(vector<double>& samples, double pct) {
+    if (samples.empty()) {
+        return 0.0;
+    }
+    size_t rank = (size_t)(pct / 100.0 * (samples.size() - 1) + 0.5);
+    nth_element(samples.begin(), samples.begin() + rank, samples.end());
+    return samples[rank];
+}
+
+// Function to record p50/p99 of latency samples taken in nanoseconds
+static void addLatency(vector<BenchResult>& results, const string& name, vector<double>& samplesNs) {
+    results.push_back({ name + "_p50", "us", percentile(samplesNs, 50) / 1000.0 });
+    results.push_back({ name + "_p99", "us", percentile(samplesNs, 99) / 1000.0 });
+}
+
+// Function to time a callable in nanoseconds
+template <typename Body>
+static double timeNs(Body body) {
+    auto start = chrono::steady_clock::now();
+    body();
+    return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+}
+
+// Function to grow a table by cloning its rows under suffixed symbols
+template <typename Record>
+static void scaleTable(const ReferenceTable<Record>& source, size_t factor, ReferenceTable<Record>& scaled) {
+    scaled.clear();
+    for (size_t copy = 0; copy < factor; copy++) {
+        for (const Record& row : source.rows) {
+            Record clone = row;
+            if (copy > 0) {
+                clone.symbol += to_string(copy);
+            }
+            scaled.add(clone);
+        }
+    }
+}
+
+// Function to run the benchmark suite against the selected backend and
+// write the results as JSON, so runs can be compared across commits.
+// Use --seed for a local stand-in database built from the dbo.* files.
+bool runBenchmarks(StorageBackend& backend, const ReferenceData& ref,
+                   const function<StorageBackend*()>& createBackend, const string& outputPath) {
+    if (!ref.loaded) {
+        fprintf(stderr, "Benchmarks need the reference tables in memory.\n");
+        return false;
+    }
+
+#ifdef _WIN32
+    const char* nullDevice = "NUL";
+#else
+    const char* nullDevice = "/dev/null";
+#endif
+    FILE* sink = fopen(nullDevice, "w");
+    if (sink == nullptr) {
+        fprintf(stderr, "Could not open %s.\n", nullDevice);
+        return false;
+    }
+
+    vector<BenchResult> results;
+    vector<double> samples;
+
+    // Cold start: open and load a fresh backend, then its first lookup
+    const int coldRuns = 10;
+    vector<double> startup;
+    for (int run = 0; run < coldRuns; run++) {
+        unique_ptr<StorageBackend> fresh(createBackend());
+        ReferenceData freshRef;
+        bool opened = false;
+        startup.push_back(timeNs([&]() { opened = fresh->open() && fresh->loadReferenceData(freshRef); }));
+        if (!opened) {
+            fprintf(stderr, "Could not open a fresh backend for the cold runs.\n");
+            fclose(sink);
+            return false;
+        }
+        ElementRecord element;
+        samples.push_back(timeNs([&]() { fresh->findElement("FE", element); }));
+        fresh->close();
+    }
+    results.push_back({ "startup_p50", "ms", percentile(startup, 50) / 1e6 });
+    addLatency(results, "cold_lookup", samples);
+
+    // Warm lookups from the cached tables and through the backend
+    const size_t warmLookups = 200000;
+    vector<string> symbols;
+    for (const ElementRecord& element : ref.elements.rows) {
+        string symbol = element.symbol;
+        for (char &c : symbol) {
+            c = toupper(c);
+        }
+        symbols.push_back(symbol);
+    }
+    samples.clear();
+    const ElementRecord* found = nullptr;
+    for (size_t i = 0; i < warmLookups; i++) {
+        const string& symbol = symbols[i % symbols.size()];
+        samples.push_back(timeNs([&]() { found = ref.elements.find(symbol); }));
+    }
+    if (found == nullptr) {
+        fprintf(stderr, "Warm lookups found nothing.\n");
+    }
+    addLatency(results, "warm_lookup_memory", samples);
+
+    samples.clear();
+    IonRecord ion;
+    for (size_t i = 0; i < 2000; i++) {
+        const IonRecord& row = ref.cations.rows[i % ref.cations.rows.size()];
+        string symbol = row.symbol;
+        for (char &c : symbol) {
+            c = toupper(c);
+        }
+        samples.push_back(timeNs([&]() { backend.findIon(true, symbol, ion); }));
+    }
+    addLatency(results, "warm_lookup_backend", samples);
+
+    // Prompt suggestions: prefix, name and misspelled queries
+    SymbolSearch search;
+    buildSymbolSearch(ref, search);
+    const char* queries[] = { "Fe", "ir", "Irn", "Sodum", "C", "Chlor", "Xq", "magnesium" };
+    vector<SearchMatch> matches;
+    samples.clear();
+    for (size_t i = 0; i < 20000; i++) {
+        const char* query = queries[i % 8];
+        samples.push_back(timeNs([&]() { search.elements.suggest(query, SEARCH_SUGGESTIONS, matches); }));
+    }
+    addLatency(results, "search_suggest", samples);
+
+    // Full listings at 1x, 10x and 1000x the seed row counts
+    const size_t scales[] = { 1, 10, 1000 };
+    for (size_t scale : scales) {
+        ReferenceTable<ElementRecord> elements;
+        ReferenceTable<IonRecord> anions;
+        scaleTable(ref.elements, scale, elements);
+        scaleTable(ref.anions, scale, anions);
+
+        vector<double> listing;
+        for (int run = 0; run < 5; run++) {
+            listing.push_back(timeNs([&]() {
+                ResultWriter writer(OutputTable, sink);
+                printSymbolListing(writer, "Elements", elements.rows);
+                printSymbolListing(writer, "Cations", ref.cations.rows);
+                printSymbolListing(writer, "Anions", anions.rows);
+            }));
+        }
+        string name = "listing_" + to_string(scale) + "x";
+        results.push_back({ name + "_rows", "rows", (double)(elements.rows.size() + ref.cations.rows.size() + anions.rows.size()) });
+        results.push_back({ name + "_p50", "ms", percentile(listing, 50) / 1e6 });
+    }
+
+    // Column scans over 10000x the element rows: weight range and charge
+    {
+        ColumnTable wide;
+        buildColumnTable(ref.elements.rows, wide);
+        size_t baseRows = wide.size();
+        for (size_t copy = 1; copy < 10000; copy++) {
+            wide.weights.insert(wide.weights.end(), wide.weights.begin(), wide.weights.begin() + baseRows);
+            wide.charges.insert(wide.charges.end(), wide.charges.begin(), wide.charges.begin() + baseRows);
+            wide.numbers.insert(wide.numbers.end(), wide.numbers.begin(), wide.numbers.begin() + baseRows);
+        }
+        ScanQuery query;
+        query.where = { { ScanWeight, 40, 60 }, { ScanCharge, 2, 2 } };
+        vector<uint32_t> matched;
+        vector<double> scans;
+        for (int run = 0; run < 10; run++) {
+            scans.push_back(timeNs([&]() { scanColumns(wide, query, matched); }));
+        }
+        double scanNs = percentile(scans, 50);
+        results.push_back({ "column_scan_rows", "rows", (double)wide.size() });
+        results.push_back({ "column_scan_p50", "ms", scanNs / 1e6 });
+        results.push_back({ "column_scan_bandwidth", "GB/s",
+                            wide.size() * (sizeof(double) + sizeof(int32_t)) / scanNs });
+    }
+
+    // Batch molar-mass throughput over a synthetic pair file
+    const size_t batchPairs = 1000000;
+    string pairsPath = outputPath + ".pairs.csv";
+    {
+        FILE* pairs = fopen(pairsPath.c_str(), "w");
+        if (pairs == nullptr) {
+            fprintf(stderr, "Could not write '%s'.\n", pairsPath.c_str());
+            fclose(sink);
+            return false;
+        }
+        setvbuf(pairs, nullptr, _IOFBF, 1 << 20);
+        uint32_t seed = 12345;
+        for (size_t i = 0; i < batchPairs; i++) {
+            seed = seed * 1664525u + 1013904223u;
+            const IonRecord& cation = ref.cations.rows[(seed >> 8) % ref.cations.rows.size()];
+            const IonRecord& anion = ref.anions.rows[(seed >> 20) % ref.anions.rows.size()];
+            fprintf(pairs, "%s,%s\n", cation.symbol.c_str(), anion.symbol.c_str());
+        }
+        fclose(pairs);
+    }
+    double batchNs = timeNs([&]() { runBatch(backend, ref, pairsPath, nullDevice, 0); });
+    remove(pairsPath.c_str());
+    results.push_back({ "batch_molar_mass", "pairs/s", batchPairs / (batchNs / 1e9) });
+
+    // Formula evaluation with and without the LRU cache
+    const size_t formulaRuns = 200000;
+    string error;
+    FormulaCache cache(FORMULA_CACHE_SIZE);
+    ParsedFormula parsed;
+    double cachedNs = timeNs([&]() {
+        for (size_t i = 0; i < formulaRuns; i++) {
+            cache.lookup(ref, constantFormulas[i % CONSTANT_FORMULA_COUNT].text, error);
+        }
+    });
+    double parsedNs = timeNs([&]() {
+        for (size_t i = 0; i < formulaRuns; i++) {
+            parseFormula(ref, constantFormulas[i % CONSTANT_FORMULA_COUNT].text, parsed, error);
+        }
+    });
+    results.push_back({ "formula_cached", "formulas/s", formulaRuns / (cachedNs / 1e9) });
+    results.push_back({ "formula_uncached", "formulas/s", formulaRuns / (parsedNs / 1e9) });
+
+    fclose(sink);
+
+    // Human-readable summary
+    printf("\n%-28s | %16s | %s\n", "Benchmark", "Value", "Unit");
+    printf("------------------------------------------------------------\n");
+    for (const BenchResult& result : results) {
+        printf("%-28s | %16.3f | %s\n", result.name.c_str(), result.value, result.unit.c_str());
+    }
+    printf("------------------------------------------------------------\n");
 
-    // Use a direct SQL query with the symbol value inline
-    string query = "SELECT Symbol, Charge, Name, AtomicWeight, AtomicNumber FROM dbo.Elements WHERE Symbol = '" + symbol + "'";
-    ret = SQLExecDirect(stmt, (SQLCHAR*)query.c_str(), SQL_NTS);
-    
-    if (!SQL_SUCCEEDED(ret)) {
-        printf("Failed to execute query.\n");
-        show_error(stmt, SQL_HANDLE_STMT);
-        SQLFreeHandle(SQL_HANDLE_STMT, stmt);
-        return;
+    // Machine-readable results
+    FILE* output = outputPath == "-" ? stdout : fopen(outputPath.c_str(), "w");
+    if (output == nullptr) {
+        fprintf(stderr, "Could not open output file '%s'.\n", outputPath.c_str());
+        return false;
+    }
+    fprintf(output, "{\n  \"backend\": %s,\n  \"threads\": %u,\n  \"results\": [\n",
+            jsonQuote(backend.name()).c_str(), max(1u, thread::hardware_concurrency()));
+    for (size_t i = 0; i < results.size(); i++) {
+        fprintf(output, "    {\"name\": %s, \"unit\": %s, \"value\": %.6g}%s\n",
+                jsonQuote(results[i].name).c_str(), jsonQuote(results[i].unit).c_str(), results[i].value,
+                i + 1 < results.size() ? "," : "");
+    }
+    fprintf(output, "  ]\n}\n");
+    if (output != stdout) {
+        fclose(output);
+        printf("Results written to %s\n", outputPath.c_str());
     }
+    return true;
+}
 
-    // Get number of columns
-    SQLSMALLINT columnCount;
-    SQLNumResultCols(stmt, &columnCount);
+// Known answers for --self-test. expected is the exact result, or the
+// start of the error message for a case that must fail.
+struct SelfTestCase {
+    const char* input;
+    const char* expected;
+    bool fails;
+};
 
-    // Define buffer to hold data
-    vector<SQLCHAR*> data(columnCount);
-    vector<SQLLEN> dataLen(columnCount);
-    
-    // Allocate buffers
-    for (int i = 0; i < columnCount; i++) {
-        data[i] = new SQLCHAR[512];
+static const SelfTestCase balanceTests[] = {
+    { "Fe + O2 -> Fe2O3", "4 Fe + 3 O2 -> 2 Fe2O3", false },
+    { "MnO4- + Fe^2+ + H+ -> Mn^2+ + Fe^3+ + H2O", "MnO4- + 5 Fe^2+ + 8 H+ -> Mn^2+ + 5 Fe^3+ + 4 H2O", false },
+    { "C3H8 + O2 -> CO2 + H2O", "C3H8 + 5 O2 -> 3 CO2 + 4 H2O", false },
+    { "H2 -> O2", "cannot be balanced", true },
+    { "H2 + O2 -> H2O + H2O2", "underdetermined", true },
+    { "H2 + O2 + He -> H2O", "'He' takes no part", true },
+    { "Fe + O2 ->", "empty term", true },
+};
+
+// Formula results are the atom counts in symbol order, then the charge
+static const SelfTestCase formulaTests[] = {
+    { "CuSO4.5H2O", "Cu1 H10 O9 S1", false },
+    { "[Fe(CN)6]4-", "C6 Fe1 N6 charge -4", false },
+    { "Ca(OH)2", "Ca1 H2 O2", false },
+    { "H1000000", "H1000000", false },
+    { "(H2O)2147483647", "count too large", true },
+    { "Xq2", "unknown element", true },
+};
+
+// A reverse mass search case: expected must be among the candidates
+struct MassSelfTest {
+    double target;
+    double tolerance;
+    bool ions;
+    const char* symbols;
+    const char* expected;
+};
+
+static const MassSelfTest massTests[] = {
+    { 180.16, 0.02, false, "C H O", "C6H12O6" },
+    { 58.44, 0.01, true, "Na Cl", "NaCl" },
+};
+
+// Function to describe a parsed formula the way formulaTests expects
+static string describeCounts(const ReferenceData& ref, const ParsedFormula& parsed) {
+    vector<string> terms;
+    for (const pair<int, int>& count : parsed.counts) {
+        terms.push_back(ref.elements.rows[count.first].symbol + to_string(count.second));
+    }
+    sort(terms.begin(), terms.end());
+    string text;
+    for (const string& term : terms) {
+        text += (text.empty() ? "" : " ") + term;
     }
+    if (parsed.charge != 0) {
+        text += " charge " + to_string(parsed.charge);
+    }
+    return text;
+}
 
-    // Fetch and display results
-    if (SQL_SUCCEEDED(ret = SQLFetch(stmt))) {
-        // Get column info
-        SQLCHAR columnName[256];
-        SQLSMALLINT columnNameLen;
-        SQLSMALLINT dataType;
-        SQLULEN columnSize;
-        SQLSMALLINT decimalDigits;
-        SQLSMALLINT nullable;
-        
-        // Get data into our buffers
-        SQLLEN dataLen1, dataLen2, dataLen3, dataLen4, dataLen5;
-        SQLCHAR symbolBuf[256] = {0};
-        SQLCHAR chargeBuf[256] = {0};
-        SQLCHAR nameBuf[256] = {0};
-        SQLCHAR weightBuf[256] = {0};
-        SQLCHAR numberBuf[256] = {0};
-        
-        // Get the data row directly
-        SQLGetData(stmt, 1, SQL_C_CHAR, symbolBuf, sizeof(symbolBuf), &dataLen1);
-        SQLGetData(stmt, 2, SQL_C_CHAR, chargeBuf, sizeof(chargeBuf), &dataLen2);
-        SQLGetData(stmt, 3, SQL_C_CHAR, nameBuf, sizeof(nameBuf), &dataLen3);
-        SQLGetData(stmt, 4, SQL_C_CHAR, weightBuf, sizeof(weightBuf), &dataLen4);
-        SQLGetData(stmt, 5, SQL_C_CHAR, numberBuf, sizeof(numberBuf), &dataLen5);
-        
-        // Display data with printf to avoid encoding issues
-        printf("\n--- Element Information ---\n");
+// Function to compare one result with a case, printing the verdict
+static bool checkSelfTest(const char* group, const SelfTestCase& test, bool ok, const string& got) {
+    bool passed = ok != test.fails &&
+                  (test.fails ? got.compare(0, strlen(test.expected), test.expected) == 0 : got == test.expected);
+    if (passed) {
+        printf("PASS %-8s %s\n", group, test.input);
+    } else {
+        printf("FAIL %-8s %s: got %s '%s', expected %s '%s'\n", group, test.input, ok ? "result" : "error",
+               got.c_str(), test.fails ? "error" : "result", test.expected);
+    }
+    return passed;
+}
 
-        // Ensure we have the symbol to display
-        // Check if we got the symbol from the database
-        if (dataLen1 != SQL_NULL_DATA && symbolBuf[0] != '\0') {
-            printf("Symbol:        %s\n", (char*)symbolBuf);
-        } else {
-            // Fall back to the user's input
-            printf("Symbol:        %s\n", symbolDisplay.c_str());
+// Function to run the equation balancer, formula parser and reverse mass
+// search over known answers (--self-test); false when any case fails.
+// The answers assume the atomic weights of the dbo.* seed scripts.
+bool runSelfTests(const ReferenceData& ref) {
+    if (!ref.loaded) {
+        fprintf(stderr, "The self-test needs the reference tables in memory.\n");
+        return false;
+    }
+
+    size_t total = 0, passed = 0;
+    FormulaCache cache(FORMULA_CACHE_SIZE);
+    string error;
+    for (const SelfTestCase& test : balanceTests) {
+        BalancedEquation balanced;
+        bool ok = balanceEquation(ref, cache, test.input, balanced, error);
+        passed += checkSelfTest("balance", test, ok, ok ? formatEquation(balanced) : error);
+        total++;
+    }
+    for (const SelfTestCase& test : formulaTests) {
+        ParsedFormula parsed;
+        bool ok = parseFormula(ref, test.input, parsed, error);
+        passed += checkSelfTest("formula", test, ok, ok ? describeCounts(ref, parsed) : error);
+        total++;
+    }
+    for (const MassSelfTest& test : massTests) {
+        vector<string> symbols;
+        splitWords(test.symbols, symbols);
+        MassSearchSettings settings;
+        settings.tolerance = test.tolerance;
+        settings.threads = 1;
+        vector<MassBlock> blocks, sorted;
+        MassSearchResult result;
+        bool found = false;
+        if (collectMassBlocks(ref, test.ions, symbols, blocks, error) &&
+            searchFormulasByMass(blocks, test.ions, test.target, settings, sorted, result, error)) {
+            for (const MassCandidate& candidate : result.candidates) {
+                found = found || formatMassCandidate(sorted, test.ions, candidate) == test.expected;
+            }
         }
-        
-        printf("Name:          %s\n", dataLen3 == SQL_NULL_DATA ? "NULL" : (char*)nameBuf);
-        printf("Atomic Number: %s\n", dataLen5 == SQL_NULL_DATA ? "NULL" : (char*)numberBuf);
-        printf("Atomic Weight: %s g/mol\n", dataLen4 == SQL_NULL_DATA ? "NULL" : (char*)weightBuf);
-        printf("Charge:        %s\n", dataLen2 == SQL_NULL_DATA ? "NULL" : (char*)chargeBuf);
-    } else if (ret == SQL_NO_DATA) {
-        printf("Element with symbol '%s' not found.\n", symbol.c_str());
-    } else {
-        printf("Error fetching data.\n");
-        show_error(stmt, SQL_HANDLE_STMT);
+        printf("%s mass     %.4f +/- %.4f from %s: %s\n", found ? "PASS" : "FAIL", test.target, test.tolerance,
+               test.symbols, test.expected);
+        passed += found;
+        total++;
     }
 
-    // Clean up
-    SQLFreeHandle(SQL_HANDLE_STMT, stmt);
+    printf("%zu of %zu checks passed.\n", passed, total);
+    return passed == total;
 }
 
-// Function to get ion information (cation or anion)
-bool getIonInfo(SQLHDBC dbc, const string& ionSymbol, bool isCation, double& charge, double& atomicMass) {
-    SQLHSTMT stmt = SQL_NULL_HSTMT;
-    SQLRETURN ret;
-    
-    // Default values in case of error
-    charge = 0.0;
-    atomicMass = 0.0;
+// One action of a recorded menu session
+struct ReplayAction {
+    double at;      // seconds since the session started
+    bool element;   // element lookup, else a molar-mass pair
+    string first;   // element symbol or cation
+    string second;  // anion
+};
 
-    // Allocate statement handle
-    ret = SQLAllocHandle(SQL_HANDLE_STMT, dbc, &stmt);
-    if (!SQL_SUCCEEDED(ret)) {
-        printf("Failed to allocate statement handle.\n");
-        show_error(dbc, SQL_HANDLE_DBC);
+// Function to read "key": number from a flat JSON object on one line
+static bool jsonNumberField(const string& line, const char* key, double& out) {
+    string quotedKey = string("\"") + key + "\"";
+    size_t pos = line.find(quotedKey);
+    if (pos == string::npos) {
         return false;
     }
+    pos = line.find(':', pos + quotedKey.size());
+    if (pos == string::npos) {
+        return false;
+    }
+    char* end;
+    out = strtod(line.c_str() + pos + 1, &end);
+    return end != line.c_str() + pos + 1;
+}
 
-    // Prepare SQL query with inline value - avoid parameter binding
-    string tableName = isCation ? "dbo.Cations" : "dbo.Anions";
-    string query = "SELECT Charge, AtomicWeight FROM " + tableName + " WHERE Symbol = '" + ionSymbol + "'";
-    
-    printf("Executing query: %s\n", query.c_str());
+// Function to read the sessions of a --record file, in recorded order
+static bool loadRecordedSessions(const string& path, vector<vector<ReplayAction>>& sessions) {
+    ifstream input(path);
+    if (!input) {
+        fprintf(stderr, "Could not open recording '%s'.\n", path.c_str());
+        return false;
+    }
+    unordered_map<string, size_t> sessionIndex;
+    string line, session, op;
+    size_t lineNumber = 0;
+    while (getline(input, line)) {
+        lineNumber++;
+        if (line.empty()) {
+            continue;
+        }
+        ReplayAction action;
+        if (!jsonStringField(line, "session", session) || !jsonStringField(line, "op", op) ||
+            !jsonNumberField(line, "at", action.at)) {
+            fprintf(stderr, "Skipping malformed recording line %zu.\n", lineNumber);
+            continue;
+        }
+        action.element = op == "element";
+        if (action.element ? !jsonStringField(line, "symbol", action.first)
+                           : op != "molarmass" || !jsonStringField(line, "cation", action.first) ||
+                                 !jsonStringField(line, "anion", action.second)) {
+            fprintf(stderr, "Skipping unknown action on recording line %zu.\n", lineNumber);
+            continue;
+        }
+        auto inserted = sessionIndex.emplace(session, sessions.size());
+        if (inserted.second) {
+            sessions.emplace_back();
+        }
+        sessions[inserted.first->second].push_back(action);
+    }
+    if (sessions.empty()) {
+        fprintf(stderr, "No sessions recorded in '%s'.\n", path.c_str());
+        return false;
+    }
+    return true;
+}
 
-    ret = SQLExecDirect(stmt, (SQLCHAR*)query.c_str(), SQL_NTS);
-    if (!SQL_SUCCEEDED(ret)) {
-        printf("Failed to execute query.\n");
-        show_error(stmt, SQL_HANDLE_STMT);
-        SQLFreeHandle(SQL_HANDLE_STMT, stmt);
+// Latency samples of one replay worker, in milliseconds
+struct ReplaySamples {
+    vector<double> startup;
+    vector<double> element;
+    vector<double> molarMass;
+    size_t sessions = 0;
+    size_t errors = 0;
+};
+
+// Function to replay recorded menu sessions against the selected backend
+// from several concurrent clients. Each client loops over the recordings,
+// starting every session on a fresh backend the way the menu does (open,
+// then load the tables unless direct is set). Actions keep their recorded
+// think time unless rate (total actions/s) is given, then the report lists
+// startup and per-action latency percentiles.
+bool runReplay(const function<StorageBackend*()>& createBackend, const string& recordingPath,
+               unsigned clients, double seconds, double rate, bool direct) {
+    vector<vector<ReplayAction>> sessions;
+    if (!loadRecordedSessions(recordingPath, sessions)) {
         return false;
     }
+    if (clients == 0) {
+        clients = 1;
+    }
 
-    // Use SQLGetData instead of binding
-    if (SQL_SUCCEEDED(ret = SQLFetch(stmt))) {
-        SQLCHAR chargeData[50] = {0};
-        SQLCHAR weightData[50] = {0};
-        SQLLEN lenCharge, lenWeight;
-        
-        // Get data for each column
-        SQLGetData(stmt, 1, SQL_C_CHAR, chargeData, sizeof(chargeData), &lenCharge);
-        SQLGetData(stmt, 2, SQL_C_CHAR, weightData, sizeof(weightData), &lenWeight);
-        
-        // Display the raw data
-        printf("Raw charge data: '%s'\n", (lenCharge == SQL_NULL_DATA ? "NULL" : (char*)chargeData));
-        printf("Raw weight data: '%s'\n", (lenWeight == SQL_NULL_DATA ? "NULL" : (char*)weightData));
-        
-        // Convert to needed types
-        if (lenCharge != SQL_NULL_DATA) {
-            try {
-                charge = atof((char*)chargeData);
-                printf("Retrieved charge: %.2f\n", charge);
-            } catch (...) {
-                printf("Warning: Could not convert charge value to a number\n");
-                charge = isCation ? 1.0 : -1.0; // Default values
-                printf("Using default charge: %.2f\n", charge);
-            }
-        } else {
-            printf("Warning: Charge is NULL\n");
-            charge = isCation ? 1.0 : -1.0; // Default values
-            printf("Using default charge: %.2f\n", charge);
-        }
-        
-        if (lenWeight != SQL_NULL_DATA) {
-            try {
-                atomicMass = atof((char*)weightData);
-                printf("Retrieved atomic weight: %.4f\n", atomicMass);
-            } catch (...) {
-                printf("Warning: Could not convert atomic weight value to a number\n");
-                atomicMass = 1.0; // Default value
-                printf("Using default atomic weight: %.4f\n", atomicMass);
+#ifdef _WIN32
+    const char* nullDevice = "NUL";
+#else
+    const char* nullDevice = "/dev/null";
+#endif
+    FILE* sink = fopen(nullDevice, "w");
+    if (sink == nullptr) {
+        fprintf(stderr, "Could not open %s.\n", nullDevice);
+        return false;
+    }
+
+    // Backends report every open and load; keep that out of the results
+    FILE* savedStatus = statusOut;
+    statusOut = sink;
+
+    auto start = chrono::steady_clock::now();
+    auto deadline = start + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(seconds));
+    auto elapsedMs = [](chrono::steady_clock::time_point since) {
+        return chrono::duration<double, milli>(chrono::steady_clock::now() - since).count();
+    };
+
+    vector<ReplaySamples> samples(clients);
+    vector<thread> workers;
+    for (unsigned client = 0; client < clients; client++) {
+        workers.emplace_back([&, client]() {
+            ReplaySamples& mine = samples[client];
+            auto next = chrono::steady_clock::now();
+            auto interval = chrono::duration_cast<chrono::steady_clock::duration>(
+                chrono::duration<double>(rate > 0 ? clients / rate : 0.0));
+
+            for (size_t turn = client; chrono::steady_clock::now() < deadline; turn++) {
+                const vector<ReplayAction>& actions = sessions[turn % sessions.size()];
+
+                auto opening = chrono::steady_clock::now();
+                unique_ptr<StorageBackend> backend(createBackend());
+                ReferenceData ref;
+                if (!backend->open()) {
+                    mine.errors++;
+                    this_thread::sleep_for(chrono::milliseconds(100));
+                    continue;
+                }
+                if (!direct) {
+                    backend->loadReferenceData(ref);
+                }
+                mine.startup.push_back(elapsedMs(opening));
+                mine.sessions++;
+
+                auto sessionStart = chrono::steady_clock::now();
+                for (const ReplayAction& action : actions) {
+                    if (rate > 0) {
+                        next = max(next + interval, chrono::steady_clock::now() - interval);
+                    } else {
+                        next = sessionStart + chrono::duration_cast<chrono::steady_clock::duration>(
+                                                  chrono::duration<double>(action.at));
+                    }
+                    if (next >= deadline) {
+                        break;
+                    }
+                    this_thread::sleep_until(next);
+
+                    auto started = chrono::steady_clock::now();
+                    bool ok;
+                    if (action.element) {
+                        ElementRecord element;
+                        ok = lookupElement(*backend, ref, action.first, element) == LookupFound;
+                        mine.element.push_back(elapsedMs(started));
+                    } else {
+                        future<IonLookup> cation = lookupIon(*backend, ref, action.first, true);
+                        future<IonLookup> anion = lookupIon(*backend, ref, action.second, false);
+                        IonLookup cationResult = cation.get();
+                        IonLookup anionResult = anion.get();
+                        IonicFormula formula;
+                        ok = cationResult.status == LookupFound && anionResult.status == LookupFound &&
+                             balanceIonicCompound(cationResult.ion.charge, cationResult.ion.atomicWeight,
+                                                  anionResult.ion.charge, anionResult.ion.atomicWeight, formula);
+                        mine.molarMass.push_back(elapsedMs(started));
+                    }
+                    if (!ok) {
+                        mine.errors++;
+                    }
+                }
+                backend->close();
             }
-        } else {
-            printf("Warning: Atomic weight is NULL\n");
-            atomicMass = 1.0; // Default value
-            printf("Using default atomic weight: %.4f\n", atomicMass);
-        }
-        
-        SQLFreeHandle(SQL_HANDLE_STMT, stmt);
-        return true;
-    } else if (ret == SQL_NO_DATA) {
-        printf("%s with symbol '%s' not found.\n", (isCation ? "Cation" : "Anion"), ionSymbol.c_str());
-    } else {
-        printf("Error fetching data.\n");
-        show_error(stmt, SQL_HANDLE_STMT);
+        });
     }
+    for (thread& worker : workers) {
+        worker.join();
+    }
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
 
-    SQLFreeHandle(SQL_HANDLE_STMT, stmt);
-    return false;
+    statusOut = savedStatus;
+    fclose(sink);
+
+    ReplaySamples total;
+    for (ReplaySamples& client : samples) {
+        total.startup.insert(total.startup.end(), client.startup.begin(), client.startup.end());
+        total.element.insert(total.element.end(), client.element.begin(), client.element.end());
+        total.molarMass.insert(total.molarMass.end(), client.molarMass.begin(), client.molarMass.end());
+        total.sessions += client.sessions;
+        total.errors += client.errors;
+    }
+    size_t actions = total.element.size() + total.molarMass.size();
+
+    ResultWriter writer(outputFormat);
+    writer.beginRecord("replay", "Replay Summary");
+    writer.field("recorded", "Recordings", intValue((long)sessions.size()));
+    writer.field("clients", "Clients", intValue(clients));
+    writer.field("sessions", "Sessions Run", intValue((long)total.sessions));
+    writer.field("actions", "Actions", intValue((long)actions));
+    writer.field("throughput", "Throughput", numberValue(actions / elapsed, 1), " actions/s");
+    writer.field("errorRate", "Error Rate", numberValue(actions > 0 ? 100.0 * total.errors / actions : 0.0, 2), " %");
+    writer.endRecord();
+
+    writer.beginTable("latency", "Latency (ms)", { { "phase", "Phase", 10 }, { "count", "Count", 8 },
+                                                   { "p50", "p50", 10 }, { "p90", "p90", 10 },
+                                                   { "p99", "p99", 10 }, { "max", "Max", 10 } });
+    pair<const char*, vector<double>*> phases[] = {
+        { "startup", &total.startup }, { "element", &total.element }, { "molarmass", &total.molarMass }
+    };
+    for (auto& phase : phases) {
+        vector<double>& values = *phase.second;
+        writer.cell(textValue(phase.first));
+        writer.cell(intValue((long)values.size()));
+        writer.cell(numberValue(percentile(values, 50), 3));
+        writer.cell(numberValue(percentile(values, 90), 3));
+        writer.cell(numberValue(percentile(values, 99), 3));
+        writer.cell(numberValue(values.empty() ? 0.0 : *max_element(values.begin(), values.end()), 3));
+        writer.endRow();
+    }
+    writer.endTable();
+    return true;
 }
 
-// Function to list available ions
-void listAvailableIons(SQLHDBC dbc, bool isCation) {
-    SQLHSTMT stmt = SQL_NULL_HSTMT;
-    SQLRETURN ret;
+// Main program function
+int main(int argc, char* argv[]) {
+    ReferenceData ref;
+    FormulaCache formulas(FORMULA_CACHE_SIZE);
+    CompoundIndex compounds;
+    ColumnStore columns;
+    SymbolSearch search;
+    int choice;
     
-    // Allocate statement handle
-    ret = SQLAllocHandle(SQL_HANDLE_STMT, dbc, &stmt);
-    if (!SQL_SUCCEEDED(ret)) {
-        printf("Failed to allocate statement handle.\n");
-        show_error(dbc, SQL_HANDLE_DBC);
-        return;
+    // --seed <dir> serves everything from the dbo.* seed scripts instead of SQL Server,
+    // --format <table|json|csv> selects how results are written,
+    // --trace prints per-phase trace lines and --stats a latency summary on exit,
+    // --refresh <seconds> re-checks the cached tables for changes at that interval,
+    // --snapshot <file> serves the tables from an exported binary snapshot,
+    // --record <file> appends each menu lookup to a session recording
+    string seedDirectory, snapshotPath, recordPath;
+    unsigned refreshSeconds = 0;
+    vector<string> args;
+    const char* traceEnv = getenv("CHEMDB_TRACE");
+    traceEnabled = traceEnv != nullptr && strcmp(traceEnv, "0") != 0;
+    for (int i = 1; i < argc; i++) {
+        if (string(argv[i]) == "--seed" && i + 1 < argc) {
+            seedDirectory = argv[++i];
+        } else if (string(argv[i]) == "--snapshot" && i + 1 < argc) {
+            snapshotPath = argv[++i];
+        } else if (string(argv[i]) == "--format" && i + 1 < argc) {
+            if (!parseOutputFormat(argv[++i], outputFormat)) {
+                fprintf(stderr, "Unknown format '%s' (expected table, json or csv).\n", argv[i]);
+                return 1;
+            }
+        } else if (string(argv[i]) == "--refresh" && i + 1 < argc) {
+            refreshSeconds = (unsigned)atoi(argv[++i]);
+        } else if (string(argv[i]) == "--record" && i + 1 < argc) {
+            recordPath = argv[++i];
+        } else if (string(argv[i]) == "--trace") {
+            traceEnabled = true;
+        } else if (string(argv[i]) == "--stats") {
+            atexit([]() { printTraceSummary(stderr); });
+        } else {
+            args.push_back(argv[i]);
+        }
     }
     
-    // Prepare SQL query
-    string tableName = isCation ? "dbo.Cations" : "dbo.Anions";
-    string query = "SELECT Symbol, Name FROM " + tableName + " ORDER BY Symbol";
-    
-    ret = SQLExecDirect(stmt, (SQLCHAR*)query.c_str(), SQL_NTS);
-    if (!SQL_SUCCEEDED(ret)) {
-        printf("Failed to execute query.\n");
-        show_error(stmt, SQL_HANDLE_STMT);
-        SQLFreeHandle(SQL_HANDLE_STMT, stmt);
-        return;
+    function<StorageBackend*()> createBackend = [&]() -> StorageBackend* {
+        if (!snapshotPath.empty()) {
+            return new SnapshotBackend(snapshotPath);
+        }
+        if (seedDirectory.empty()) {
+            return new OdbcBackend();
+        }
+        return new SeedFileBackend(seedDirectory);
+    };
+    // Extra connections behind the primary one open without status output
+    function<StorageBackend*()> createPooledBackend = [&]() -> StorageBackend* {
+        if (snapshotPath.empty() && seedDirectory.empty()) {
+            return new OdbcBackend(true);
+        }
+        return createBackend();
+    };
+    unique_ptr<StorageBackend> backend(createBackend());
+    // Every mode but the menu may write its results to stdout, so keep
+    // connection and loading messages out of that stream
+    if (outputFormat != OutputTable || !args.empty()) {
+        statusOut = stderr;
     }
     
-    // Variables to hold data
-    SQLCHAR symbol[50] = {0};
-    SQLCHAR name[100] = {0};
-    SQLLEN lenSymbol, lenName;
-    
-    // Display header
-    printf("\nAvailable %s:\n", (isCation ? "Cations" : "Anions"));
-    printf("------------------------\n");
-    printf("%-10s | %s\n", "Symbol", "Name");
-    printf("------------------------\n");
-    
-    // Fetch and display results
-    while (SQL_SUCCEEDED(ret = SQLFetch(stmt))) {
-        // Get column data
-        SQLGetData(stmt, 1, SQL_C_CHAR, symbol, sizeof(symbol), &lenSymbol);
-        SQLGetData(stmt, 2, SQL_C_CHAR, name, sizeof(name), &lenName);
-        
-        // Print data
-        printf("%-10s | %s\n", 
-            (lenSymbol == SQL_NULL_DATA ? "NULL" : (char*)symbol),
-            (lenName == SQL_NULL_DATA ? "NULL" : (char*)name));
+    // Non-interactive batch pricing: --batch <input.csv|.jsonl> <output|-> [threads]
+    if (args.size() >= 3 && args[0] == "--batch") {
+        unsigned threads = 0;
+        if (args.size() >= 4 && !parseCountArgument(args[3], "thread count", threads)) {
+            return 1;
+        }
+        if (!backend->open()) {
+            return 1;
+        }
+        // A mapped snapshot is priced in place, without copying its tables
+        bool ok = (backend->lookupsInPlace() || backend->loadReferenceData(ref)) &&
+                  runBatch(*backend, ref, args[1], args[2], threads);
+        backend->close();
+        return ok ? 0 : 1;
     }
     
-    printf("------------------------\n");
-    
-    // Clean up
-    SQLFreeHandle(SQL_HANDLE_STMT, stmt);
-}
-
-// Function to calculate molar mass of ionic compound
-void calculateMolarMass(SQLHDBC dbc) {
-    string cationSymbol, anionSymbol;
-    double cationCharge = 0.0, cationMass = 0.0, anionCharge = 0.0, anionMass = 0.0;
-    
-    printf("\n=== Ionic Compound Molar Mass Calculator ===\n");
-    
-    // List available cations
-    listAvailableIons(dbc, true);
-    
-    // Get cation info
-    printf("Enter cation symbol: ");
-    cin >> cationSymbol;
+    // Bulk load: --load [--replace] [--check] <seed-or-csv>...
+    if (args.size() >= 2 && args[0] == "--load") {
+        bool replace = false, checkOnly = false;
+        vector<string> paths;
+        for (size_t i = 1; i < args.size(); i++) {
+            if (args[i] == "--replace") {
+                replace = true;
+            } else if (args[i] == "--check") {
+                checkOnly = true;
+            } else {
+                paths.push_back(args[i]);
+            }
+        }
+        return !paths.empty() && runBulkLoad(paths, replace, checkOnly) ? 0 : 1;
+    }
     
-    // Store original symbol for display
-    string cationSymbolDisplay = cationSymbol;
+    // Isotopic patterns: --isotopes <formulas> <output|-> [threshold] [threads]
+    if (args.size() >= 3 && args[0] == "--isotopes") {
+        double threshold = args.size() >= 4 ? atof(args[3].c_str()) : 0.0;
+        unsigned threads = 0;
+        if (args.size() >= 5 && !parseCountArgument(args[4], "thread count", threads)) {
+            return 1;
+        }
+        if (!backend->open()) {
+            return 1;
+        }
+        bool ok = backend->loadReferenceData(ref) && runIsotopeBatch(ref, args[1], args[2], threshold, threads);
+        backend->close();
+        return ok ? 0 : 1;
+    }
     
-    // Convert to uppercase for database lookup only
-    for (char &c : cationSymbol) {
-        c = toupper(c);
+    // Filtered scans: --query <elements|cations|anions> [field=low..high]... [order|desc <field>] [limit <n>]
+    if (args.size() >= 2 && args[0] == "--query") {
+        if (!backend->open()) {
+            return 1;
+        }
+        string error;
+        bool ok = backend->loadReferenceData(ref);
+        if (ok && !runTableScan(ref, columns, args[1], vector<string>(args.begin() + 2, args.end()), error)) {
+            fprintf(stderr, "Could not filter: %s\n", error.c_str());
+            ok = false;
+        }
+        backend->close();
+        return ok ? 0 : 1;
     }
     
-    if (!getIonInfo(dbc, cationSymbol, true, cationCharge, cationMass)) {
-        printf("Could not calculate molar mass due to missing cation information.\n");
-        return;
+    // Reverse mass search: --mass-search <mass> <tolerance> <elements|ions> [symbols...]
+    if (args.size() >= 4 && args[0] == "--mass-search") {
+        if (!backend->open()) {
+            return 1;
+        }
+        bool ok = backend->loadReferenceData(ref) && runMassSearch(ref, args);
+        backend->close();
+        return ok ? 0 : 1;
     }
     
-    // Verify cation charge is positive
-    if (cationCharge <= 0) {
-        printf("Error: Cation charge must be positive. The database shows %s with charge %.2f\n", 
-               cationSymbol.c_str(), cationCharge);
-        return;
+    // Snapshot export: --export-snapshot <file>
+    if (args.size() >= 2 && args[0] == "--export-snapshot") {
+        if (!backend->open()) {
+            return 1;
+        }
+        string error;
+        auto start = chrono::steady_clock::now();
+        // Read the file back so a bad write is caught here, not by readers
+        bool ok = backend->loadReferenceData(ref) && writeSnapshot(ref, args[1], error) &&
+                  verifySnapshotFile(args[1], error);
+        backend->close();
+        if (!ok) {
+            fprintf(stderr, "Could not export snapshot: %s\n", error.c_str());
+            return 1;
+        }
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        fprintf(statusOut, "Wrote snapshot '%s' in %.2f ms.\n", args[1].c_str(), ms);
+        return 0;
     }
     
-    // List available anions
-    listAvailableIons(dbc, false);
+    // Snapshot check, checksum included: --verify-snapshot <file>
+    if (args.size() >= 2 && args[0] == "--verify-snapshot") {
+        string error;
+        if (!verifySnapshotFile(args[1], error)) {
+            fprintf(stderr, "Snapshot check failed: %s\n", error.c_str());
+            return 1;
+        }
+        fprintf(statusOut, "Snapshot '%s' is intact.\n", args[1].c_str());
+        return 0;
+    }
     
-    // Get anion info
-    printf("Enter anion symbol: ");
-    cin >> anionSymbol;
+    // Compile-time element table: --emit-element-table <output|->
+    if (args.size() >= 2 && args[0] == "--emit-element-table") {
+        if (!backend->open()) {
+            return 1;
+        }
+        bool ok = backend->loadReferenceData(ref) && writeStaticElementTable(ref, args[1]);
+        backend->close();
+        return ok ? 0 : 1;
+    }
     
-    // Store original symbol for display
-    string anionSymbolDisplay = anionSymbol;
+    // Equation balancing: --balance <equations> <output|->
+    if (args.size() >= 3 && args[0] == "--balance") {
+        if (!backend->open()) {
+            return 1;
+        }
+        bool ok = backend->loadReferenceData(ref) && runBalanceBatch(ref, args[1], args[2]);
+        backend->close();
+        return ok ? 0 : 1;
+    }
     
-    // Convert to uppercase for database lookup only
-    for (char &c : anionSymbol) {
-        c = toupper(c);
+    // Temperature sweep: --thermo-sweep <reactions> <minK> <maxK> <steps> <output|->
+    if (args.size() >= 6 && args[0] == "--thermo-sweep") {
+        double minTemp = 0.0, maxTemp = 0.0;
+        unsigned steps = 0;
+        if (!parseNumberArgument(args[2], "minimum temperature", minTemp) ||
+            !parseNumberArgument(args[3], "maximum temperature", maxTemp) ||
+            !parseCountArgument(args[4], "step count", steps)) {
+            return 1;
+        }
+        if (minTemp <= 0.0 || maxTemp < minTemp) {
+            fprintf(stderr, "Temperatures must be above 0 K with the minimum first.\n");
+            return 1;
+        }
+        if (!backend->open()) {
+            return 1;
+        }
+        bool ok = backend->loadReferenceData(ref) && runThermoSweep(ref, args[1], minTemp, maxTemp, steps, args[5]);
+        backend->close();
+        return ok ? 0 : 1;
     }
     
-    if (!getIonInfo(dbc, anionSymbol, false, anionCharge, anionMass)) {
-        printf("Could not calculate molar mass due to missing anion information.\n");
-        return;
+    // Formula pricing: --formulas <input> <output|->
+    if (args.size() >= 3 && args[0] == "--formulas") {
+        if (!backend->open()) {
+            return 1;
+        }
+        bool ok = backend->loadReferenceData(ref) && runFormulaBatch(ref, args[1], args[2]);
+        backend->close();
+        return ok ? 0 : 1;
     }
     
-    // Verify anion charge is negative
-    if (anionCharge >= 0) {
-        printf("Error: Anion charge must be negative. The database shows %s with charge %.2f\n",
-               anionSymbol.c_str(), anionCharge);
-        return;
+    // One-shot results: --list <elements|cations|anions>, --element <symbol>,
+    // --molar-mass <cation> <anion>
+    if ((args.size() >= 2 && (args[0] == "--list" || args[0] == "--element")) ||
+        (args.size() >= 3 && args[0] == "--molar-mass")) {
+        if (!backend->open()) {
+            return 1;
+        }
+        // A mapped snapshot answers in place, without copying its tables
+        if (!backend->lookupsInPlace()) {
+            backend->loadReferenceData(ref);
+        }
+
+        // Without cached tables the two ion lookups run on their own connections
+        PipelinedBackend pipelined(createPooledBackend, 2, false);
+        StorageBackend* active = backend.get();
+        if (!ref.loaded && !backend->lookupsInPlace() && args[0] == "--molar-mass") {
+            pipelined.open();
+            active = &pipelined;
+        }
+
+        vector<string> symbols(args.begin() + 1, args.end());
+        for (string& symbol : symbols) {
+            for (char &c : symbol) {
+                c = toupper(c);
+            }
+        }
+
+        bool ok = true;
+        if (args[0] == "--list") {
+            if (symbols[0] == "ELEMENTS") {
+                listAvailableElements(*backend, ref);
+            } else if (symbols[0] == "CATIONS" || symbols[0] == "ANIONS") {
+                listAvailableIons(*backend, ref, symbols[0] == "CATIONS");
+            } else {
+                fprintf(stderr, "Unknown table '%s' (expected elements, cations or anions).\n", args[1].c_str());
+                ok = false;
+            }
+        } else if (args[0] == "--element") {
+            ElementRecord element;
+            LookupStatus status = lookupElement(*backend, ref, symbols[0], element);
+            if (status == LookupFound) {
+                printElementRecord(element, args[1]);
+            } else {
+                fprintf(stderr, "Element with symbol '%s' not found.\n", symbols[0].c_str());
+                ok = false;
+            }
+        } else {
+            future<IonLookup> cationLookup = lookupIon(*active, ref, symbols[0], true);
+            future<IonLookup> anionLookup = lookupIon(*active, ref, symbols[1], false);
+            IonRecord cation, anion;
+            double charge, mass;
+            ok = acceptIonLookup(cationLookup.get(), ref, symbols[0], true, charge, mass);
+            cation.symbol = symbols[0];
+            cation.charge = (int)charge;
+            cation.atomicWeight = mass;
+            ok = acceptIonLookup(anionLookup.get(), ref, symbols[1], false, charge, mass) && ok;
+            anion.symbol = symbols[1];
+            anion.charge = (int)charge;
+            anion.atomicWeight = mass;
+            if (ok && (cation.charge <= 0 || anion.charge >= 0)) {
+                fprintf(stderr, "Charges %d and %d cannot balance.\n", cation.charge, anion.charge);
+                ok = false;
+            }
+            if (ok) {
+                reportMolarMass(cation, args[1], anion, args[2]);
+            }
+        }
+        pipelined.close();
+        backend->close();
+        return ok ? 0 : 1;
     }
     
-    // Following the logic from CalcMM function
-    double totalMolarMass = 0.0;
+    // Benchmark suite: --bench [results.json|-]
+    if (args.size() >= 1 && args[0] == "--bench") {
+        if (!backend->open()) {
+            return 1;
+        }
+        bool ok = backend->loadReferenceData(ref) &&
+                  runBenchmarks(*backend, ref, createBackend, args.size() >= 2 ? args[1] : "bench_results.json");
+        backend->close();
+        return ok ? 0 : 1;
+    }
     
-    // Convert charges to their absolute values for calculation
-    int cationChargeAbs = abs((int)cationCharge);
-    int anionChargeAbs = abs((int)anionCharge);
+    // Known-answer checks: --self-test (pair with --seed .)
+    if (args.size() >= 1 && args[0] == "--self-test") {
+        if (!backend->open()) {
+            return 1;
+        }
+        bool ok = backend->loadReferenceData(ref) && runSelfTests(ref);
+        backend->close();
+        return ok ? 0 : 1;
+    }
     
-    // Check if charges are equal
-    if (cationChargeAbs == anionChargeAbs) {
-        // Simple 1:1 compound
-        totalMolarMass = cationMass + anionMass;
-        
-        // Display the result
-        printf("\n--- Calculation Results ---\n");
-        printf("Cation:        %s\n", cationSymbolDisplay.c_str());
-        printf("Charge:        %.2f\n", cationCharge);
-        printf("Atomic Weight: %.4f g/mol\n", cationMass);
-        printf("\n");
-        printf("Anion:         %s\n", anionSymbolDisplay.c_str());
-        printf("Charge:        %.2f\n", anionCharge);
-        printf("Atomic Weight: %.4f g/mol\n", anionMass);
-        
-        printf("\nThe charges have the same magnitude, so we have a 1:1 ratio.\n");
-        printf("\nChemical formula: %s%s\n", cationSymbolDisplay.c_str(), anionSymbolDisplay.c_str());
-        printf("Molar mass calculation: %.4f g/mol + %.4f g/mol = %.4f g/mol\n", 
-               cationMass, anionMass, totalMolarMass);
-    } else {
-        // Need to cross-multiply charges for balancing
-        int cationCount = anionChargeAbs;
-        int anionCount = cationChargeAbs;
-        
-        // Simplify the ratio if possible (find GCD)
-        int a = cationCount;
-        int b = anionCount;
-        while (b != 0) {
-            int temp = b;
-            b = a % b;
-            a = temp;
-        }
-        int gcd = a;
-        
-        if (gcd > 1) {
-            cationCount /= gcd;
-            anionCount /= gcd;
+    // Load replay: --replay <recording> [--sessions N] [--seconds S] [--rate R] [--direct]
+    if (args.size() >= 2 && args[0] == "--replay") {
+        unsigned clients = 4;
+        double seconds = 10.0, rate = 0.0;
+        bool direct = false;
+        for (size_t i = 2; i < args.size(); i++) {
+            if (args[i] == "--sessions" && i + 1 < args.size()) {
+                if (!parseCountArgument(args[++i], "session count", clients)) {
+                    return 1;
+                }
+            } else if (args[i] == "--seconds" && i + 1 < args.size()) {
+                seconds = atof(args[++i].c_str());
+            } else if (args[i] == "--rate" && i + 1 < args.size()) {
+                rate = atof(args[++i].c_str());
+            } else if (args[i] == "--direct") {
+                direct = true;
+            }
         }
-        
-        // Calculate total molar mass according to your formula
-        totalMolarMass = (anionChargeAbs * cationMass) + (cationChargeAbs * anionMass);
-        
-        // Display the result
-        printf("\n--- Calculation Results ---\n");
-        printf("Cation:        %s\n", cationSymbol.c_str());
-        printf("Charge:        %.2f\n", cationCharge);
-        printf("Atomic Weight: %.4f g/mol\n", cationMass);
-        printf("\n");
-        printf("Anion:         %s\n", anionSymbol.c_str());
-        printf("Charge:        %.2f\n", anionCharge);
-        printf("Atomic Weight: %.4f g/mol\n", anionMass);
-        
-        printf("\nCharge Balancing:\n");
-        printf("To balance charges (%.2f and %.2f), we need:\n", cationCharge, anionCharge);
-        printf("- %d %s ions (total charge: %.2f)\n", cationCount, cationSymbolDisplay.c_str(), cationCount * cationCharge);
-        printf("- %d %s ions (total charge: %.2f)\n", anionCount, anionSymbolDisplay.c_str(), anionCount * anionCharge);
-        printf("Total charge: %.2f (should be 0)\n", (cationCount * cationCharge) + (anionCount * anionCharge));
-        
-        printf("\nChemical formula: ");
-        if (cationCount > 1) 
-            printf("%s%d", cationSymbolDisplay.c_str(), cationCount);
-        else 
-            printf("%s", cationSymbolDisplay.c_str());
-        
-        if (anionCount > 1) 
-            printf("%s%d", anionSymbolDisplay.c_str(), anionCount);
-        else 
-            printf("%s", anionSymbolDisplay.c_str());
-        
-        printf("\n");
-        
-        printf("Molar mass calculation: ");
-        printf("(%.4f g/mol x %d) + ", cationMass, cationCount);
-        printf("(%.4f g/mol x %d) = ", anionMass, anionCount);
-        printf("%.4f g/mol\n", totalMolarMass);
+        return runReplay(createBackend, args[1], clients, seconds, rate, direct) ? 0 : 1;
     }
-}
+    
+    // Query daemon: --serve <socket-path> [workers] [connections]
+    if (args.size() >= 2 && args[0] == "--serve") {
+        unsigned workers = 0, connections = 4;
+        if ((args.size() >= 3 && !parseCountArgument(args[2], "worker count", workers)) ||
+            (args.size() >= 4 && !parseCountArgument(args[3], "connection count", connections))) {
+            return 1;
+        }
+        if (!backend->open()) {
+            return 1;
+        }
+        if (!backend->lookupsInPlace()) {
+            backend->loadReferenceData(ref);
+        }
 
-// Main program function
-int main() {
-    SQLHENV env = SQL_NULL_HENV;
-    SQLHDBC dbc = SQL_NULL_HDBC;
-    int choice;
+        // Without cached tables the workers share pre-opened connections
+        ConnectionPool pool;
+        if (!ref.loaded && !backend->lookupsInPlace() && pool.open(connections, []() { return new OdbcBackend(true); }) == 0) {
+            fprintf(stderr, "Could not open any pooled connections.\n");
+            backend->close();
+            return 1;
+        }
+        ReferenceStore store;
+        store.publish(make_shared<const ReferenceData>(std::move(ref)));
+        bool ok = runServer(store, *backend, refreshSeconds, pool, args[1], workers);
+        pool.close();
+        backend->close();
+        return ok ? 0 : 1;
+    }
     
     printf("=== Chemical Database Application ===\n");
     
-    // Connect to database
-    if (!connectToDatabase(env, dbc)) {
-        printf("Press Enter to exit...");
-        getchar();
-        return 1;
+    SessionRecorder recorder;
+    if (!recordPath.empty()) {
+        if (!recorder.open(recordPath)) {
+            fprintf(stderr, "Could not open recording '%s'.\n", recordPath.c_str());
+            return 1;
+        }
+        sessionRecorder = &recorder;
+    }
+    
+    // Connect to the data source in the background while the menu is shown.
+    // Its messages are held back and printed once the first choice is made,
+    // which is also when the menu waits for the connection.
+    FILE* savedStatus = statusOut;
+    FILE* startupLog = tmpfile();
+    if (startupLog != nullptr) {
+        statusOut = startupLog;
     }
+    future<bool> startup = async(launch::async, [&]() {
+        if (!backend->open()) {
+            return false;
+        }
+        // Cache the small reference tables so lookups skip the server
+        if (backend->loadReferenceData(ref)) {
+            checkStaticElements(ref);
+        }
+        return true;
+    });
+
+    // Otherwise overlap lookups on extra connections and prefetch listings
+    PipelinedBackend pipelined(createPooledBackend, 4, true);
+    StorageBackend* active = backend.get();
+    auto finishStartup = [&]() {
+        bool opened = startup.get();
+        statusOut = savedStatus;
+        if (startupLog != nullptr) {
+            if (ftell(startupLog) > 0) {
+                fputc('\n', statusOut);
+            }
+            rewind(startupLog);
+            char text[512];
+            size_t length;
+            while ((length = fread(text, 1, sizeof(text), startupLog)) > 0) {
+                fwrite(text, 1, length, statusOut);
+            }
+            fclose(startupLog);
+        }
+        if (opened && !ref.loaded) {
+            pipelined.open();
+            active = &pipelined;
+        }
+        return opened;
+    };
     
     // Main menu loop
+    auto refreshDue = chrono::steady_clock::now() + chrono::seconds(refreshSeconds);
     while (true) {
+        // Pick up table changes between actions; the menu owns its tables,
+        // so they are patched in place rather than through a snapshot
+        if (refreshSeconds > 0 && !startup.valid() && ref.loaded && chrono::steady_clock::now() >= refreshDue) {
+            RefreshResult result;
+            if (backend->refreshReferenceData(ref, result) && result.any()) {
+                ref.generation++;
+                applyRefresh(ref, result, compounds, search);
+                printf("\nRefreshed %zu reference rows.\n", refreshedRows(ref, result));
+            }
+            refreshDue = chrono::steady_clock::now() + chrono::seconds(refreshSeconds);
+        }
+
         printf("\n=== Main Menu ===\n");
         printf("1. Look up element information\n");
         printf("2. Calculate ionic compound molar mass\n");
-        printf("3. Exit\n");
-        printf("Enter your choice (1-3): ");
+        printf("3. Calculate formula molar mass\n");
+        printf("4. Find ionic compounds by molar mass\n");
+        printf("5. Calculate reaction thermodynamics\n");
+        printf("6. Calculate isotopic pattern\n");
+        printf("7. Balance a chemical equation\n");
+        printf("8. Find formulas for a measured mass\n");
+        printf("9. Filter elements and ions\n");
+        printf("10. Exit\n");
+        printf("Enter your choice (1-10): ");
         
         // Validate input
         if (!(cin >> choice)) {
@@ -600,26 +9459,52 @@ int main() {
             continue;
         }
         
+        if (startup.valid() && !finishStartup()) {
+            printf("Press Enter to exit...");
+            cin.ignore();
+            getchar();
+            return 1;
+        }
+        
         // Process choice
         switch (choice) {
             case 1:
-                getElementInfo(dbc);
+                getElementInfo(*active, ref, search);
                 break;
             case 2:
-                calculateMolarMass(dbc);
+                calculateMolarMass(*active, ref, search);
                 break;
             case 3:
-                printf("Disconnecting from database...\n");
-                SQLDisconnect(dbc);
-                SQLFreeHandle(SQL_HANDLE_DBC, dbc);
-                SQLFreeHandle(SQL_HANDLE_ENV, env);
+                calculateFormulaMass(ref, formulas);
+                break;
+            case 4:
+                findCompoundsByMass(ref, compounds);
+                break;
+            case 5:
+                calculateReactionThermo(ref, formulas);
+                break;
+            case 6:
+                calculateIsotopePattern(ref, formulas);
+                break;
+            case 7:
+                balanceEquationPrompt(ref, formulas);
+                break;
+            case 8:
+                findFormulasByMass(ref);
+                break;
+            case 9:
+                filterTablesPrompt(ref, columns);
+                break;
+            case 10:
+                pipelined.close();
+                backend->close();
                 printf("Thank you for using the Chemical Database Application. Goodbye!\n");
                 printf("Press Enter to exit...");
                 cin.ignore();
                 getchar();
                 return 0;
             default:
-                printf("Invalid choice. Please enter a number between 1 and 3.\n");
+                printf("Invalid choice. Please enter a number between 1 and 10.\n");
         }
         
         // Clear input buffer